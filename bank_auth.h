@@ -0,0 +1,316 @@
+// PIN hashing and per-session verified-credential caching
+
+#ifndef BANK_AUTH_H
+#define BANK_AUTH_H
+
+#include <stdint.h>
+#include "bank_common.h"
+
+#define SHA256_DIGEST_LENGTH 32
+#ifndef PIN_HASH_ITERATIONS
+#define PIN_HASH_ITERATIONS 100000 // PBKDF2 rounds; one verification takes about 0.1 s
+#endif
+#define CREDENTIAL_CACHE_SIZE 4
+#define CREDENTIAL_CACHE_TTL 300 // Seconds a verified PIN is trusted within a session
+
+// SHA-256 (FIPS 180-4)
+typedef struct
+{
+    uint32_t state[8];
+    uint64_t length;
+    unsigned char block[64];
+    size_t used;
+} Sha256;
+
+static const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+void sha256Transform(Sha256 *ctx, const unsigned char *data)
+{
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+    {
+        w[i] = (uint32_t)data[i * 4] << 24 | (uint32_t)data[i * 4 + 1] << 16 |
+               (uint32_t)data[i * 4 + 2] << 8 | data[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++)
+    {
+        uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = ctx->state[0], b = ctx->state[1], c = ctx->state[2], d = ctx->state[3];
+    uint32_t e = ctx->state[4], f = ctx->state[5], g = ctx->state[6], h = ctx->state[7];
+    for (int i = 0; i < 64; i++)
+    {
+        uint32_t t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i];
+        uint32_t t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    ctx->state[0] += a;
+    ctx->state[1] += b;
+    ctx->state[2] += c;
+    ctx->state[3] += d;
+    ctx->state[4] += e;
+    ctx->state[5] += f;
+    ctx->state[6] += g;
+    ctx->state[7] += h;
+}
+
+void sha256Init(Sha256 *ctx)
+{
+    static const uint32_t initial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(ctx->state, initial, sizeof(initial));
+    ctx->length = 0;
+    ctx->used = 0;
+}
+
+void sha256Update(Sha256 *ctx, const void *data, size_t length)
+{
+    const unsigned char *next = data;
+    ctx->length += length;
+    while (length > 0)
+    {
+        size_t take = 64 - ctx->used < length ? 64 - ctx->used : length;
+        memcpy(ctx->block + ctx->used, next, take);
+        ctx->used += take;
+        next += take;
+        length -= take;
+        if (ctx->used == 64)
+        {
+            sha256Transform(ctx, ctx->block);
+            ctx->used = 0;
+        }
+    }
+}
+
+void sha256Final(Sha256 *ctx, unsigned char *digest)
+{
+    uint64_t bits = ctx->length * 8;
+    size_t used = ctx->used;
+    ctx->block[used++] = 0x80;
+    if (used > 56)
+    {
+        memset(ctx->block + used, 0, 64 - used);
+        sha256Transform(ctx, ctx->block);
+        used = 0;
+    }
+    memset(ctx->block + used, 0, 56 - used);
+    for (int i = 0; i < 8; i++)
+    {
+        ctx->block[56 + i] = bits >> (56 - i * 8);
+    }
+    sha256Transform(ctx, ctx->block);
+
+    for (int i = 0; i < 8; i++)
+    {
+        digest[i * 4] = ctx->state[i] >> 24;
+        digest[i * 4 + 1] = ctx->state[i] >> 16;
+        digest[i * 4 + 2] = ctx->state[i] >> 8;
+        digest[i * 4 + 3] = ctx->state[i];
+    }
+}
+
+// HMAC-SHA256 with the keyed inner and outer states prepared once, so that
+// PBKDF2 pays two compressions per round instead of four
+typedef struct
+{
+    Sha256 inner;
+    Sha256 outer;
+} HmacSha256;
+
+void hmacInit(HmacSha256 *hmac, const void *key, size_t keyLength)
+{
+    unsigned char block[64] = {0};
+    if (keyLength > 64)
+    {
+        Sha256 ctx;
+        sha256Init(&ctx);
+        sha256Update(&ctx, key, keyLength);
+        sha256Final(&ctx, block);
+    }
+    else
+    {
+        memcpy(block, key, keyLength);
+    }
+
+    unsigned char pad[64];
+    for (int i = 0; i < 64; i++)
+    {
+        pad[i] = block[i] ^ 0x36;
+    }
+    sha256Init(&hmac->inner);
+    sha256Update(&hmac->inner, pad, 64);
+    for (int i = 0; i < 64; i++)
+    {
+        pad[i] = block[i] ^ 0x5c;
+    }
+    sha256Init(&hmac->outer);
+    sha256Update(&hmac->outer, pad, 64);
+}
+
+void hmacCompute(const HmacSha256 *hmac, const void *data, size_t length, unsigned char *mac)
+{
+    unsigned char inner[SHA256_DIGEST_LENGTH];
+    Sha256 ctx = hmac->inner;
+    sha256Update(&ctx, data, length);
+    sha256Final(&ctx, inner);
+    ctx = hmac->outer;
+    sha256Update(&ctx, inner, sizeof(inner));
+    sha256Final(&ctx, mac);
+}
+
+// PBKDF2-HMAC-SHA256 for one 32-byte block of output
+void pbkdf2Sha256(const char *password, const unsigned char *salt, size_t saltLength, int iterations, unsigned char *output)
+{
+    HmacSha256 hmac;
+    hmacInit(&hmac, password, strlen(password));
+
+    unsigned char first[PIN_SALT_LENGTH + 4];
+    memcpy(first, salt, saltLength);
+    first[saltLength] = 0;
+    first[saltLength + 1] = 0;
+    first[saltLength + 2] = 0;
+    first[saltLength + 3] = 1;
+
+    unsigned char u[SHA256_DIGEST_LENGTH];
+    hmacCompute(&hmac, first, saltLength + 4, u);
+    memcpy(output, u, SHA256_DIGEST_LENGTH);
+    for (int i = 1; i < iterations; i++)
+    {
+        hmacCompute(&hmac, u, sizeof(u), u);
+        for (int j = 0; j < SHA256_DIGEST_LENGTH; j++)
+        {
+            output[j] ^= u[j];
+        }
+    }
+}
+
+// Compare without an early exit, so timing reveals nothing about the match
+int constantTimeEqual(const unsigned char *a, const unsigned char *b, size_t length)
+{
+    unsigned char difference = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        difference |= a[i] ^ b[i];
+    }
+    return difference == 0;
+}
+
+// Set a fresh random salt on the account and store the hash of pin
+void setAccountPIN(Account *account, const char *pin)
+{
+    secureRandom(account->pinSalt, PIN_SALT_LENGTH);
+    pbkdf2Sha256(pin, account->pinSalt, PIN_SALT_LENGTH, PIN_HASH_ITERATIONS, account->pinHash);
+}
+
+// The slow check: hash pin with the account's salt and compare
+int verifyAccountPIN(const Account *account, const char *pin)
+{
+    unsigned char hash[PIN_HASH_LENGTH];
+    pbkdf2Sha256(pin, account->pinSalt, PIN_SALT_LENGTH, PIN_HASH_ITERATIONS, hash);
+    return constantTimeEqual(hash, account->pinHash, PIN_HASH_LENGTH);
+}
+
+// PINs a session has already proven. Each entry keeps a MAC of the PIN
+// under a key private to the session rather than the PIN itself, and the
+// stored hash it was checked against, so a changed PIN is never trusted.
+typedef struct
+{
+    char accountNumber[ACC_NUM_LENGTH + 1];
+    unsigned char pinHash[PIN_HASH_LENGTH];
+    unsigned char pinMac[SHA256_DIGEST_LENGTH];
+    time_t verified;
+} VerifiedCredential;
+
+typedef struct
+{
+    HmacSha256 key;
+    int next;
+    VerifiedCredential entries[CREDENTIAL_CACHE_SIZE];
+} CredentialCache;
+
+// Start a session with an empty cache and a new random key
+void credentialCacheInit(CredentialCache *cache)
+{
+    unsigned char key[32];
+    memset(cache, 0, sizeof(*cache));
+    secureRandom(key, sizeof(key));
+    hmacInit(&cache->key, key, sizeof(key));
+}
+
+// Has this session proven pin for account recently? Cheap: no hashing. A
+// NULL cache has proven nothing.
+int credentialCached(CredentialCache *cache, const Account *account, const char *pin)
+{
+    if (cache == NULL)
+    {
+        return 0;
+    }
+
+    unsigned char mac[SHA256_DIGEST_LENGTH];
+    hmacCompute(&cache->key, pin, strlen(pin), mac);
+    time_t now = time(NULL);
+
+    for (int i = 0; i < CREDENTIAL_CACHE_SIZE; i++)
+    {
+        VerifiedCredential *entry = &cache->entries[i];
+        if (strcmp(entry->accountNumber, account->accountNumber) == 0 &&
+            now - entry->verified < CREDENTIAL_CACHE_TTL &&
+            memcmp(entry->pinHash, account->pinHash, PIN_HASH_LENGTH) == 0 &&
+            constantTimeEqual(entry->pinMac, mac, sizeof(mac)))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Verify pin for account, running the slow hash only when this session has
+// not already proven the same PIN recently. A NULL cache always hashes.
+int verifyPINCached(CredentialCache *cache, const Account *account, const char *pin)
+{
+    if (credentialCached(cache, account, pin))
+    {
+        return 1;
+    }
+    if (!verifyAccountPIN(account, pin))
+    {
+        return 0;
+    }
+    if (cache == NULL)
+    {
+        return 1;
+    }
+
+    unsigned char mac[SHA256_DIGEST_LENGTH];
+    hmacCompute(&cache->key, pin, strlen(pin), mac);
+    VerifiedCredential *entry = &cache->entries[cache->next];
+    cache->next = (cache->next + 1) % CREDENTIAL_CACHE_SIZE;
+    strcpy(entry->accountNumber, account->accountNumber);
+    memcpy(entry->pinHash, account->pinHash, PIN_HASH_LENGTH);
+    memcpy(entry->pinMac, mac, sizeof(mac));
+    entry->verified = time(NULL);
+    return 1;
+}
+
+#endif // BANK_AUTH_H
@@ -0,0 +1,102 @@
+// Change-data-capture stream of committed account events, read from the
+// operation log
+
+#ifndef BANK_CDC_H
+#define BANK_CDC_H
+
+#include "bank_common.h"
+#include "bank_oplog.h"
+
+#define CDC_SEND_BUFFER (256 * 1024) // Bytes a subscriber may leave unread
+#define CDC_SEND_TIMEOUT 5           // Seconds a full buffer may stay full
+#define CDC_MAX_LAG 1000000          // Events a subscriber may fall behind
+
+// A subscriber opens with the sequence of the first event it wants, 0 for
+// the oldest the log still holds. The server answers with a CdcHeader and,
+// when the status is CDC_STREAMING, a CdcEvent for every committed change
+// from next on, in commit order. Otherwise the header gives the range the
+// log holds: first up to next - 1. A subscriber that falls too far behind or
+// stops reading is disconnected; it resumes by subscribing again with the
+// sequence after the last event it processed.
+typedef enum
+{
+    CDC_STREAMING,
+    CDC_OUT_OF_RANGE // The log no longer, or does not yet, hold the events asked for
+} CdcStatus;
+
+typedef struct
+{
+    CdcStatus status;
+    unsigned long first;
+    unsigned long next;
+} CdcHeader;
+
+// One committed change, as an operation log record without credentials
+typedef struct
+{
+    unsigned long sequence;
+    time_t timestamp;
+    RequestType type; // OPEN_ACCOUNT, CLOSE_ACCOUNT, WITHDRAW, DEPOSIT_FUNDS, TRANSFER, ACCRUAL or a transfer step
+    char accountNumber[ACC_NUM_LENGTH + 1];
+    char description[MAX_NAME_LENGTH + 1]; // OPEN_ACCOUNT: the holder; TRANSFER, ACCRUAL: the description;
+                                           // transfer steps: the transfer ID and the other account
+    AccountType accountType;               // OPEN_ACCOUNT only
+    double amount;                         // Signed for transfers and accruals
+    double balance;                        // Balance after the change
+} CdcEvent;
+
+void cdcEventFromRecord(const OperationRecord *record, CdcEvent *event)
+{
+    memset(event, 0, sizeof(*event));
+    event->sequence = record->sequence;
+    event->timestamp = record->timestamp;
+    event->type = record->type;
+    memcpy(event->accountNumber, record->accountNumber, ACC_NUM_LENGTH);
+    if (record->type == OPEN_ACCOUNT || record->type == TRANSFER || record->type == ACCRUAL)
+    {
+        memcpy(event->description, record->name, MAX_NAME_LENGTH);
+    }
+    else if (record->type == PREPARE_TRANSFER || record->type == COMMIT_TRANSFER || record->type == ABORT_TRANSFER ||
+             record->type == TRANSFER_DELIVERED)
+    {
+        // On the target shard only the commit moves funds; see bank_oplog.h
+        int received = record->type == COMMIT_TRANSFER ? record->amount > 0
+                                                       : record->type != TRANSFER_DELIVERED && record->amount == 0;
+        snprintf(event->description, sizeof(event->description), "Transfer %.16s %s %.10s", record->name,
+                 received ? "from" : "to", record->nationalID);
+    }
+    event->accountType = record->accountType;
+    event->amount = record->amount;
+    event->balance = record->balance;
+}
+
+const char *cdcEventTypeString(RequestType type)
+{
+    switch (type)
+    {
+    case OPEN_ACCOUNT:
+        return "open";
+    case CLOSE_ACCOUNT:
+        return "close";
+    case WITHDRAW:
+        return "withdraw";
+    case DEPOSIT_FUNDS:
+        return "deposit";
+    case TRANSFER:
+        return "transfer";
+    case ACCRUAL:
+        return "accrual";
+    case PREPARE_TRANSFER:
+        return "reserve";
+    case COMMIT_TRANSFER:
+        return "commit";
+    case ABORT_TRANSFER:
+        return "release";
+    case TRANSFER_DELIVERED:
+        return "delivered";
+    default:
+        return "unknown";
+    }
+}
+
+#endif // BANK_CDC_H
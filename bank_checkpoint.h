@@ -0,0 +1,376 @@
+// Periodic checkpoints of every account, which together with the operation
+// log answer what an account held at a past moment and rebuild the whole
+// database as of one
+
+#ifndef BANK_CHECKPOINT_H
+#define BANK_CHECKPOINT_H
+
+#include "bank_common.h"
+#include "bank_oplog.h"
+#include "bank_storage.h"
+#include "bank_history.h"
+#include "bank_slots.h"
+
+#define CHECKPOINT_INDEX_SUFFIX ".checkpoints"
+#define CHECKPOINT_FILE_SUFFIX ".checkpoint"
+#define CHECKPOINT_INTERVAL 3600   // Seconds between checkpoints
+#define CHECKPOINT_RECORDS 100000  // or log records, whichever comes first
+#define CHECKPOINT_KEEP 168        // Checkpoint files kept; a week of hourly ones
+
+// A checkpoint is a database file, written in account number order, of
+// every account as of log sequence. The index file lists checkpoints oldest
+// first, so the one for a moment is found by binary search and only the log
+// records after it need replaying. Index entries outlive the files of
+// checkpoints past CHECKPOINT_KEEP.
+typedef struct
+{
+    unsigned long sequence; // Last log record the checkpoint reflects
+    time_t timestamp;
+} CheckpointEntry;
+
+// An account's state at a past moment
+typedef struct
+{
+    int existed;
+    int isActive;
+    double balance;
+} AccountState;
+
+void checkpointPath(char *path, size_t size, const char *database, unsigned long sequence)
+{
+    snprintf(path, size, "%s%s.%lu", database, CHECKPOINT_FILE_SUFFIX, sequence);
+}
+
+int compareAccountNumbers(const void *a, const void *b)
+{
+    return strcmp(((const Account *)a)->accountNumber, ((const Account *)b)->accountNumber);
+}
+
+// Read index entry n. Returns 0, or -1 when there is none.
+int readCheckpointEntry(int fd, long n, CheckpointEntry *entry)
+{
+    return n >= 0 && pread(fd, entry, sizeof(*entry), n * sizeof(*entry)) == sizeof(*entry) ? 0 : -1;
+}
+
+long checkpointCount(int fd)
+{
+    struct stat st;
+    return fstat(fd, &st) < 0 ? 0 : st.st_size / sizeof(CheckpointEntry);
+}
+
+// Write a checkpoint of count accounts, which it sorts, taken at sequence,
+// and then list it in the index. Slots without an account are left out.
+// Drops the file of the checkpoint CHECKPOINT_KEEP before it. Returns 0, or
+// -1 on error.
+int writeCheckpoint(const char *database, Account *accounts, int count, unsigned long sequence, time_t now)
+{
+    int used = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (accounts[i].accountNumber[0] != '\0')
+        {
+            accounts[used++] = accounts[i];
+        }
+    }
+    qsort(accounts, used, sizeof(Account), compareAccountNumbers);
+
+    char path[512];
+    checkpointPath(path, sizeof(path), database, sequence);
+    if (saveAccountFile(path, accounts, used) < 0)
+    {
+        return -1;
+    }
+
+    char indexPath[512];
+    snprintf(indexPath, sizeof(indexPath), "%s%s", database, CHECKPOINT_INDEX_SUFFIX);
+    int fd = open(indexPath, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    CheckpointEntry entry = {sequence, now};
+    int failed = write(fd, &entry, sizeof(entry)) != sizeof(entry) || fdatasync(fd) != 0;
+
+    CheckpointEntry expired;
+    if (!failed && readCheckpointEntry(fd, checkpointCount(fd) - 1 - CHECKPOINT_KEEP, &expired) == 0)
+    {
+        checkpointPath(path, sizeof(path), database, expired.sequence);
+        unlink(path);
+    }
+    close(fd);
+    return failed ? -1 : 0;
+}
+
+// Find the newest checkpoint taken at or before at, and the sequence of
+// the next one (0 when there is none). Returns 1 when there is one, 0 when
+// every checkpoint is later, or -1 when there is no index.
+int findCheckpoint(const char *database, time_t at, CheckpointEntry *found, unsigned long *nextSequence)
+{
+    char indexPath[512];
+    snprintf(indexPath, sizeof(indexPath), "%s%s", database, CHECKPOINT_INDEX_SUFFIX);
+    int fd = open(indexPath, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    // The last entry at or before at
+    long low = 0;
+    long high = checkpointCount(fd) - 1;
+    long best = -1;
+    CheckpointEntry entry;
+    while (low <= high)
+    {
+        long middle = low + (high - low) / 2;
+        if (readCheckpointEntry(fd, middle, &entry) < 0)
+        {
+            break;
+        }
+        if (entry.timestamp <= at)
+        {
+            best = middle;
+            *found = entry;
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle - 1;
+        }
+    }
+
+    *nextSequence = readCheckpointEntry(fd, best + 1, &entry) == 0 ? entry.sequence : 0;
+    close(fd);
+    return best >= 0;
+}
+
+// Fill in a new account from its OPEN_ACCOUNT record
+void accountFromOpenRecord(Account *account, const OperationRecord *record)
+{
+    memset(account, 0, sizeof(Account));
+    strcpy(account->accountNumber, record->accountNumber);
+    memcpy(account->pinSalt, record->pinSalt, PIN_SALT_LENGTH);
+    memcpy(account->pinHash, record->pinHash, PIN_HASH_LENGTH);
+    strcpy(account->name, record->name);
+    strcpy(account->nationalID, record->nationalID);
+    account->type = record->accountType;
+    account->balance = record->amount;
+    account->isActive = 1;
+    account->accruedPeriod = accrualPeriod(record->timestamp);
+    appendHistory(account, record->timestamp, DEPOSIT, record->amount, "Initial deposit");
+}
+
+// Apply a WITHDRAW, DEPOSIT_FUNDS, TRANSFER, ACCRUAL or transfer step record
+// to its account
+void applyRecordToAccount(Account *account, const OperationRecord *record)
+{
+    if (record->type == WITHDRAW)
+    {
+        account->balance -= record->amount;
+        appendRequestHistory(account, record->timestamp, WITHDRAWAL, record->amount, "Withdrawal",
+                             strtoul(record->name, NULL, 16));
+    }
+    else if (record->type == TRANSFER || record->type == ACCRUAL)
+    {
+        account->balance += record->amount;
+        appendHistory(account, record->timestamp, record->amount < 0 ? WITHDRAWAL : DEPOSIT,
+                      record->amount < 0 ? -record->amount : record->amount, record->name);
+
+        // Remember the month, so interest and fees are not posted again
+        if (record->type == ACCRUAL)
+        {
+            account->accruedPeriod = accrualPeriod(record->timestamp);
+        }
+    }
+    else if (record->type == PREPARE_TRANSFER || record->type == COMMIT_TRANSFER || record->type == ABORT_TRANSFER)
+    {
+        // Funds reserved for a cross-shard transfer or given back on the
+        // source shard, or credited on the target. The other steps move
+        // nothing and log 0.
+        if (record->amount != 0)
+        {
+            char description[100];
+            sprintf(description,
+                    record->type == PREPARE_TRANSFER  ? "Transfer to %s"
+                    : record->type == COMMIT_TRANSFER ? "Transfer from %s"
+                                                      : "Reversed transfer to %s",
+                    record->nationalID);
+            account->balance += record->amount;
+            appendRequestHistory(account, record->timestamp, record->amount < 0 ? WITHDRAWAL : DEPOSIT,
+                                 record->amount < 0 ? -record->amount : record->amount, description,
+                                 strtoul(record->name, NULL, 16));
+        }
+    }
+    else if (record->type == TRANSFER_DELIVERED)
+    {
+        // The target shard has the outcome; no funds move
+    }
+    else
+    {
+        account->balance += record->amount;
+        appendRequestHistory(account, record->timestamp, DEPOSIT, record->amount, "Deposit",
+                             strtoul(record->name, NULL, 16));
+    }
+}
+
+// Replay the log records of one account from sequence from up to, but not
+// including, until (0 for the end of the log), skipping records dated after
+// at. Every record carries the balance after it, so only the last one
+// matters. Returns 0, or -1 when the log does not reach back to from.
+int replayAccountState(int logFd, unsigned long first, unsigned long from, unsigned long until, time_t at,
+                       const char *accountNumber, AccountState *state)
+{
+    OperationRecord batch[REPLICATION_BATCH];
+    if (from < first)
+    {
+        return -1;
+    }
+
+    int count;
+    while ((until == 0 || from < until) && (count = readOperationRecords(logFd, first, from, batch, REPLICATION_BATCH)) > 0)
+    {
+        for (int i = 0; i < count && (until == 0 || batch[i].sequence < until); i++)
+        {
+            if (batch[i].timestamp > at || strcmp(batch[i].accountNumber, accountNumber) != 0)
+            {
+                continue;
+            }
+            state->existed = 1;
+            state->isActive = batch[i].type != CLOSE_ACCOUNT;
+            state->balance = batch[i].balance;
+        }
+        from += count;
+    }
+    return 0;
+}
+
+// Work out an account's state at a moment from the newest checkpoint before
+// it and the log records after that. Without such a checkpoint the log has
+// to go back to its very first record. Returns 0, or -1 when no history
+// that old is kept.
+int accountStateAt(const char *database, int logFd, unsigned long first, const char *accountNumber, time_t at,
+                   AccountState *state)
+{
+    CheckpointEntry checkpoint;
+    unsigned long next = 0;
+    memset(state, 0, sizeof(*state));
+
+    // Records written while the next checkpoint was taken may be dated at
+    // or before the moment, so replay up to and including its sequence
+    int found = findCheckpoint(database, at, &checkpoint, &next);
+    unsigned long until = next != 0 ? next + 1 : 0;
+    if (found <= 0)
+    {
+        // Before the first checkpoint, the log must reach back to genesis
+        return first == 1 ? replayAccountState(logFd, first, 1, until, at, accountNumber, state) : -1;
+    }
+
+    char path[512];
+    Account account;
+    checkpointPath(path, sizeof(path), database, checkpoint.sequence);
+    int stored = findStoredAccount(path, accountNumber, &account);
+    if (stored < 0)
+    {
+        return -1;
+    }
+    if (stored)
+    {
+        state->existed = 1;
+        state->isActive = account.isActive;
+        state->balance = account.balance;
+    }
+
+    return replayAccountState(logFd, first, checkpoint.sequence + 1, until, at, accountNumber, state);
+}
+
+// Rebuild every account as of a moment into accounts, from the newest
+// checkpoint before it and the log records after that, as accountStateAt
+// does for one. The log is only read. Returns the number of accounts, or -1
+// after reporting why it cannot be done.
+int restoreAccountsAt(const char *database, time_t at, Account *accounts, int maxAccounts)
+{
+    char logPath[512];
+    snprintf(logPath, sizeof(logPath), "%s%s", database, LOG_FILE_SUFFIX);
+    int logFd = open(logPath, O_RDONLY | O_CLOEXEC);
+    OperationRecord record;
+    unsigned long first = logFd >= 0 && pread(logFd, &record, sizeof(record), 0) == sizeof(record) ? record.sequence : 0;
+
+    CheckpointEntry checkpoint;
+    unsigned long next = 0;
+    unsigned long from = 1;
+    int count = 0;
+    int found = findCheckpoint(database, at, &checkpoint, &next);
+    if (found > 0)
+    {
+        char path[512];
+        int converted;
+        checkpointPath(path, sizeof(path), database, checkpoint.sequence);
+        count = loadAccountFile(path, accounts, maxAccounts, &converted);
+        if (count < 0)
+        {
+            perror(path);
+        }
+        from = checkpoint.sequence + 1;
+    }
+    if (count < 0 || (found <= 0 && first != 1) || (first != 0 && from < first))
+    {
+        if (count >= 0)
+        {
+            fprintf(stderr, "%s: no checkpoint and log reach back that far.\n", database);
+        }
+        if (logFd >= 0)
+            close(logFd);
+        return -1;
+    }
+
+    static AccountSlots slots;
+    slotsBuild(&slots, accounts, count);
+    unsigned long until = next != 0 ? next + 1 : 0;
+    OperationRecord batch[REPLICATION_BATCH];
+    int read;
+    while ((until == 0 || from < until) && (read = readOperationRecords(logFd, first, from, batch, REPLICATION_BATCH)) > 0)
+    {
+        for (int i = 0; i < read && (until == 0 || batch[i].sequence < until); i++)
+        {
+            if (batch[i].timestamp > at)
+            {
+                continue;
+            }
+            int slot = slotsFind(&slots, accounts, batch[i].accountNumber);
+            if (batch[i].type == OPEN_ACCOUNT && slot < 0 && count < maxAccounts)
+            {
+                accountFromOpenRecord(&accounts[count], &batch[i]);
+                slotsAdd(&slots, accounts, count++);
+            }
+            else if (batch[i].type == CLOSE_ACCOUNT && slot >= 0)
+            {
+                accounts[slot].isActive = 0;
+            }
+            else if (batch[i].type != OPEN_ACCOUNT && slot >= 0)
+            {
+                applyRecordToAccount(&accounts[slot], &batch[i]);
+            }
+        }
+        from += read;
+    }
+
+    if (logFd >= 0)
+        close(logFd);
+    return count;
+}
+
+// Read the newest index entry. Returns 0, or -1 when there is none.
+int lastCheckpoint(const char *database, CheckpointEntry *entry)
+{
+    char indexPath[512];
+    snprintf(indexPath, sizeof(indexPath), "%s%s", database, CHECKPOINT_INDEX_SUFFIX);
+    int fd = open(indexPath, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    int result = readCheckpointEntry(fd, checkpointCount(fd) - 1, entry);
+    close(fd);
+    return result;
+}
+
+#endif // BANK_CHECKPOINT_H
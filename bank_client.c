@@ -1,4 +1,86 @@
 #include "bank_common.h"
+#include "bank_shard.h"
+#include "bank_cdc.h"
+#include <netinet/tcp.h>
+
+#define SEND_ATTEMPTS 3 // Tries at a deposit or withdrawal before giving up
+#define SCRIPT_MAX_PIPELINE 64 // Requests a script keeps in flight at most
+#define SCRIPT_DEFAULT_PIPELINE 16
+
+// The server, or every shard of a cluster, with one connection each
+ShardAddress shards[MAX_SHARDS];
+int shardSockets[MAX_SHARDS];
+int shardCount = 1;
+#ifdef BANK_TLS
+SSL_CTX *tlsContext = NULL;              // Set by --tls
+SSL_SESSION *shardSessions[MAX_SHARDS]; // Last session of each shard, to resume
+#endif
+
+// Function to connect to a shard, over TLS when --tls was given, resuming
+// the shard's last session if resume is set. Returns the socket, or -1.
+int connectShard(int shard, int resume)
+{
+    int sockfd = connectTo(shards[shard].host, shards[shard].port);
+#ifdef BANK_TLS
+    if (sockfd >= 0 && tlsContext != NULL &&
+        tlsConnect(tlsContext, sockfd, shards[shard].host, resume ? &shardSessions[shard] : NULL) < 0)
+    {
+        close(sockfd);
+        return -1;
+    }
+#else
+    (void)resume;
+#endif
+    return sockfd;
+}
+
+// Function to hang up a connection made by connectShard
+void disconnect(int sockfd)
+{
+#ifdef BANK_TLS
+    tlsDetach(sockfd);
+#endif
+    close(sockfd);
+}
+
+// Function to get the connection to the shard that owns an account
+int socketForAccount(const char *accountNumber)
+{
+    return shardSockets[shardForAccount(accountNumber, shardCount)];
+}
+
+// Function to send a deposit or withdrawal and wait for the answer. When
+// the connection drops before the answer arrives, reconnect and send the
+// same request again: its requestId lets the server answer a retry without
+// moving the money twice. Returns 0, or -1 once every attempt failed.
+int sendWithRetry(Request *request, Response *response)
+{
+    do
+    {
+        secureRandom(&request->requestId, sizeof(request->requestId));
+    } while (request->requestId == 0);
+
+    int shard = shardForAccount(request->accountNumber, shardCount);
+    for (int attempt = 0; attempt < SEND_ATTEMPTS; attempt++)
+    {
+        if (attempt > 0)
+        {
+            printf("Connection lost; retrying...\n");
+            sleep(1);
+            if (shardSockets[shard] >= 0)
+                disconnect(shardSockets[shard]);
+            shardSockets[shard] = connectShard(shard, 1);
+            if (shardSockets[shard] < 0)
+                continue;
+        }
+        if (sendAll(shardSockets[shard], request, sizeof(*request)) == 0 &&
+            recvAll(shardSockets[shard], response, sizeof(*response)) == 0)
+        {
+            return 0;
+        }
+    }
+    return -1;
+}
 
 // Function to display the main menu
 void displayMainMenu()
@@ -10,12 +92,17 @@ void displayMainMenu()
     printf("4. Deposit\n");
     printf("5. Check Balance\n");
     printf("6. Get Statement\n");
+    printf("7. Transfer\n");
+    printf("8. Set Up Standing Order\n");
+    printf("9. Cancel Standing Order\n");
+    printf("10. List My Accounts\n");
+    printf("11. Balance at a Past Time\n");
     printf("0. Exit\n");
     printf("Enter your choice: ");
 }
 
 // Function to open an account
-void openAccount(int sockfd)
+void openAccount()
 {
     Request request;
     memset(&request, 0, sizeof(request));
@@ -37,8 +124,11 @@ void openAccount(int sockfd)
     printf("Enter initial deposit amount (minimum %.2f): ", (double)MIN_BALANCE);
     scanf("%lf", &request.amount);
 
+    // New accounts are opened on the shard picked by national ID
+    int sockfd = shardSockets[shardForNationalID(request.nationalID, shardCount)];
+
     // Send request to server
-    send(sockfd, &request, sizeof(request), 0);
+    sendAll(sockfd, &request, sizeof(request));
 
     // Receive response from server
     Response response;
@@ -48,7 +138,7 @@ void openAccount(int sockfd)
 }
 
 // Function to close an account
-void closeAccount(int sockfd)
+void closeAccount()
 {
     Request request;
     memset(&request, 0, sizeof(request));
@@ -62,8 +152,10 @@ void closeAccount(int sockfd)
     printf("Enter PIN: ");
     scanf(" %[^\n]", request.pin);
 
+    int sockfd = socketForAccount(request.accountNumber);
+
     // Send request to server
-    send(sockfd, &request, sizeof(request), 0);
+    sendAll(sockfd, &request, sizeof(request));
 
     // Receive response from server
     Response response;
@@ -73,7 +165,7 @@ void closeAccount(int sockfd)
 }
 
 // Function to withdraw money
-void withdraw(int sockfd)
+void withdraw()
 {
     Request request;
     memset(&request, 0, sizeof(request));
@@ -91,18 +183,19 @@ void withdraw(int sockfd)
            (double)MIN_TRANSACTION, (double)MIN_TRANSACTION);
     scanf("%lf", &request.amount);
 
-    // Send request to server
-    send(sockfd, &request, sizeof(request), 0);
-
-    // Receive response from server
+    // Send request to server and receive its response, retrying safely
     Response response;
-    recv(sockfd, &response, sizeof(response), 0);
+    if (sendWithRetry(&request, &response) < 0)
+    {
+        printf("\nError: Lost connection to server. The withdrawal may or may not have gone through.\n");
+        return;
+    }
 
     printf("\n%s\n", response.message);
 }
 
 // Function to deposit money
-void deposit(int sockfd)
+void deposit()
 {
     Request request;
     memset(&request, 0, sizeof(request));
@@ -119,18 +212,19 @@ void deposit(int sockfd)
     printf("Enter deposit amount (minimum %.2f): ", (double)MIN_TRANSACTION);
     scanf("%lf", &request.amount);
 
-    // Send request to server
-    send(sockfd, &request, sizeof(request), 0);
-
-    // Receive response from server
+    // Send request to server and receive its response, retrying safely
     Response response;
-    recv(sockfd, &response, sizeof(response), 0);
+    if (sendWithRetry(&request, &response) < 0)
+    {
+        printf("\nError: Lost connection to server. The deposit may or may not have gone through.\n");
+        return;
+    }
 
     printf("\n%s\n", response.message);
 }
 
 // Function to check balance
-void checkBalance(int sockfd)
+void checkBalance()
 {
     Request request;
     memset(&request, 0, sizeof(request));
@@ -144,8 +238,10 @@ void checkBalance(int sockfd)
     printf("Enter PIN: ");
     scanf(" %[^\n]", request.pin);
 
+    int sockfd = socketForAccount(request.accountNumber);
+
     // Send request to server
-    send(sockfd, &request, sizeof(request), 0);
+    sendAll(sockfd, &request, sizeof(request));
 
     // Receive response from server
     Response response;
@@ -154,14 +250,14 @@ void checkBalance(int sockfd)
     printf("\n%s\n", response.message);
 }
 
-// Function to get account statement
-void getStatement(int sockfd)
+// Function to transfer money to another account
+void transfer()
 {
     Request request;
     memset(&request, 0, sizeof(request));
-    request.type = GET_STATEMENT;
+    request.type = TRANSFER;
 
-    printf("\n===== ACCOUNT STATEMENT =====\n");
+    printf("\n===== TRANSFER =====\n");
 
     printf("Enter account number: ");
     scanf(" %[^\n]", request.accountNumber);
@@ -169,18 +265,123 @@ void getStatement(int sockfd)
     printf("Enter PIN: ");
     scanf(" %[^\n]", request.pin);
 
+    printf("Enter target account number: ");
+    scanf(" %[^\n]", request.targetAccount);
+
+    printf("Enter transfer amount (minimum %.2f): ", (double)MIN_TRANSACTION);
+    scanf("%lf", &request.amount);
+
+    // The source account's shard coordinates the transfer
+    int sockfd = socketForAccount(request.accountNumber);
+
     // Send request to server
-    send(sockfd, &request, sizeof(request), 0);
+    sendAll(sockfd, &request, sizeof(request));
 
     // Receive response from server
     Response response;
     recv(sockfd, &response, sizeof(response), 0);
 
-    if (response.success)
+    printf("\n%s\n", response.message);
+}
+
+// Function to parse a YYYY-MM-DD date as local time, "-" meaning no limit
+time_t parseDate(const char *text, int endOfDay)
+{
+    struct tm date = {0};
+    if (sscanf(text, "%d-%d-%d", &date.tm_year, &date.tm_mon, &date.tm_mday) != 3)
     {
-        printf("\nAccount Statement\n");
-        printf("Current Balance: %.2f\n\n", response.balance);
-        printf("Last %d Transactions:\n", response.transactionCount);
+        return 0;
+    }
+    date.tm_year -= 1900;
+    date.tm_mon -= 1;
+    date.tm_isdst = -1;
+    if (endOfDay)
+    {
+        date.tm_hour = 23;
+        date.tm_min = 59;
+        date.tm_sec = 59;
+    }
+    return mktime(&date);
+}
+
+// Function to get account statement
+void getStatement()
+{
+    Request request;
+    memset(&request, 0, sizeof(request));
+    request.type = GET_STATEMENT;
+
+    printf("\n===== ACCOUNT STATEMENT =====\n");
+
+    printf("Enter account number: ");
+    scanf(" %[^\n]", request.accountNumber);
+
+    printf("Enter PIN: ");
+    scanf(" %[^\n]", request.pin);
+
+    printf("Enter page size (0 for the last %d transactions): ", MAX_TRANSACTIONS_IN_STATEMENT);
+    scanf("%d", &request.pageSize);
+
+    if (request.pageSize > 0)
+    {
+        char date[32];
+        printf("Enter start date (YYYY-MM-DD, or - for no limit): ");
+        scanf(" %31s", date);
+        request.fromTime = parseDate(date, 0);
+
+        printf("Enter end date (YYYY-MM-DD, or - for no limit): ");
+        scanf(" %31s", date);
+        request.toTime = parseDate(date, 1);
+    }
+
+    int sockfd = socketForAccount(request.accountNumber);
+    int page = 1;
+    while (1)
+    {
+        // Send request to server
+        sendAll(sockfd, &request, sizeof(request));
+
+        // Receive response from server, followed by its transaction records
+        Response response;
+        if (recvAll(sockfd, &response, sizeof(response)) < 0)
+        {
+            printf("\nError: Lost connection to server.\n");
+            return;
+        }
+
+        Transaction *transactions = NULL;
+        if (response.transactionCount > 0)
+        {
+            transactions = malloc(response.transactionCount * sizeof(Transaction));
+            if (transactions == NULL ||
+                recvAll(sockfd, transactions, response.transactionCount * sizeof(Transaction)) < 0)
+            {
+                printf("\nError: Failed to receive statement.\n");
+                free(transactions);
+                return;
+            }
+        }
+
+        if (!response.success)
+        {
+            printf("\n%s\n", response.message);
+            free(transactions);
+            return;
+        }
+
+        if (page == 1)
+        {
+            printf("\nAccount Statement\n");
+            printf("Current Balance: %.2f\n\n", response.balance);
+        }
+        if (request.pageSize > 0)
+        {
+            printf("Page %d (%d Transactions):\n", page, response.transactionCount);
+        }
+        else
+        {
+            printf("Last %d Transactions:\n", response.transactionCount);
+        }
 
         if (response.transactionCount == 0)
         {
@@ -193,7 +394,7 @@ void getStatement(int sockfd)
 
             for (int i = 0; i < response.transactionCount; i++)
             {
-                Transaction *txn = &response.transactions[i];
+                Transaction *txn = &transactions[i];
                 char dateStr[20];
                 strftime(dateStr, sizeof(dateStr), "%Y-%m-%d %H:%M:%S", localtime(&txn->timestamp));
 
@@ -204,43 +405,822 @@ void getStatement(int sockfd)
                        txn->description);
             }
         }
+
+        free(transactions);
+
+        if (!response.hasMore)
+        {
+            break;
+        }
+
+        char more;
+        printf("Show next page? (y/n): ");
+        scanf(" %c", &more);
+        if (more != 'y' && more != 'Y')
+        {
+            break;
+        }
+
+        request.cursor = response.nextCursor;
+        page++;
     }
-    else
+}
+
+// Function to set up a recurring or scheduled deposit, withdrawal or transfer
+void scheduleOrder()
+{
+    Request request;
+    memset(&request, 0, sizeof(request));
+    request.type = SCHEDULE_ORDER;
+
+    printf("\n===== SET UP STANDING ORDER =====\n");
+
+    printf("Enter account number: ");
+    scanf(" %[^\n]", request.accountNumber);
+
+    printf("Enter PIN: ");
+    scanf(" %[^\n]", request.pin);
+
+    int orderChoice;
+    printf("Select order type (1 for Deposit, 2 for Withdrawal, 3 for Transfer): ");
+    scanf("%d", &orderChoice);
+    request.orderType = orderChoice == 1 ? DEPOSIT_FUNDS : orderChoice == 2 ? WITHDRAW : TRANSFER;
+
+    if (request.orderType == TRANSFER)
+    {
+        printf("Enter target account number: ");
+        scanf(" %[^\n]", request.targetAccount);
+    }
+
+    printf("Enter amount (minimum %.2f): ", (double)MIN_TRANSACTION);
+    scanf("%lf", &request.amount);
+
+    char date[32];
+    printf("First run date (YYYY-MM-DD, - for now): ");
+    scanf(" %31s", date);
+    request.runAt = parseDate(date, 0);
+
+    int days;
+    printf("Repeat every how many days (0 to run once): ");
+    scanf("%d", &days);
+    request.interval = days > 0 ? days * 86400L : 0;
+
+    int sockfd = socketForAccount(request.accountNumber);
+
+    // Send request to server
+    sendAll(sockfd, &request, sizeof(request));
+
+    // Receive response from server
+    Response response;
+    recv(sockfd, &response, sizeof(response), 0);
+
+    printf("\n%s\n", response.message);
+}
+
+// Function to list every account of the customer who holds an account
+void listAccounts()
+{
+    Request request;
+    memset(&request, 0, sizeof(request));
+    request.type = LIST_ACCOUNTS;
+
+    printf("\n===== MY ACCOUNTS =====\n");
+
+    printf("Enter account number: ");
+    scanf(" %[^\n]", request.accountNumber);
+
+    printf("Enter PIN: ");
+    scanf(" %[^\n]", request.pin);
+
+    int sockfd = socketForAccount(request.accountNumber);
+
+    // Send request to server
+    sendAll(sockfd, &request, sizeof(request));
+
+    // Receive response from server, followed by its account summaries
+    Response response;
+    if (recvAll(sockfd, &response, sizeof(response)) < 0)
+    {
+        printf("\nError: Lost connection to server.\n");
+        return;
+    }
+
+    AccountSummary *summaries = NULL;
+    if (response.accountCount > 0)
+    {
+        summaries = malloc(response.accountCount * sizeof(AccountSummary));
+        if (summaries == NULL || recvAll(sockfd, summaries, response.accountCount * sizeof(AccountSummary)) < 0)
+        {
+            printf("\nError: Failed to receive account list.\n");
+            free(summaries);
+            return;
+        }
+    }
+
+    if (!response.success)
     {
         printf("\n%s\n", response.message);
+        free(summaries);
+        return;
+    }
+
+    printf("\n%-12s %-10s %s\n", "Account", "Type", "Balance");
+    printf("----------------------------------\n");
+    for (int i = 0; i < response.accountCount; i++)
+    {
+        printf("%-12s %-10s %.2f\n", summaries[i].accountNumber, getAccountTypeString(summaries[i].type),
+               summaries[i].balance);
+    }
+    if (response.hasMore)
+    {
+        printf("(More accounts not shown)\n");
+    }
+    if (shardCount > 1)
+    {
+        printf("Only accounts held on this account's shard are listed.\n");
     }
+    free(summaries);
 }
 
-int main()
+// Function to ask for an account's balance at a past moment
+void balanceAt()
 {
-    int sockfd;
-    struct sockaddr_in serv_addr;
+    Request request;
+    memset(&request, 0, sizeof(request));
+    request.type = BALANCE_AT;
+
+    printf("\n===== BALANCE AT A PAST TIME =====\n");
+
+    printf("Enter account number: ");
+    scanf(" %[^\n]", request.accountNumber);
 
-    // Create socket
-    if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    printf("Enter PIN: ");
+    scanf(" %[^\n]", request.pin);
+
+    char when[64];
+    printf("Enter time (YYYY-MM-DD HH:MM:SS): ");
+    scanf(" %63[^\n]", when);
+    request.toTime = parseTimestamp(when);
+    if (request.toTime < 0)
     {
-        perror("Socket creation error");
+        printf("\nError: Invalid time.\n");
+        return;
+    }
+
+    int sockfd = socketForAccount(request.accountNumber);
+
+    // Send request to server
+    sendAll(sockfd, &request, sizeof(request));
+
+    // Receive response from server
+    Response response;
+    recv(sockfd, &response, sizeof(response), 0);
+
+    printf("\n%s\n", response.message);
+}
+
+// Function to cancel a standing order
+void cancelOrder()
+{
+    Request request;
+    memset(&request, 0, sizeof(request));
+    request.type = CANCEL_ORDER;
+
+    printf("\n===== CANCEL STANDING ORDER =====\n");
+
+    printf("Enter account number: ");
+    scanf(" %[^\n]", request.accountNumber);
+
+    printf("Enter PIN: ");
+    scanf(" %[^\n]", request.pin);
+
+    printf("Enter standing order number: ");
+    scanf("%lu", &request.orderId);
+
+    int sockfd = socketForAccount(request.accountNumber);
+
+    // Send request to server
+    sendAll(sockfd, &request, sizeof(request));
+
+    // Receive response from server
+    Response response;
+    recv(sockfd, &response, sizeof(response), 0);
+
+    printf("\n%s\n", response.message);
+}
+
+// Function to send one balance check and time it, in microseconds.
+// Returns -1 if the request failed.
+double timeBalanceCheck(int sockfd, const Request *request)
+{
+    struct timespec start, end;
+    Response response;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    sendAll(sockfd, request, sizeof(*request));
+    if (recvAll(sockfd, &response, sizeof(response)) < 0)
+    {
+        printf("Error: Lost connection to server.\n");
         return -1;
     }
+    clock_gettime(CLOCK_MONOTONIC, &end);
 
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(PORT);
+    if (!response.success)
+    {
+        printf("%s\n", response.message);
+        if (response.retryAfter > 0)
+        {
+            printf("Run the server with --no-rate-limit to benchmark.\n");
+        }
+        return -1;
+    }
+    return (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3;
+}
+
+// Function to time freshCount new connections, each answering one balance
+// check, and print the mean cost of connecting and of the check. Returns -1
+// if a connection or request failed.
+int timeNewConnections(int shard, const Request *request, int freshCount, int resume, const char *label)
+{
+    double connectTotal = 0;
+    double requestTotal = 0;
+    int resumed = 0;
+    for (int i = 0; i < freshCount; i++)
+    {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int sockfd = connectShard(shard, resume);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (sockfd < 0)
+        {
+            perror("Connection Failed");
+            return -1;
+        }
+#ifdef BANK_TLS
+        resumed += tlsResumed(sockfd);
+#endif
+        double elapsed = timeBalanceCheck(sockfd, request);
+        disconnect(sockfd);
+        if (elapsed < 0)
+        {
+            return -1;
+        }
+        connectTotal += (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3;
+        requestTotal += elapsed;
+    }
+
+    printf("New connection per request, %-15s %10.1f us to connect, %.1f us for the request", label,
+           connectTotal / freshCount, requestTotal / freshCount);
+    if (resume)
+    {
+        printf(" (%d of %d resumed)", resumed, freshCount);
+    }
+    printf("\n");
+    return 0;
+}
 
-    // Convert IPv4 and IPv6 addresses from text to binary form
-    if (inet_pton(AF_INET, "127.0.0.1", &serv_addr.sin_addr) <= 0)
+// Function to benchmark the PIN check and the transport. Balance checks
+// over one connection pay for the PIN hash once and then hit the session's
+// credential cache; checks on fresh connections pay for it every time, and
+// over TLS for a handshake too, full or resumed from an earlier session.
+int runBenchmark(const char *accountNumber, const char *pin, int count)
+{
+    Request request;
+    memset(&request, 0, sizeof(request));
+    request.type = CHECK_BALANCE;
+    snprintf(request.accountNumber, sizeof(request.accountNumber), "%s", accountNumber);
+    snprintf(request.pin, sizeof(request.pin), "%s", pin);
+
+    int shard = shardForAccount(accountNumber, shardCount);
+    double first = timeBalanceCheck(shardSockets[shard], &request);
+    if (first < 0)
     {
-        perror("Invalid address/ Address not supported");
         return -1;
     }
 
-    // Connect to server
-    if (connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
+    double cachedTotal = 0;
+    double cachedMax = 0;
+    for (int i = 1; i < count; i++)
+    {
+        double elapsed = timeBalanceCheck(shardSockets[shard], &request);
+        if (elapsed < 0)
+        {
+            return -1;
+        }
+        cachedTotal += elapsed;
+        cachedMax = elapsed > cachedMax ? elapsed : cachedMax;
+    }
+
+    // Hang up first; a server that serves one client at a time would
+    // otherwise never get to the fresh connections
+    disconnect(shardSockets[shard]);
+    shardSockets[shard] = -1;
+
+    printf("First request on the connection (PIN hashed): %10.1f us\n", first);
+    if (count > 1)
+    {
+        printf("Later requests, PIN cached (%5d requests):   %10.1f us mean, %.1f us max\n",
+               count - 1, cachedTotal / (count - 1), cachedMax);
+    }
+
+    int freshCount = count < 100 ? count : 100;
+#ifdef BANK_TLS
+    if (tlsContext != NULL)
+    {
+        if (timeNewConnections(shard, &request, freshCount, 0, "full handshake:") < 0)
+        {
+            return -1;
+        }
+        return timeNewConnections(shard, &request, freshCount, 1, "resumed:");
+    }
+#endif
+    return timeNewConnections(shard, &request, freshCount, 0, "plain TCP:");
+}
+
+// Operations a script can run, with the fields each takes in order:
+//   a account number, p PIN, n name (underscores stand for spaces),
+//   i national ID, t savings or checking, m amount, g target account,
+//   o standing order number, w a time (YYYY-MM-DDTHH:MM:SS or seconds
+//   since the epoch)
+// $ACCOUNT and $PIN stand for the account the script last opened.
+typedef struct
+{
+    const char *name;
+    RequestType type;
+    const char *fields;
+} ScriptOperation;
+
+static const ScriptOperation SCRIPT_OPERATIONS[] = {
+    {"open", OPEN_ACCOUNT, "nitm"},   {"close", CLOSE_ACCOUNT, "ap"},     {"withdraw", WITHDRAW, "apm"},
+    {"deposit", DEPOSIT_FUNDS, "apm"}, {"balance", CHECK_BALANCE, "ap"}, {"statement", GET_STATEMENT, "ap"},
+    {"transfer", TRANSFER, "apgm"},   {"cancel-order", CANCEL_ORDER, "apo"}, {"accounts", LIST_ACCOUNTS, "ap"},
+    {"balance-at", BALANCE_AT, "apw"},
+};
+
+// A script request sent and not answered yet
+typedef struct
+{
+    int line;
+    const char *operation;
+    int socket;
+    struct timespec sent;
+} ScriptPending;
+
+typedef struct
+{
+    int count;
+    int failed;
+    double totalMicros;
+    double maxMicros;
+} ScriptStats;
+
+char scriptAccount[ACC_NUM_LENGTH + 1];
+char scriptPIN[PIN_LENGTH + 1];
+
+// Function to turn one script line into a request. Returns 1 for a
+// request, 0 for a blank or comment line and -1 for a line it cannot parse.
+int parseScriptLine(char *line, Request *request, const ScriptOperation **operation)
+{
+    memset(request, 0, sizeof(*request));
+    char *save;
+    char *word = strtok_r(line, " \t\r\n", &save);
+    if (word == NULL || word[0] == '#')
+    {
+        return 0;
+    }
+
+    *operation = NULL;
+    for (size_t i = 0; i < sizeof(SCRIPT_OPERATIONS) / sizeof(SCRIPT_OPERATIONS[0]); i++)
+    {
+        if (strcmp(word, SCRIPT_OPERATIONS[i].name) == 0)
+        {
+            *operation = &SCRIPT_OPERATIONS[i];
+        }
+    }
+    if (*operation == NULL)
+    {
+        return -1;
+    }
+    request->type = (*operation)->type;
+
+    for (const char *field = (*operation)->fields; *field != '\0'; field++)
+    {
+        word = strtok_r(NULL, " \t\r\n", &save);
+        if (word == NULL)
+        {
+            return -1;
+        }
+        word = strcmp(word, "$ACCOUNT") == 0 ? scriptAccount : strcmp(word, "$PIN") == 0 ? scriptPIN : word;
+
+        char *end = NULL;
+        switch (*field)
+        {
+        case 'a':
+            snprintf(request->accountNumber, sizeof(request->accountNumber), "%s", word);
+            break;
+        case 'p':
+            snprintf(request->pin, sizeof(request->pin), "%.*s", PIN_LENGTH, word);
+            break;
+        case 'n':
+            snprintf(request->name, sizeof(request->name), "%s", word);
+            for (char *c = request->name; *c != '\0'; c++)
+            {
+                *c = *c == '_' ? ' ' : *c;
+            }
+            break;
+        case 'i':
+            snprintf(request->nationalID, sizeof(request->nationalID), "%s", word);
+            break;
+        case 't':
+            if (strcmp(word, "savings") != 0 && strcmp(word, "checking") != 0)
+                return -1;
+            request->accountType = word[0] == 's' ? SAVINGS : CHECKING;
+            break;
+        case 'm':
+            request->amount = strtod(word, &end);
+            break;
+        case 'g':
+            snprintf(request->targetAccount, sizeof(request->targetAccount), "%s", word);
+            break;
+        case 'o':
+            request->orderId = strtoul(word, &end, 10);
+            break;
+        case 'w':
+            request->toTime = parseTimestamp(word);
+            if (request->toTime < 0)
+                return -1;
+            break;
+        }
+        if (end != NULL && (end == word || *end != '\0'))
+        {
+            return -1;
+        }
+    }
+
+    if (strtok_r(NULL, " \t\r\n", &save) != NULL)
+    {
+        return -1;
+    }
+    if (request->type == WITHDRAW || request->type == DEPOSIT_FUNDS)
+    {
+        do
+        {
+            secureRandom(&request->requestId, sizeof(request->requestId));
+        } while (request->requestId == 0);
+    }
+    return 1;
+}
+
+// Function to print one result line: line, operation, 1 or 0 for success,
+// microseconds from send to answer, balance, account, PIN and message, tab
+// separated, with - for fields that do not apply
+void printScriptResult(int line, const char *operation, int success, double micros, const Response *response)
+{
+    char message[MAX_BUFFER];
+    snprintf(message, sizeof(message), "%s", response->message);
+    for (char *c = message; *c != '\0'; c++)
+    {
+        *c = *c == '\n' || *c == '\t' ? ' ' : *c;
+    }
+
+    char balance[32] = "-";
+    if (success)
+    {
+        snprintf(balance, sizeof(balance), "%.2f", response->balance);
+    }
+    printf("%d\t%s\t%d\t%.1f\t%s\t%s\t%s\t%s\n", line, operation, success, micros, balance,
+           response->accountNumber[0] != '\0' ? response->accountNumber : "-",
+           response->pin[0] != '\0' ? response->pin : "-", message);
+}
+
+// Function to wait for the answer to the oldest request in flight. Each
+// connection answers in order, so it is the next answer on its socket.
+// Returns 0, or -1 when the connection was lost.
+int finishScriptRequest(const ScriptPending *pending, ScriptStats *stats)
+{
+    Response response;
+    if (recvAll(pending->socket, &response, sizeof(response)) < 0)
+    {
+        return -1;
+    }
+    response.message[MAX_BUFFER - 1] = '\0';
+    response.accountNumber[ACC_NUM_LENGTH] = '\0';
+    response.pin[PIN_LENGTH] = '\0';
+
+    // A statement's transactions or a listing's accounts follow; the count
+    // is all a script reports
+    for (int i = 0; i < response.transactionCount; i++)
+    {
+        Transaction transaction;
+        if (recvAll(pending->socket, &transaction, sizeof(transaction)) < 0)
+        {
+            return -1;
+        }
+    }
+    for (int i = 0; i < response.accountCount; i++)
+    {
+        AccountSummary summary;
+        if (recvAll(pending->socket, &summary, sizeof(summary)) < 0)
+        {
+            return -1;
+        }
+    }
+    if (response.success && response.message[0] == '\0')
+    {
+        snprintf(response.message, sizeof(response.message), "%d transactions", response.transactionCount);
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double micros = (now.tv_sec - pending->sent.tv_sec) * 1e6 + (now.tv_nsec - pending->sent.tv_nsec) / 1e3;
+    printScriptResult(pending->line, pending->operation, response.success, micros, &response);
+
+    if (response.success && response.pin[0] != '\0')
     {
-        perror("Connection Failed");
+        strcpy(scriptAccount, response.accountNumber);
+        strcpy(scriptPIN, response.pin);
+    }
+    stats->count++;
+    stats->failed += !response.success;
+    stats->totalMicros += micros;
+    stats->maxMicros = micros > stats->maxMicros ? micros : stats->maxMicros;
+    return 0;
+}
+
+// Function to wait for answers until at most keep requests are in flight.
+// Returns 0, or -1 when the connection was lost.
+int drainScript(ScriptPending *pending, int *oldest, int *inFlight, int keep, ScriptStats *stats)
+{
+    while (*inFlight > keep)
+    {
+        if (finishScriptRequest(&pending[*oldest], stats) < 0)
+        {
+            fprintf(stderr, "Error: Lost connection to server.\n");
+            return -1;
+        }
+        *oldest = (*oldest + 1) % SCRIPT_MAX_PIPELINE;
+        (*inFlight)--;
+    }
+    return 0;
+}
+
+// Function to run a script without the menu: the lines in ops, or else
+// those read from script. Up to depth requests are kept in flight, since
+// the server answers each connection in order. Results go to stdout, one
+// line each in script order, and a summary to stderr. Returns 0 when every
+// operation succeeded, 1 when some failed and -1 when the connection was lost.
+int runScript(FILE *script, char **ops, int opCount, int depth)
+{
+    ScriptPending pending[SCRIPT_MAX_PIPELINE];
+    ScriptStats stats = {0};
+    int oldest = 0;
+    int inFlight = 0;
+    int number = 0;
+    char text[512];
+    char line[512];
+    struct timespec start, end;
+
+    // Requests go out back to back; do not hold them for the previous ACK
+    int noDelay = 1;
+    for (int i = 0; i < shardCount; i++)
+    {
+        setsockopt(shardSockets[i], IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    printf("line\toperation\tok\tmicros\tbalance\taccount\tpin\tmessage\n");
+    while (opCount > 0 ? number < opCount : fgets(text, sizeof(text), script) != NULL)
+    {
+        if (opCount > 0)
+        {
+            snprintf(text, sizeof(text), "%s", ops[number]);
+        }
+        number++;
+
+        Request request;
+        const ScriptOperation *operation;
+        strcpy(line, text);
+        int parsed = parseScriptLine(line, &request, &operation);
+        if (parsed == 0)
+        {
+            continue;
+        }
+
+        // A line naming the last opened account, or one reported as
+        // unparseable, waits for the answers to everything before it
+        int usesLast = strchr(text, '$') != NULL;
+        if (drainScript(pending, &oldest, &inFlight, usesLast || parsed < 0 ? 0 : depth - 1, &stats) < 0)
+        {
+            return -1;
+        }
+        if (usesLast && parsed > 0)
+        {
+            strcpy(line, text);
+            parseScriptLine(line, &request, &operation);
+        }
+        if (parsed < 0)
+        {
+            Response response = {0};
+            strcpy(response.message, "Error: Cannot parse line.");
+            printScriptResult(number, "-", 0, 0, &response);
+            stats.count++;
+            stats.failed++;
+            continue;
+        }
+
+        ScriptPending *entry = &pending[(oldest + inFlight) % SCRIPT_MAX_PIPELINE];
+        entry->line = number;
+        entry->operation = operation->name;
+        entry->socket = request.type == OPEN_ACCOUNT ? shardSockets[shardForNationalID(request.nationalID, shardCount)]
+                                                     : socketForAccount(request.accountNumber);
+        clock_gettime(CLOCK_MONOTONIC, &entry->sent);
+        if (sendAll(entry->socket, &request, sizeof(request)) < 0)
+        {
+            fprintf(stderr, "Error: Lost connection to server.\n");
+            return -1;
+        }
+        inFlight++;
+    }
+    if (drainScript(pending, &oldest, &inFlight, 0, &stats) < 0)
+    {
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "%d operations, %d failed, in %.3f s (%.0f per second), %.1f us mean, %.1f us max\n",
+            stats.count, stats.failed, seconds, seconds > 0 ? stats.count / seconds : 0,
+            stats.count > 0 ? stats.totalMicros / stats.count : 0, stats.maxMicros);
+    return stats.failed > 0 ? 1 : 0;
+}
+
+// Function to follow the change-data-capture stream of the server at
+// sockfd from sequence from (0 for the oldest event still logged), printing
+// a tab-separated line per event: sequence, time, type, account, amount,
+// balance and description. Runs until the server hangs up. Returns -1 if
+// the subscription was refused or lost.
+int followEvents(int sockfd, unsigned long from)
+{
+    CdcHeader header;
+    if (sendAll(sockfd, &from, sizeof(from)) < 0 || recvAll(sockfd, &header, sizeof(header)) < 0)
+    {
+        fprintf(stderr, "Error: Lost connection to server.\n");
+        return -1;
+    }
+    if (header.status != CDC_STREAMING)
+    {
+        fprintf(stderr, "Error: The server's log holds events %lu to %lu only.\n", header.first, header.next - 1);
+        return -1;
+    }
+
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    printf("sequence\ttime\ttype\taccount\tamount\tbalance\tdescription\n");
+    CdcEvent event;
+    while (recvAll(sockfd, &event, sizeof(event)) == 0)
+    {
+        char date[20];
+        strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&event.timestamp));
+        event.accountNumber[ACC_NUM_LENGTH] = '\0';
+        event.description[MAX_NAME_LENGTH] = '\0';
+        printf("%lu\t%s\t%s\t%s\t%.2f\t%.2f\t%s\n", event.sequence, date, cdcEventTypeString(event.type),
+               event.accountNumber, event.amount, event.balance, event.description);
+    }
+
+    fprintf(stderr, "Server closed the event stream; resume with --events <last sequence + 1>.\n");
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    // --bench ACCOUNT PIN COUNT times balance checks instead of starting
+    // the menu
+    const char *benchAccount = NULL;
+    const char *benchPIN = NULL;
+    int benchCount = 0;
+    for (int i = 1; i + 3 < argc; i++)
+    {
+        if (strcmp(argv[i], "--bench") == 0)
+        {
+            benchAccount = argv[i + 1];
+            benchPIN = argv[i + 2];
+            benchCount = atoi(argv[i + 3]);
+            argc = i;
+            break;
+        }
+    }
+
+    // --script FILE (- for standard input) or any number of --op LINE run
+    // operations instead of starting the menu, --pipeline N keeping up to N
+    // requests in flight. --events FROM follows a server's --cdc-port instead.
+    // --tls CA_FILE talks TLS to servers with a certificate from CA_FILE, or
+    // from the system's trusted ones with "system".
+    const char *scriptPath = NULL;
+    const char *eventsFrom = NULL;
+    const char *tlsCA = NULL;
+    char *ops[argc];
+    int opCount = 0;
+    int depth = SCRIPT_DEFAULT_PIPELINE;
+    int optionsStart = argc;
+    for (int i = 1; i + 1 < argc; i++)
+    {
+        int known = 1;
+        if (strcmp(argv[i], "--script") == 0)
+            scriptPath = argv[i + 1];
+        else if (strcmp(argv[i], "--op") == 0)
+            ops[opCount++] = argv[i + 1];
+        else if (strcmp(argv[i], "--pipeline") == 0)
+            depth = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--events") == 0)
+            eventsFrom = argv[i + 1];
+        else if (strcmp(argv[i], "--tls") == 0)
+            tlsCA = argv[i + 1];
+        else
+            known = 0;
+
+        if (known)
+        {
+            optionsStart = i < optionsStart ? i : optionsStart;
+            i++;
+        }
+    }
+    argc = optionsStart;
+    if (depth < 1 || depth > SCRIPT_MAX_PIPELINE)
+    {
+        printf("Pipeline depth must be from 1 to %d.\n", SCRIPT_MAX_PIPELINE);
         return -1;
     }
 
-    printf("Connected to bank server.\n");
+    // Either an optional server address, e.g. a read-only replica, or
+    // --shards with every shard of a cluster in shard order
+    if (argc > 2 && strcmp(argv[1], "--shards") == 0)
+    {
+        shardCount = parseShardList(argv[2], shards, MAX_SHARDS);
+        if (shardCount < 1)
+        {
+            printf("Invalid shard list: %s\n", argv[2]);
+            return -1;
+        }
+    }
+    else
+    {
+        snprintf(shards[0].host, SHARD_HOST_LENGTH, "%s", argc > 1 ? argv[1] : "127.0.0.1");
+        shards[0].port = argc > 2 ? atoi(argv[2]) : PORT;
+    }
+
+    if (tlsCA != NULL)
+    {
+#ifdef BANK_TLS
+        // The event stream is plain TCP only
+        tlsContext = eventsFrom == NULL ? tlsClientContext(strcmp(tlsCA, "system") == 0 ? NULL : tlsCA) : NULL;
+        if (eventsFrom == NULL && tlsContext == NULL)
+        {
+            return -1;
+        }
+#else
+        printf("This client was built without TLS support (see BANK_TLS in the Makefile).\n");
+        return -1;
+#endif
+    }
+
+    // Connect to server
+    for (int i = 0; i < shardCount; i++)
+    {
+        shardSockets[i] = connectShard(i, 1);
+        if (shardSockets[i] < 0)
+        {
+            perror("Connection Failed");
+            return -1;
+        }
+    }
+
+    if (eventsFrom != NULL)
+    {
+        return followEvents(shardSockets[0], strtoul(eventsFrom, NULL, 10));
+    }
+    if (scriptPath != NULL || opCount > 0)
+    {
+        FILE *script = scriptPath == NULL || strcmp(scriptPath, "-") == 0 ? stdin : fopen(scriptPath, "r");
+        if (script == NULL)
+        {
+            perror(scriptPath);
+            return -1;
+        }
+        return runScript(script, ops, opCount, depth);
+    }
+
+    if (shardCount > 1)
+    {
+        printf("Connected to %d bank server shards.\n", shardCount);
+    }
+    else
+    {
+        printf("Connected to bank server.\n");
+    }
+
+    if (benchAccount != NULL)
+    {
+        return benchCount > 0 ? runBenchmark(benchAccount, benchPIN, benchCount) : -1;
+    }
 
     int choice;
     do
@@ -251,22 +1231,37 @@ int main()
         switch (choice)
         {
         case 1:
-            openAccount(sockfd);
+            openAccount();
             break;
         case 2:
-            closeAccount(sockfd);
+            closeAccount();
             break;
         case 3:
-            withdraw(sockfd);
+            withdraw();
             break;
         case 4:
-            deposit(sockfd);
+            deposit();
             break;
         case 5:
-            checkBalance(sockfd);
+            checkBalance();
             break;
         case 6:
-            getStatement(sockfd);
+            getStatement();
+            break;
+        case 7:
+            transfer();
+            break;
+        case 8:
+            scheduleOrder();
+            break;
+        case 9:
+            cancelOrder();
+            break;
+        case 10:
+            listAccounts();
+            break;
+        case 11:
+            balanceAt();
             break;
         case 0:
             printf("Thank you for using our banking system. Goodbye!\n");
@@ -276,6 +1271,9 @@ int main()
         }
     } while (choice != 0);
 
-    close(sockfd);
+    for (int i = 0; i < shardCount; i++)
+    {
+        disconnect(shardSockets[i]);
+    }
     return 0;
 }
\ No newline at end of file
@@ -11,6 +11,13 @@
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/random.h>
+#include <stdint.h>
+#include "bank_tls.h"
 
 #define PORT 8080
 #define MAX_BUFFER 1024
@@ -18,11 +25,19 @@
 #define MIN_BALANCE 1000
 #define MIN_TRANSACTION 500
 #define MAX_TRANSACTIONS 100
+#define HISTORY_BYTES 1200 // Room for MAX_TRANSACTIONS transfers; see bank_history.h
 #define MAX_NAME_LENGTH 50
 #define ID_LENGTH 20
 #define PIN_LENGTH 6
+#define PIN_SALT_LENGTH 16
+#define PIN_HASH_LENGTH 32
 #define ACC_NUM_LENGTH 10
 #define MAX_TRANSACTIONS_IN_STATEMENT 5
+#define MAX_STATEMENT_PAGE MAX_TRANSACTIONS
+#define RESPONSE_MAX_IOV 4
+#define SEND_TIMEOUT 5000 // Milliseconds to wait on a full socket buffer
+#define ACCOUNT_SEQUENCE_LIMIT 1000000000UL // Sequences fill the 9 digits before the check digit
+#define PIN_RANGE 1000000U
 
 // Account type enum
 typedef enum
@@ -48,17 +63,27 @@ typedef struct
 } Transaction;
 
 // Account structure
+// The PIN is kept only as a salted PBKDF2 hash (see bank_auth.h). The last
+// transactionCount transactions are kept encoded in history (see
+// bank_history.h); the oldest are dropped past MAX_TRANSACTIONS or when it
+// is full. accruedPeriod is the month (see accrualPeriod) of the last
+// interest or fee posting, so a batch rerun never posts twice.
 typedef struct
 {
     char accountNumber[ACC_NUM_LENGTH + 1];
-    char pin[PIN_LENGTH + 1];
+    unsigned char pinSalt[PIN_SALT_LENGTH];
+    unsigned char pinHash[PIN_HASH_LENGTH];
     char name[MAX_NAME_LENGTH + 1];
     char nationalID[ID_LENGTH + 1];
     AccountType type;
     double balance;
-    Transaction transactions[MAX_TRANSACTIONS];
     int transactionCount;
+    int historyLength;  // Bytes of history in use
+    time_t historyBase; // Time the first entry's delta counts from
+    time_t historyLast; // Time of the newest entry
+    unsigned char history[HISTORY_BYTES];
     int isActive;
+    int accruedPeriod;
 } Account;
 
 // Request type enum
@@ -70,10 +95,42 @@ typedef enum
     DEPOSIT_FUNDS,
     CHECK_BALANCE,
     GET_STATEMENT,
+    TRANSFER,
+    PREPARE_TRANSFER, // Shard-to-shard steps of a cross-shard transfer, which
+    COMMIT_TRANSFER,  // the source shard also logs (see bank_oplog.h)
+    ABORT_TRANSFER,
+    SCHEDULE_ORDER, // Set up or cancel a standing order
+    CANCEL_ORDER,
+    LIST_ACCOUNTS,      // Every open account of the customer who holds accountNumber
+    BALANCE_AT,         // The balance of accountNumber at the end of second toTime
+    ACCRUAL,            // Interest or a monthly fee; written to the operation log only
+    TRANSFER_DELIVERED, // The target shard has a transfer's outcome; operation log only
     INVALID_REQUEST
 } RequestType;
 
+// Statement continuation cursor: the timestamp of the last transaction
+// returned and how many transactions with that timestamp have been returned.
+// Resuming from it stays correct when old history is dropped in between.
+typedef struct
+{
+    time_t timestamp;
+    int offset;
+} StatementCursor;
+
 // Request structure
+// For GET_STATEMENT, pageSize 0 asks for the last
+// MAX_TRANSACTIONS_IN_STATEMENT transactions. A positive pageSize pages
+// forward through [fromTime, toTime] (0 meaning unbounded), starting at
+// cursor when its timestamp is set.
+// For TRANSFER, amount moves from accountNumber to targetAccount. Between
+// shards the same fields carry the transfer's id and, in name, the cluster
+// secret.
+// For SCHEDULE_ORDER, orderType (DEPOSIT_FUNDS, WITHDRAW or TRANSFER) with
+// amount and targetAccount runs at runAt (0 meaning now) and then every
+// interval seconds (0 meaning once). CANCEL_ORDER cancels orderId.
+// For WITHDRAW and DEPOSIT_FUNDS, a nonzero requestId makes retries safe:
+// a request repeating an ID already applied to the account gets the first
+// answer again instead of being applied twice.
 typedef struct
 {
     RequestType type;
@@ -83,9 +140,31 @@ typedef struct
     char nationalID[ID_LENGTH + 1];
     AccountType accountType;
     double amount;
+    int pageSize;
+    time_t fromTime;
+    time_t toTime;
+    StatementCursor cursor;
+    char targetAccount[ACC_NUM_LENGTH + 1];
+    unsigned long transferId;
+    RequestType orderType;
+    time_t runAt;
+    long interval;
+    unsigned long orderId;
+    unsigned long requestId;
 } Request;
 
+// One line of a customer's account listing
+typedef struct
+{
+    char accountNumber[ACC_NUM_LENGTH + 1];
+    AccountType type;
+    double balance;
+} AccountSummary;
+
 // Response structure
+// A statement response is followed on the wire by transactionCount
+// Transaction records, and an account listing by accountCount
+// AccountSummary records. hasMore on a listing means it was cut short.
 typedef struct
 {
     int success;
@@ -93,19 +172,157 @@ typedef struct
     char accountNumber[ACC_NUM_LENGTH + 1];
     char pin[PIN_LENGTH + 1];
     double balance;
-    Transaction transactions[MAX_TRANSACTIONS_IN_STATEMENT];
     int transactionCount;
+    StatementCursor nextCursor;
+    int hasMore;
+    int retryAfter; // Seconds to back off when the server refused the request
+    int accountCount;
 } Response;
 
+// Records sent after a Response. The iovecs point at a buffer of the
+// serving thread, such as a statement page decoded from the account's
+// history, which stays valid until that thread answers its next request.
+typedef struct
+{
+    struct iovec iov[RESPONSE_MAX_IOV];
+    int iovcnt;
+} ResponsePayload;
+
 // Helper functions
-void generateAccountNumber(char *accountNumber)
+// Luhn check digit for a string of digits, as used on card numbers; it
+// catches any single mistyped digit and most swapped neighbours
+int luhnCheckDigit(const char *digits)
+{
+    int sum = 0;
+    int length = strlen(digits);
+    for (int i = 0; i < length; i++)
+    {
+        int digit = digits[length - 1 - i] - '0';
+        if (i % 2 == 0)
+        {
+            digit *= 2;
+            if (digit > 9)
+                digit -= 9;
+        }
+        sum += digit;
+    }
+    return (10 - sum % 10) % 10;
+}
+
+// Account numbers are nine digits of sequence plus a check digit, so
+// distinct sequence numbers always give distinct account numbers
+void generateAccountNumber(char *accountNumber, unsigned long sequence)
 {
-    sprintf(accountNumber, "%010ld", rand() % 10000000000L);
+    sprintf(accountNumber, "%09lu", sequence % ACCOUNT_SEQUENCE_LIMIT);
+    accountNumber[ACC_NUM_LENGTH - 1] = '0' + luhnCheckDigit(accountNumber);
+    accountNumber[ACC_NUM_LENGTH] = '\0';
+}
+
+// Fill buffer from the kernel's cryptographically secure generator
+void secureRandom(void *buffer, size_t length)
+{
+    char *next = buffer;
+    while (length > 0)
+    {
+        ssize_t got = getrandom(next, length, 0);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0)
+        {
+            perror("getrandom failed");
+            exit(EXIT_FAILURE);
+        }
+        next += got;
+        length -= got;
+    }
 }
 
 void generatePIN(char *pin)
 {
-    sprintf(pin, "%06d", rand() % 1000000);
+    // Redraw values from the incomplete top range so every PIN is equally likely
+    uint32_t value;
+    do
+    {
+        secureRandom(&value, sizeof(value));
+    } while (value >= UINT32_MAX - UINT32_MAX % PIN_RANGE);
+    sprintf(pin, "%06u", (unsigned)(value % PIN_RANGE));
+}
+
+// Month a time falls in, counted from 1900, as used for monthly interest
+// and fees
+int accrualPeriod(time_t timestamp)
+{
+    struct tm local;
+    localtime_r(&timestamp, &local);
+    return local.tm_year * 12 + local.tm_mon;
+}
+
+// Parse a local time written YYYY-MM-DD HH:MM:SS (a T may stand for the
+// space; the seconds, or the whole time of day, may be left out), or a
+// count of seconds since the epoch. Returns -1 when it is neither.
+time_t parseTimestamp(const char *text)
+{
+    struct tm when = {0};
+    char separator = ' ';
+    char *end;
+    long seconds = strtol(text, &end, 10);
+    if (end != text && *end == '\0')
+    {
+        return seconds;
+    }
+    int fields = sscanf(text, "%d-%d-%d%c%d:%d:%d", &when.tm_year, &when.tm_mon, &when.tm_mday, &separator,
+                        &when.tm_hour, &when.tm_min, &when.tm_sec);
+    if ((fields != 3 && fields < 6) || (separator != ' ' && separator != 'T'))
+    {
+        return -1;
+    }
+    when.tm_year -= 1900;
+    when.tm_mon -= 1;
+    when.tm_isdst = -1;
+    return mktime(&when);
+}
+
+// Write amount with two decimals, as "%.2f" would, and return the end of
+// the text. Rounding to whole cents in integer arithmetic skips printf's
+// format parsing and locale lookups, which dominated cheap requests such as
+// balance checks; amounts too large for it fall back to sprintf.
+char *formatAmount(char *out, double amount)
+{
+    if (!(amount > -1e15 && amount < 1e15))
+    {
+        return out + sprintf(out, "%.2f", amount);
+    }
+
+    // A double times 100 fits a long double's 64-bit mantissa exactly, so
+    // halves are seen as printf sees them and go to the even cent
+    long double scaled = (long double)(amount < 0 ? -amount : amount) * 100;
+    uint64_t cents = (uint64_t)scaled;
+    long double rest = scaled - cents;
+    if (rest > 0.5L || (rest == 0.5L && (cents & 1)))
+    {
+        cents++;
+    }
+    char digits[24];
+    int count = 0;
+    do
+    {
+        digits[count++] = '0' + cents % 10;
+        cents /= 10;
+    } while (cents > 0 || count < 3);
+
+    if (amount < 0)
+    {
+        *out++ = '-';
+    }
+    while (count > 2)
+    {
+        *out++ = digits[--count];
+    }
+    *out++ = '.';
+    *out++ = digits[1];
+    *out++ = digits[0];
+    *out = '\0';
+    return out;
 }
 
 const char *getAccountTypeString(AccountType type)
@@ -118,4 +335,96 @@ const char *getTransactionTypeString(TransactionType type)
     return type == DEPOSIT ? "Deposit" : "Withdrawal";
 }
 
+// Receive exactly length bytes. Returns 0 on success, -1 on error or disconnect.
+int recvAll(int socket, void *buffer, size_t length)
+{
+#ifdef BANK_TLS
+    if (tlsSession(socket) != NULL)
+        return tlsRecvAll(tlsSession(socket), buffer, length);
+#endif
+    char *next = buffer;
+    while (length > 0)
+    {
+        ssize_t received = recv(socket, next, length, 0);
+        if (received < 0 && errno == EINTR)
+            continue;
+        if (received <= 0)
+            return -1;
+        next += received;
+        length -= received;
+    }
+    return 0;
+}
+
+// Advance msg past sent bytes: skip the fully written iovecs and trim the
+// partially written one. Returns the number of iovecs left to send.
+size_t skipSent(struct msghdr *msg, size_t sent)
+{
+    while (msg->msg_iovlen > 0 && sent >= msg->msg_iov->iov_len)
+    {
+        sent -= msg->msg_iov->iov_len;
+        msg->msg_iov++;
+        msg->msg_iovlen--;
+    }
+    if (msg->msg_iovlen > 0)
+    {
+        msg->msg_iov->iov_base = (char *)msg->msg_iov->iov_base + sent;
+        msg->msg_iov->iov_len -= sent;
+    }
+    return msg->msg_iovlen;
+}
+
+// Send as much of msg as the socket takes, advancing msg past what went
+// out. On a non-blocking socket this stops once the buffer is full. Returns
+// the number of iovecs left to send, or -1 on error.
+int sendAvailable(int socket, struct msghdr *msg)
+{
+    while (msg->msg_iovlen > 0)
+    {
+        ssize_t sent = sendmsg(socket, msg, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (sent < 0)
+            return -1;
+        skipSent(msg, sent);
+    }
+    return msg->msg_iovlen;
+}
+
+// Send a response and its payload records with one gathered sendmsg,
+// resuming after partial writes. Returns 0 on success, -1 on error.
+int sendResponse(int socket, const Response *response, const ResponsePayload *payload)
+{
+    struct iovec iov[RESPONSE_MAX_IOV + 1];
+    int iovcnt = 0;
+
+    iov[iovcnt].iov_base = (void *)response;
+    iov[iovcnt].iov_len = sizeof(Response);
+    iovcnt++;
+    for (int i = 0; payload != NULL && i < payload->iovcnt; i++)
+    {
+        iov[iovcnt++] = payload->iov[i];
+    }
+#ifdef BANK_TLS
+    // Without kTLS, OpenSSL has to encrypt the records itself
+    if (tlsSession(socket) != NULL && !tlsKernelSend(socket))
+        return tlsSendv(tlsSession(socket), iov, iovcnt);
+#endif
+
+    struct msghdr msg = {0};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+    int left;
+    while ((left = sendAvailable(socket, &msg)) > 0)
+    {
+        // Non-blocking socket with a full buffer: wait for room
+        struct pollfd pfd = {socket, POLLOUT, 0};
+        if (poll(&pfd, 1, SEND_TIMEOUT) <= 0)
+            return -1;
+    }
+    return left;
+}
+
 #endif // BANK_COMMON_H
\ No newline at end of file
@@ -0,0 +1,97 @@
+// Secondary index from a customer's national ID to the slots of their open
+// accounts
+
+#ifndef BANK_CUSTOMER_H
+#define BANK_CUSTOMER_H
+
+#include "bank_common.h"
+#include "bank_ratelimit.h"
+
+#define CUSTOMER_BUCKETS (MAX_ACCOUNTS * 2) // Keeps chains short at any table size
+#define MAX_LISTED_ACCOUNTS 64              // Accounts one LIST_ACCOUNTS answer holds
+
+// Slots are chained per hash bucket through next, so adding or dropping an
+// account is O(1) plus the length of its chain, and finding a customer's
+// accounts never looks at anyone else's beyond a shared bucket. Accounts
+// without a national ID are not indexed. The index holds slot numbers
+// only, so it can live in shared memory next to the accounts.
+typedef struct
+{
+    int buckets[CUSTOMER_BUCKETS];
+    int next[MAX_ACCOUNTS]; // Next slot in the same bucket, or -1
+} CustomerIndex;
+
+unsigned long customerBucket(const char *nationalID)
+{
+    return hashKey(nationalID) % CUSTOMER_BUCKETS;
+}
+
+void customerIndexClear(CustomerIndex *index)
+{
+    for (int i = 0; i < CUSTOMER_BUCKETS; i++)
+    {
+        index->buckets[i] = -1;
+    }
+}
+
+void customerIndexAdd(CustomerIndex *index, const Account *accounts, int slot)
+{
+    if (accounts[slot].nationalID[0] == '\0')
+    {
+        return;
+    }
+    int *bucket = &index->buckets[customerBucket(accounts[slot].nationalID)];
+    index->next[slot] = *bucket;
+    *bucket = slot;
+}
+
+void customerIndexRemove(CustomerIndex *index, const Account *accounts, int slot)
+{
+    if (accounts[slot].nationalID[0] == '\0')
+    {
+        return;
+    }
+    int *link = &index->buckets[customerBucket(accounts[slot].nationalID)];
+    while (*link >= 0 && *link != slot)
+    {
+        link = &index->next[*link];
+    }
+    if (*link == slot)
+    {
+        *link = index->next[slot];
+    }
+}
+
+// Index every open account of a freshly loaded table
+void customerIndexBuild(CustomerIndex *index, const Account *accounts, int count)
+{
+    customerIndexClear(index);
+    for (int slot = 0; slot < count; slot++)
+    {
+        if (accounts[slot].isActive)
+        {
+            customerIndexAdd(index, accounts, slot);
+        }
+    }
+}
+
+// Find the slots of a customer's accounts, newest first. Fills up to max
+// slots and returns how many accounts the customer has in all.
+int customerIndexFind(const CustomerIndex *index, const Account *accounts, const char *nationalID, int *slots, int max)
+{
+    int found = 0;
+    for (int slot = index->buckets[customerBucket(nationalID)]; slot >= 0; slot = index->next[slot])
+    {
+        if (strcmp(accounts[slot].nationalID, nationalID) == 0)
+        {
+            if (found < max)
+            {
+                slots[found] = slot;
+            }
+            found++;
+        }
+    }
+    return found;
+}
+
+#endif // BANK_CUSTOMER_H
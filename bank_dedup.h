@@ -0,0 +1,129 @@
+// Table of recently applied client request IDs, so a retried deposit or
+// withdrawal is answered without being applied twice
+
+#ifndef BANK_DEDUP_H
+#define BANK_DEDUP_H
+
+#include "bank_common.h"
+#include "bank_ratelimit.h"
+
+#define DEDUP_CAPACITY 65536 // Request IDs remembered at most
+#define DEDUP_BUCKETS 65536
+#define DEDUP_TTL 86400 // Seconds a request ID is remembered
+
+// Outcome of one applied request
+typedef struct
+{
+    char accountNumber[ACC_NUM_LENGTH + 1];
+    RequestType type;
+    unsigned long requestId;
+    time_t appliedAt;
+    double amount;
+    double balance; // Balance right after it was applied
+    int next;       // Next entry in the same hash bucket, or -1
+} DedupEntry;
+
+// Entries are kept in a ring in the order they were applied, which is also
+// the order they expire in, so evicting the oldest is O(1): it is always at
+// the tail. Lookups go through hash buckets chained by entry index. The
+// table lives in shared memory so forked children see each other's entries.
+typedef struct
+{
+    pthread_mutex_t lock;
+    unsigned long head; // Entries ever added; the next goes to head % DEDUP_CAPACITY
+    unsigned long tail; // Oldest entry still in the table
+    int buckets[DEDUP_BUCKETS];
+    DedupEntry entries[DEDUP_CAPACITY];
+} DedupTable;
+
+DedupTable *createDedupTable()
+{
+    DedupTable *table = mapShared(sizeof(DedupTable));
+    if (table == NULL)
+    {
+        return NULL;
+    }
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&table->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    for (int i = 0; i < DEDUP_BUCKETS; i++)
+    {
+        table->buckets[i] = -1;
+    }
+    return table;
+}
+
+unsigned long dedupBucket(const char *accountNumber, unsigned long requestId)
+{
+    return (hashKey(accountNumber) ^ (requestId * 0x9e3779b97f4a7c15UL)) % DEDUP_BUCKETS;
+}
+
+// Drop the oldest entry. Must be called with the lock held.
+void dedupEvict(DedupTable *table)
+{
+    int index = table->tail % DEDUP_CAPACITY;
+    DedupEntry *entry = &table->entries[index];
+    int *link = &table->buckets[dedupBucket(entry->accountNumber, entry->requestId)];
+    while (*link != index)
+    {
+        link = &table->entries[*link].next;
+    }
+    *link = entry->next;
+    table->tail++;
+}
+
+// Find the outcome of a request ID used on an account within DEDUP_TTL of
+// now. Returns 1 and fills found if there is one.
+int dedupLookup(DedupTable *table, const char *accountNumber, unsigned long requestId, time_t now, DedupEntry *found)
+{
+    int seen = 0;
+    pthread_mutex_lock(&table->lock);
+    for (int index = table->buckets[dedupBucket(accountNumber, requestId)]; index >= 0 && !seen;
+         index = table->entries[index].next)
+    {
+        const DedupEntry *entry = &table->entries[index];
+        if (entry->requestId == requestId && strcmp(entry->accountNumber, accountNumber) == 0 &&
+            now - entry->appliedAt < DEDUP_TTL)
+        {
+            *found = *entry;
+            seen = 1;
+        }
+    }
+    pthread_mutex_unlock(&table->lock);
+    return seen;
+}
+
+// Remember an applied request, first dropping entries past DEDUP_TTL and,
+// when the table is full, the oldest one
+void dedupRemember(DedupTable *table, const char *accountNumber, unsigned long requestId, RequestType type,
+                   double amount, double balance, time_t appliedAt)
+{
+    pthread_mutex_lock(&table->lock);
+    while (table->tail < table->head &&
+           (table->head - table->tail >= DEDUP_CAPACITY ||
+            appliedAt - table->entries[table->tail % DEDUP_CAPACITY].appliedAt >= DEDUP_TTL))
+    {
+        dedupEvict(table);
+    }
+
+    int index = table->head % DEDUP_CAPACITY;
+    DedupEntry *entry = &table->entries[index];
+    strcpy(entry->accountNumber, accountNumber);
+    entry->type = type;
+    entry->requestId = requestId;
+    entry->appliedAt = appliedAt;
+    entry->amount = amount;
+    entry->balance = balance;
+
+    int *bucket = &table->buckets[dedupBucket(accountNumber, requestId)];
+    entry->next = *bucket;
+    *bucket = index;
+    table->head++;
+    pthread_mutex_unlock(&table->lock);
+}
+
+#endif // BANK_DEDUP_H
@@ -0,0 +1,309 @@
+// Velocity and unusual-amount checks on withdrawals, shared between the
+// server and its children
+
+#ifndef BANK_FRAUD_H
+#define BANK_FRAUD_H
+
+#include "bank_common.h"
+#include "bank_ratelimit.h"
+
+#define FRAUD_TABLE_SIZE 1024
+#define FRAUD_PROBE_LIMIT 8
+#define FRAUD_BUCKETS 8 // Each window moves in steps of an eighth of its length
+#define FRAUD_AVERAGE_WEIGHT 0.125 // Weight of the newest amount in the running average
+
+// Limits, each 0 to turn it off. Counts and sums are over a sliding window
+// of the given seconds.
+typedef struct
+{
+    int maxWithdrawals;
+    int withdrawalWindow;
+    double maxWithdrawn;
+    int withdrawnWindow;
+    int maxPinFailures;
+    int pinFailureWindow;
+    double unusualFactor;  // Refuse amounts this many times the account's average
+    double unusualMinimum; // but only from this amount up
+    int lockout;           // Seconds withdrawals stay blocked once a limit is crossed
+} FraudRules;
+
+static const FraudRules DEFAULT_FRAUD_RULES = {10, 600, 50000, 86400, 5, 900, 10, 10000, 900};
+
+// Events or cents in a window, kept as FRAUD_BUCKETS partial totals plus
+// their sum. Moving the window on only clears the buckets it passes, so
+// recording an event costs O(1) however busy the account is.
+typedef struct
+{
+    uint32_t bucket; // Number of the newest bucket, in bucket widths since start
+    uint32_t total;
+    uint32_t counts[FRAUD_BUCKETS];
+} SlidingWindow;
+
+// Per-account state, claimed like the rate limiter's buckets
+typedef struct
+{
+    char key[ACC_NUM_LENGTH + 1];
+    SlidingWindow withdrawals;
+    SlidingWindow withdrawn; // In cents
+    SlidingWindow pinFailures;
+    float averageAmount;
+    double lastUsed;
+    double lockedUntil;
+} FraudEntry;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    FraudRules rules;
+    FraudEntry entries[FRAUD_TABLE_SIZE];
+} FraudMonitor;
+
+// Create a monitor applying rules
+FraudMonitor *createFraudMonitor(const FraudRules *rules)
+{
+    FraudMonitor *monitor = mapShared(sizeof(FraudMonitor));
+    if (monitor == NULL)
+    {
+        return NULL;
+    }
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&monitor->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    monitor->rules = *rules;
+    return monitor;
+}
+
+// Read rules from path, one per line, over the defaults:
+//   max-withdrawals COUNT SECONDS
+//   max-withdrawn AMOUNT SECONDS
+//   max-pin-failures COUNT SECONDS
+//   unusual-amount FACTOR MINIMUM
+//   lockout SECONDS
+// Blank lines and lines starting with # are skipped. Returns 0, or -1 after
+// reporting the first bad line.
+int loadFraudRules(const char *path, FraudRules *rules)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+
+    *rules = DEFAULT_FRAUD_RULES;
+    char line[256];
+    int number = 0;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        char name[32];
+        double value;
+        double extra = 0;
+        number++;
+        int fields = sscanf(line, "%31s %lf %lf", name, &value, &extra);
+        if (fields <= 0 || name[0] == '#')
+        {
+            continue;
+        }
+
+        int ok = fields >= 2 && value >= 0 && extra >= 0;
+        if (ok && strcmp(name, "max-withdrawals") == 0 && fields == 3)
+        {
+            rules->maxWithdrawals = value;
+            rules->withdrawalWindow = extra;
+        }
+        else if (ok && strcmp(name, "max-withdrawn") == 0 && fields == 3)
+        {
+            rules->maxWithdrawn = value;
+            rules->withdrawnWindow = extra;
+        }
+        else if (ok && strcmp(name, "max-pin-failures") == 0 && fields == 3)
+        {
+            rules->maxPinFailures = value;
+            rules->pinFailureWindow = extra;
+        }
+        else if (ok && strcmp(name, "unusual-amount") == 0 && fields == 3)
+        {
+            rules->unusualFactor = value;
+            rules->unusualMinimum = extra;
+        }
+        else if (ok && strcmp(name, "lockout") == 0 && fields == 2)
+        {
+            rules->lockout = value;
+        }
+        else
+        {
+            fprintf(stderr, "%s:%d: invalid fraud rule: %s", path, number, line);
+            fclose(file);
+            return -1;
+        }
+    }
+    fclose(file);
+    return 0;
+}
+
+// Move the window on to now and return its total
+uint32_t windowTotal(SlidingWindow *window, int seconds, double now)
+{
+    double width = seconds > 0 ? (double)seconds / FRAUD_BUCKETS : 1;
+    uint32_t bucket = (uint32_t)(now / width);
+    uint32_t gap = bucket - window->bucket;
+    if (gap >= FRAUD_BUCKETS)
+    {
+        memset(window->counts, 0, sizeof(window->counts));
+        window->total = 0;
+    }
+    else
+    {
+        for (uint32_t i = 1; i <= gap; i++)
+        {
+            uint32_t *count = &window->counts[(window->bucket + i) % FRAUD_BUCKETS];
+            window->total -= *count;
+            *count = 0;
+        }
+    }
+    window->bucket = bucket;
+    return window->total;
+}
+
+// Add to the newest bucket of a window already moved on by windowTotal
+void windowAdd(SlidingWindow *window, uint32_t amount)
+{
+    window->counts[window->bucket % FRAUD_BUCKETS] += amount;
+    window->total += amount;
+}
+
+// Find the entry for an account, claiming a free or the stalest one in its
+// probe window. Entries still locked out are only reused as a last resort.
+// Must be called with the lock held.
+FraudEntry *findFraudEntry(FraudMonitor *monitor, const char *accountNumber, double now)
+{
+    unsigned long index = hashKey(accountNumber) % FRAUD_TABLE_SIZE;
+    FraudEntry *victim = NULL;
+
+    for (int i = 0; i < FRAUD_PROBE_LIMIT; i++)
+    {
+        FraudEntry *entry = &monitor->entries[(index + i) % FRAUD_TABLE_SIZE];
+        if (strcmp(entry->key, accountNumber) == 0)
+        {
+            return entry;
+        }
+        if (entry->key[0] == '\0')
+        {
+            victim = entry;
+            break;
+        }
+        if (victim == NULL || (victim->lockedUntil > now && entry->lockedUntil <= now) ||
+            ((victim->lockedUntil > now) == (entry->lockedUntil > now) && entry->lastUsed < victim->lastUsed))
+        {
+            victim = entry;
+        }
+    }
+
+    memset(victim, 0, sizeof(*victim));
+    strncpy(victim->key, accountNumber, ACC_NUM_LENGTH);
+    return victim;
+}
+
+// Seconds left on a lockout, rounded up
+int lockoutLeft(const FraudEntry *entry, double now)
+{
+    return entry->lockedUntil > now ? (int)(entry->lockedUntil - now) + 1 : 0;
+}
+
+// Check a withdrawal against the rules and, when it passes, count it.
+// Returns 0 when allowed, otherwise the seconds until withdrawals are
+// allowed again, with *rule naming the limit that was crossed. A NULL
+// monitor allows all.
+int fraudAdmitWithdrawal(FraudMonitor *monitor, const char *accountNumber, double amount, const char **rule)
+{
+    if (monitor == NULL)
+    {
+        return 0;
+    }
+
+    const FraudRules *rules = &monitor->rules;
+    double now = monotonicSeconds();
+    uint32_t cents = amount * 100 < UINT32_MAX ? (uint32_t)(amount * 100 + 0.5) : UINT32_MAX;
+    int retryAfter = 0;
+
+    pthread_mutex_lock(&monitor->lock);
+    FraudEntry *entry = findFraudEntry(monitor, accountNumber, now);
+    entry->lastUsed = now;
+    *rule = "lockout";
+
+    if (entry->lockedUntil <= now)
+    {
+        *rule = NULL;
+        if (rules->maxWithdrawals > 0 &&
+            windowTotal(&entry->withdrawals, rules->withdrawalWindow, now) + 1 > (uint32_t)rules->maxWithdrawals)
+        {
+            *rule = "too many withdrawals";
+        }
+        else if (rules->maxWithdrawn > 0 &&
+                 windowTotal(&entry->withdrawn, rules->withdrawnWindow, now) + (double)cents > rules->maxWithdrawn * 100)
+        {
+            *rule = "too much withdrawn";
+        }
+        else if (rules->unusualFactor > 0 && entry->averageAmount > 0 && amount >= rules->unusualMinimum &&
+                 amount > rules->unusualFactor * entry->averageAmount)
+        {
+            *rule = "unusual amount";
+        }
+
+        if (*rule != NULL)
+        {
+            entry->lockedUntil = now + rules->lockout;
+        }
+    }
+
+    if (*rule == NULL)
+    {
+        if (rules->maxWithdrawals > 0)
+            windowAdd(&entry->withdrawals, 1);
+        if (rules->maxWithdrawn > 0)
+            windowAdd(&entry->withdrawn, cents);
+        entry->averageAmount = entry->averageAmount > 0
+                                   ? entry->averageAmount + FRAUD_AVERAGE_WEIGHT * (amount - entry->averageAmount)
+                                   : amount;
+    }
+    else
+    {
+        // A lockout of 0 seconds still refuses the withdrawal that crossed the limit
+        retryAfter = lockoutLeft(entry, now);
+        retryAfter = retryAfter > 0 ? retryAfter : 1;
+    }
+    pthread_mutex_unlock(&monitor->lock);
+    return retryAfter;
+}
+
+// Count a wrong PIN against an account, locking out its withdrawals once
+// there are too many. Returns the seconds of lockout left, or 0.
+int fraudRecordPinFailure(FraudMonitor *monitor, const char *accountNumber)
+{
+    if (monitor == NULL || monitor->rules.maxPinFailures <= 0)
+    {
+        return 0;
+    }
+
+    const FraudRules *rules = &monitor->rules;
+    double now = monotonicSeconds();
+
+    pthread_mutex_lock(&monitor->lock);
+    FraudEntry *entry = findFraudEntry(monitor, accountNumber, now);
+    entry->lastUsed = now;
+    windowTotal(&entry->pinFailures, rules->pinFailureWindow, now);
+    windowAdd(&entry->pinFailures, 1);
+    if (entry->pinFailures.total >= (uint32_t)rules->maxPinFailures && entry->lockedUntil <= now)
+    {
+        entry->lockedUntil = now + rules->lockout;
+    }
+    int left = lockoutLeft(entry, now);
+    pthread_mutex_unlock(&monitor->lock);
+    return left;
+}
+
+#endif // BANK_FRAUD_H
@@ -0,0 +1,352 @@
+// Compact encoding of account transaction history
+
+#ifndef BANK_HISTORY_H
+#define BANK_HISTORY_H
+
+#include "bank_common.h"
+
+// Each entry is a tag byte followed by varints:
+//   tag   bit 0 the TransactionType, bits 1-3 the description kind, bit 4
+//         set when the amount is a raw double, bit 5 when a request ID follows
+//   time  zigzag delta from the previous entry's timestamp
+//   amount in cents, or 8 raw bytes when it is not a whole number of cents
+//   then, for transfers, the other account number as an integer, or for
+//   any other description, its length and bytes
+//   then the client's request ID, for a deposit or withdrawal that had one,
+//   so a retry is still recognized after a crash lost the log record
+// A deposit takes about 6 bytes and a transfer about 12, against 128 for a
+// Transaction.
+#define HISTORY_TYPE_MASK 0x01
+#define HISTORY_KIND_SHIFT 1
+#define HISTORY_KIND_MASK 0x0e
+#define HISTORY_RAW_AMOUNT 0x10
+#define HISTORY_REQUEST_ID 0x20
+#define HISTORY_MAX_ENTRY 144
+
+// Description kinds. Descriptions the servers write are interned; anything
+// else is stored as text.
+typedef enum
+{
+    HISTORY_INITIAL_DEPOSIT,
+    HISTORY_DEPOSIT,
+    HISTORY_WITHDRAWAL,
+    HISTORY_TRANSFER_TO,
+    HISTORY_TRANSFER_FROM,
+    HISTORY_INTEREST,
+    HISTORY_FEE,
+    HISTORY_TEXT = 7
+} HistoryKind;
+
+static const char *const HISTORY_DESCRIPTIONS[] = {"Initial deposit", "Deposit", "Withdrawal", "Transfer to ",
+                                                    "Transfer from ", "Interest", "Monthly fee"};
+
+unsigned char *putVarint(unsigned char *out, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        *out++ = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (unsigned char)value;
+    return out;
+}
+
+const unsigned char *getVarint(const unsigned char *in, uint64_t *value)
+{
+    uint64_t result = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        unsigned char byte = *in++;
+        result |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            break;
+    }
+    *value = result;
+    return in;
+}
+
+// Whether text is an account number: exactly ACC_NUM_LENGTH digits
+int isAccountNumberText(const char *text)
+{
+    int length = 0;
+    for (; text[length] != '\0'; length++)
+    {
+        if (text[length] < '0' || text[length] > '9')
+            return 0;
+    }
+    return length == ACC_NUM_LENGTH;
+}
+
+// Encode one transaction into out, with requestId unless it is 0. Returns
+// its length.
+int encodeHistoryEntry(unsigned char *out, time_t previous, time_t timestamp, TransactionType type, double amount,
+                       const char *description, unsigned long requestId)
+{
+    unsigned char *next = out + 1;
+    int kind = HISTORY_TEXT;
+    const char *rest = description;
+    for (int i = 0; i < (int)(sizeof(HISTORY_DESCRIPTIONS) / sizeof(HISTORY_DESCRIPTIONS[0])); i++)
+    {
+        size_t length = strlen(HISTORY_DESCRIPTIONS[i]);
+        int transfer = i == HISTORY_TRANSFER_TO || i == HISTORY_TRANSFER_FROM;
+        if (!transfer ? strcmp(description, HISTORY_DESCRIPTIONS[i]) == 0
+                      : strncmp(description, HISTORY_DESCRIPTIONS[i], length) == 0 &&
+                            isAccountNumberText(description + length))
+        {
+            kind = i;
+            rest = description + length;
+            break;
+        }
+    }
+
+    int64_t delta = (int64_t)(timestamp - previous);
+    next = putVarint(next, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+
+    uint64_t cents = amount >= 0 && amount < 1e13 ? (uint64_t)(amount * 100 + 0.5) : 0;
+    int rawAmount = (double)cents / 100 != amount;
+    if (rawAmount)
+    {
+        memcpy(next, &amount, sizeof(amount));
+        next += sizeof(amount);
+    }
+    else
+    {
+        next = putVarint(next, cents);
+    }
+
+    if (kind == HISTORY_TRANSFER_TO || kind == HISTORY_TRANSFER_FROM)
+    {
+        next = putVarint(next, strtoull(rest, NULL, 10));
+    }
+    else if (kind == HISTORY_TEXT)
+    {
+        size_t length = strnlen(description, sizeof(((Transaction *)0)->description) - 1);
+        *next++ = (unsigned char)length;
+        memcpy(next, description, length);
+        next += length;
+    }
+    if (requestId != 0)
+    {
+        next = putVarint(next, requestId);
+    }
+
+    out[0] = (type & HISTORY_TYPE_MASK) | kind << HISTORY_KIND_SHIFT | (rawAmount ? HISTORY_RAW_AMOUNT : 0) |
+             (requestId != 0 ? HISTORY_REQUEST_ID : 0);
+    return next - out;
+}
+
+// Decode the entry at in, which follows one made at previous. When out is
+// NULL only the timestamp is decoded; requestId, when not NULL, gets the
+// entry's request ID or 0. Returns the next entry.
+const unsigned char *decodeHistoryEntry(const unsigned char *in, time_t previous, time_t *timestamp, Transaction *out,
+                                        unsigned long *requestId)
+{
+    unsigned char tag = *in++;
+    uint64_t value;
+    in = getVarint(in, &value);
+    *timestamp = previous + (time_t)((value >> 1) ^ -(value & 1));
+
+    double amount;
+    if (tag & HISTORY_RAW_AMOUNT)
+    {
+        memcpy(&amount, in, sizeof(amount));
+        in += sizeof(amount);
+    }
+    else
+    {
+        in = getVarint(in, &value);
+        amount = (double)value / 100;
+    }
+
+    int kind = (tag & HISTORY_KIND_MASK) >> HISTORY_KIND_SHIFT;
+    if (out != NULL)
+    {
+        memset(out, 0, sizeof(*out));
+        out->timestamp = *timestamp;
+        out->type = tag & HISTORY_TYPE_MASK;
+        out->amount = amount;
+    }
+    if (kind == HISTORY_TRANSFER_TO || kind == HISTORY_TRANSFER_FROM)
+    {
+        in = getVarint(in, &value);
+        if (out != NULL)
+        {
+            size_t length = strlen(HISTORY_DESCRIPTIONS[kind]);
+            memcpy(out->description, HISTORY_DESCRIPTIONS[kind], length);
+            for (int digit = ACC_NUM_LENGTH - 1; digit >= 0; digit--, value /= 10)
+            {
+                out->description[length + digit] = '0' + value % 10;
+            }
+        }
+    }
+    else if (kind == HISTORY_TEXT)
+    {
+        size_t length = *in++;
+        if (out != NULL)
+            memcpy(out->description, in, length < sizeof(out->description) ? length : sizeof(out->description) - 1);
+        in += length;
+    }
+    else if (out != NULL)
+    {
+        strcpy(out->description, HISTORY_DESCRIPTIONS[kind]);
+    }
+
+    value = 0;
+    if (tag & HISTORY_REQUEST_ID)
+    {
+        in = getVarint(in, &value);
+    }
+    if (requestId != NULL)
+    {
+        *requestId = value;
+    }
+    return in;
+}
+
+// Drop the oldest entry. The next one's delta then counts from its time.
+void dropOldestHistoryEntry(Account *account)
+{
+    time_t timestamp;
+    const unsigned char *next = decodeHistoryEntry(account->history, account->historyBase, &timestamp, NULL, NULL);
+    int length = next - account->history;
+    memmove(account->history, next, account->historyLength - length);
+    account->historyLength -= length;
+    account->historyBase = timestamp;
+    account->transactionCount--;
+}
+
+// Append a transaction made by request requestId (0 for none), dropping the
+// oldest ones while the history is over MAX_TRANSACTIONS entries or out of
+// room
+void appendRequestHistory(Account *account, time_t timestamp, TransactionType type, double amount,
+                          const char *description, unsigned long requestId)
+{
+    unsigned char entry[HISTORY_MAX_ENTRY];
+    if (account->transactionCount == 0)
+    {
+        account->historyBase = account->historyLast = timestamp;
+    }
+    int length = encodeHistoryEntry(entry, account->historyLast, timestamp, type, amount, description, requestId);
+
+    while (account->transactionCount > 0 &&
+           (account->transactionCount >= MAX_TRANSACTIONS || account->historyLength + length > HISTORY_BYTES))
+    {
+        dropOldestHistoryEntry(account);
+    }
+    if (account->transactionCount == 0)
+    {
+        account->historyBase = account->historyLast;
+    }
+
+    memcpy(account->history + account->historyLength, entry, length);
+    account->historyLength += length;
+    account->historyLast = timestamp;
+    account->transactionCount++;
+}
+
+// Append a transaction no client request ID goes with
+void appendHistory(Account *account, time_t timestamp, TransactionType type, double amount, const char *description)
+{
+    appendRequestHistory(account, timestamp, type, amount, description, 0);
+}
+
+// Decode the timestamps of the whole history, oldest first, into times
+// (room for MAX_TRANSACTIONS). This skips the amounts and descriptions, so
+// statements can search by time and then decode only the page they send.
+// Returns the number of entries.
+int decodeHistoryTimes(const Account *account, time_t *times)
+{
+    const unsigned char *next = account->history;
+    time_t timestamp = account->historyBase;
+    for (int i = 0; i < account->transactionCount; i++)
+    {
+        next = decodeHistoryEntry(next, timestamp, &timestamp, NULL, NULL);
+        times[i] = timestamp;
+    }
+    return account->transactionCount;
+}
+
+// Decode entries start to end - 1 (oldest is 0) into transactions
+void decodeHistoryRange(const Account *account, int start, int end, Transaction *transactions)
+{
+    const unsigned char *next = account->history;
+    time_t timestamp = account->historyBase;
+    for (int i = 0; i < end; i++)
+    {
+        next = decodeHistoryEntry(next, timestamp, &timestamp, i >= start ? &transactions[i - start] : NULL, NULL);
+    }
+}
+
+// Decode the whole history, oldest first, into transactions and the request
+// ID of each entry (0 for none). Returns the number of entries.
+int decodeHistoryRequests(const Account *account, Transaction *transactions, unsigned long *requestIds)
+{
+    const unsigned char *next = account->history;
+    time_t timestamp = account->historyBase;
+    for (int i = 0; i < account->transactionCount; i++)
+    {
+        next = decodeHistoryEntry(next, timestamp, &timestamp, &transactions[i], &requestIds[i]);
+    }
+    return account->transactionCount;
+}
+
+// Find the newest entry made by requestId and decode it into found.
+// Returns 0 when the history has none.
+int findRequestHistory(const Account *account, unsigned long requestId, Transaction *found)
+{
+    const unsigned char *next = account->history;
+    time_t timestamp = account->historyBase;
+    int seen = 0;
+    for (int i = 0; i < account->transactionCount; i++)
+    {
+        Transaction transaction;
+        unsigned long entryId;
+        next = decodeHistoryEntry(next, timestamp, &timestamp, &transaction, &entryId);
+        if (entryId == requestId)
+        {
+            *found = transaction;
+            seen = 1;
+        }
+    }
+    return seen;
+}
+
+// Decode just the newest transaction. Returns 0 when there is none.
+int lastTransaction(const Account *account, Transaction *transaction)
+{
+    decodeHistoryRange(account, account->transactionCount - 1, account->transactionCount, transaction);
+    return account->transactionCount > 0;
+}
+
+// Whether an account's encoded history from disk decodes to exactly its
+// recorded length without running past it
+int historyValid(const Account *account)
+{
+    if (account->transactionCount < 0 || account->transactionCount > MAX_TRANSACTIONS ||
+        account->historyLength < 0 || account->historyLength > HISTORY_BYTES)
+    {
+        return 0;
+    }
+
+    const unsigned char *next = account->history;
+    const unsigned char *end = account->history + account->historyLength;
+    for (int i = 0; i < account->transactionCount; i++)
+    {
+        // An entry never exceeds HISTORY_MAX_ENTRY, so check the room first
+        unsigned char entry[HISTORY_MAX_ENTRY * 2] = {0};
+        size_t left = end - next;
+        if (left == 0)
+            return 0;
+        memcpy(entry, next, left < HISTORY_MAX_ENTRY ? left : HISTORY_MAX_ENTRY);
+        if (entry[0] & ~(HISTORY_TYPE_MASK | HISTORY_KIND_MASK | HISTORY_RAW_AMOUNT | HISTORY_REQUEST_ID))
+            return 0;
+        time_t timestamp;
+        size_t length = decodeHistoryEntry(entry, 0, &timestamp, NULL, NULL) - entry;
+        if (length > left)
+            return 0;
+        next += length;
+    }
+    return next == end;
+}
+
+#endif // BANK_HISTORY_H
@@ -0,0 +1,201 @@
+// Graceful shutdown and hot restart support shared by both servers
+
+#ifndef BANK_LIFECYCLE_H
+#define BANK_LIFECYCLE_H
+
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include "bank_common.h"
+
+#define HANDOFF_ENV "BANK_HANDOFF_FD"
+#define HANDOFF_MAX_FDS 32
+#define HANDOFF_READY_TIMEOUT 10000 // Milliseconds to wait for the new binary
+#define DRAIN_TIMEOUT 30            // Seconds idle sessions may stay open while draining
+
+// SIGTERM/SIGINT count; the first starts a drain, the second cuts it short
+volatile sig_atomic_t shutdown_requested = 0;
+// Set by SIGUSR2 to hand the server over to a freshly executed binary
+volatile sig_atomic_t restart_requested = 0;
+
+void handle_lifecycle_signal(int sig)
+{
+    if (sig == SIGUSR2)
+    {
+        restart_requested = 1;
+    }
+    else
+    {
+        shutdown_requested++;
+    }
+}
+
+// Install the handlers without SA_RESTART so blocking accept and poll calls
+// return EINTR and the main loops notice the request promptly
+void installLifecycleHandlers()
+{
+    struct sigaction sa;
+    sa.sa_handler = handle_lifecycle_signal;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGUSR2, &sa, NULL);
+}
+
+// Wait up to timeoutMs for the socket to become readable.
+// Returns 1 when readable, 0 on timeout or signal, -1 on error.
+int waitReadable(int socket, int timeoutMs)
+{
+    struct pollfd pfd = {socket, POLLIN, 0};
+    int ready = poll(&pfd, 1, timeoutMs);
+    if (ready < 0 && errno == EINTR)
+    {
+        return 0;
+    }
+    return ready;
+}
+
+// Whether a session should end now: draining has been cut short by a second
+// signal, or the drain deadline has passed
+int drainExpired(time_t drainStarted)
+{
+    return shutdown_requested > 1 || time(NULL) - drainStarted >= DRAIN_TIMEOUT;
+}
+
+// Execute argv as the successor, connected to us by a socket pair whose end
+// is named in HANDOFF_ENV. Returns our end once the successor reports it is
+// ready to take over, or -1 if it failed to start.
+int startSuccessor(char *argv[])
+{
+    int channel[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, channel) < 0)
+    {
+        perror("Handoff socketpair failed");
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("Fork failed");
+        close(channel[0]);
+        close(channel[1]);
+        return -1;
+    }
+
+    if (pid == 0)
+    {
+        char value[16];
+        close(channel[0]);
+        snprintf(value, sizeof(value), "%d", channel[1]);
+        setenv(HANDOFF_ENV, value, 1);
+        execvp(argv[0], argv);
+        perror("Exec of new server binary failed");
+        _exit(EXIT_FAILURE);
+    }
+
+    close(channel[1]);
+
+    char ready;
+    struct pollfd pfd = {channel[0], POLLIN, 0};
+    int waited = 0;
+    while (waited < HANDOFF_READY_TIMEOUT)
+    {
+        int result = poll(&pfd, 1, 100);
+        if (result > 0)
+        {
+            break;
+        }
+        if (result < 0 && errno != EINTR)
+        {
+            break;
+        }
+        waited += 100;
+    }
+    if (!(pfd.revents & POLLIN) || recv(channel[0], &ready, 1, 0) != 1)
+    {
+        fprintf(stderr, "New server binary did not become ready.\n");
+        close(channel[0]);
+        return -1;
+    }
+    return channel[0];
+}
+
+// Pass descriptors to the successor over the handoff channel
+int sendHandoff(int channel, const int *fds, int count)
+{
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    memset(control, 0, sizeof(control));
+
+    struct iovec iov = {&count, sizeof(count)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+
+    return sendmsg(channel, &msg, 0) < 0 ? -1 : 0;
+}
+
+// When started by a predecessor, report readiness and receive its
+// descriptors, the listening socket first. Returns the number received, or
+// -1 when this is a fresh start.
+int receiveHandoff(int *fds, int maxFds)
+{
+    const char *value = getenv(HANDOFF_ENV);
+    if (value == NULL)
+    {
+        return -1;
+    }
+
+    int channel = atoi(value);
+    unsetenv(HANDOFF_ENV);
+    fcntl(channel, F_SETFD, FD_CLOEXEC);
+
+    char ready = 1;
+    if (send(channel, &ready, 1, 0) != 1)
+    {
+        close(channel);
+        return -1;
+    }
+
+    int count = 0;
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    struct iovec iov = {&count, sizeof(count)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t received;
+    do
+    {
+        received = recvmsg(channel, &msg, MSG_CMSG_CLOEXEC);
+    } while (received < 0 && errno == EINTR);
+    close(channel);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (received != sizeof(count) || cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS)
+    {
+        fprintf(stderr, "Handoff from previous server failed.\n");
+        return -1;
+    }
+
+    count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    if (count > maxFds)
+    {
+        count = maxFds;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * count);
+    return count;
+}
+
+#endif // BANK_LIFECYCLE_H
@@ -0,0 +1,103 @@
+// Convert account databases to the current format, check one, or rebuild
+// one as it was at a past moment
+#include "bank_common.h"
+#include "bank_auth.h"
+#include "bank_storage.h"
+#include "bank_checkpoint.h"
+
+Account accounts[MAX_ACCOUNTS];
+
+void printUsage(const char *program)
+{
+    printf("Usage: %s FILE [OUTPUT]\n", program);
+    printf("       %s --check FILE\n", program);
+    printf("       %s --restore-to TIME FILE OUTPUT\n", program);
+    printf("  FILE [OUTPUT]   convert FILE, written by any earlier server, to the\n");
+    printf("                  current format. Without OUTPUT, FILE is replaced and\n");
+    printf("                  the original kept as FILE%s.\n", ".bak");
+    printf("  --check FILE    verify the header and block checksums of FILE\n");
+    printf("  --restore-to TIME FILE OUTPUT\n");
+    printf("                  write the accounts of FILE as they were at TIME\n");
+    printf("                  (YYYY-MM-DD HH:MM:SS, or seconds since the epoch) to\n");
+    printf("                  OUTPUT, from the newest checkpoint before it and the\n");
+    printf("                  operation log. FILE and its log are only read.\n");
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc == 3 && strcmp(argv[1], "--check") == 0)
+    {
+        int converted;
+        int count = loadAccountFile(argv[2], accounts, MAX_ACCOUNTS, &converted);
+        if (count < 0)
+        {
+            if (errno == ENOENT)
+                perror(argv[2]);
+            return 1;
+        }
+        printf("%s: %d accounts, %s.\n", argv[2], count,
+               converted ? "older format; convert it with bank_migrate" : "all checksums valid");
+        return converted ? 2 : 0;
+    }
+    if (argc == 5 && strcmp(argv[1], "--restore-to") == 0)
+    {
+        time_t at = parseTimestamp(argv[2]);
+        if (at < 0)
+        {
+            fprintf(stderr, "Invalid time: %s\n", argv[2]);
+            return 1;
+        }
+        int count = restoreAccountsAt(argv[3], at, accounts, MAX_ACCOUNTS);
+        if (count < 0)
+        {
+            return 1;
+        }
+        if (saveAccountFile(argv[4], accounts, count) < 0)
+        {
+            perror("Error writing the restored database");
+            return 1;
+        }
+        printf("Wrote %d accounts as of %s to %s.\n", count, argv[2], argv[4]);
+        return 0;
+    }
+    if (argc < 2 || argc > 3 || argv[1][0] == '-')
+    {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    const char *input = argv[1];
+    const char *output = argc == 3 ? argv[2] : input;
+    int converted;
+    int count = loadAccountFile(input, accounts, MAX_ACCOUNTS, &converted);
+    if (count < 0)
+    {
+        if (errno == ENOENT)
+            perror(input);
+        return 1;
+    }
+    if (!converted && output == input)
+    {
+        printf("%s is already in the current format (%d accounts).\n", input, count);
+        return 0;
+    }
+
+    if (output == input)
+    {
+        char backup[512];
+        snprintf(backup, sizeof(backup), "%s.bak", input);
+        if (link(input, backup) < 0)
+        {
+            perror("Error keeping a backup of the original");
+            return 1;
+        }
+        printf("Original kept as %s.\n", backup);
+    }
+    if (saveAccountFile(output, accounts, count) < 0)
+    {
+        perror("Error writing the converted database");
+        return 1;
+    }
+    printf("Wrote %d accounts to %s (format version %d).\n", count, output, STORAGE_VERSION);
+    return 0;
+}
@@ -0,0 +1,124 @@
+// Operation log of committed changes, used for replication
+
+#ifndef BANK_OPLOG_H
+#define BANK_OPLOG_H
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "bank_common.h"
+
+#define LOG_FILE_SUFFIX ".log"
+#define REPLICATION_BATCH 64
+
+// One committed change. Records are fixed-size and numbered from 1 without
+// gaps, so record n sits at a known offset in the log file.
+// The source shard of a cross-shard transfer logs each step: PREPARE_TRANSFER
+// when it reserves the funds (a negative amount), COMMIT_TRANSFER once the
+// transfer is decided, ABORT_TRANSFER when the reservation is given back, and
+// TRANSFER_DELIVERED when the target shard has acknowledged the outcome.
+// The target shard logs PREPARE_TRANSFER and ABORT_TRANSFER with amount 0,
+// and COMMIT_TRANSFER with the amount it credits.
+typedef struct
+{
+    unsigned long sequence;
+    time_t timestamp;
+    RequestType type; // OPEN_ACCOUNT, CLOSE_ACCOUNT, WITHDRAW, DEPOSIT_FUNDS, TRANSFER, ACCRUAL or a transfer step
+    char accountNumber[ACC_NUM_LENGTH + 1];
+    unsigned char pinSalt[PIN_SALT_LENGTH]; // OPEN_ACCOUNT only
+    unsigned char pinHash[PIN_HASH_LENGTH]; // OPEN_ACCOUNT only
+    char name[MAX_NAME_LENGTH + 1];     // OPEN_ACCOUNT: the holder; TRANSFER, ACCRUAL: the description;
+                                        // WITHDRAW, DEPOSIT_FUNDS: the client's request ID in hex, if any;
+                                        // transfer steps: the transfer ID in hex
+    char nationalID[ID_LENGTH + 1];     // OPEN_ACCOUNT: the holder's; transfer steps: the other shard's account
+    AccountType accountType;            // OPEN_ACCOUNT only
+    double amount;
+    double balance; // Balance after the change
+} OperationRecord;
+
+// Replication stream framing. A replica opens with the cluster secret and
+// the sequence it wants next (0 for a full snapshot); the primary hangs up
+// on a wrong secret, and otherwise answers with a snapshot of count
+// accounts taken at sequence, or with count records.
+typedef struct
+{
+    char secret[MAX_NAME_LENGTH + 1]; // Zero-padded
+    unsigned long next;
+} ReplicationHello;
+
+typedef enum
+{
+    REPLICATION_SNAPSHOT,
+    REPLICATION_RECORDS
+} ReplicationKind;
+
+typedef struct
+{
+    ReplicationKind kind;
+    int count;
+    unsigned long sequence;
+} ReplicationHeader;
+
+// Send exactly length bytes. Returns 0 on success, -1 on error.
+int sendAll(int socket, const void *buffer, size_t length)
+{
+#ifdef BANK_TLS
+    if (tlsSession(socket) != NULL)
+        return tlsSendAll(tlsSession(socket), buffer, length);
+#endif
+    const char *next = buffer;
+    while (length > 0)
+    {
+        ssize_t sent = send(socket, next, length, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent < 0)
+            return -1;
+        next += sent;
+        length -= sent;
+    }
+    return 0;
+}
+
+// Open the log, reporting the first and last sequence it holds (both 0 when
+// it is empty). A torn record at the end from a crash is cut off.
+int openOperationLog(const char *path, unsigned long *first, unsigned long *last)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    struct stat st;
+    fstat(fd, &st);
+    off_t count = st.st_size / sizeof(OperationRecord);
+    if (st.st_size % sizeof(OperationRecord) != 0)
+    {
+        ftruncate(fd, count * sizeof(OperationRecord));
+    }
+
+    *first = 0;
+    *last = 0;
+    OperationRecord record;
+    if (count > 0 && pread(fd, &record, sizeof(record), 0) == sizeof(record))
+    {
+        *first = record.sequence;
+        *last = record.sequence + count - 1;
+    }
+    return fd;
+}
+
+// Read up to max records starting at sequence from a log whose first record
+// is first. Returns the number read.
+int readOperationRecords(int fd, unsigned long first, unsigned long sequence, OperationRecord *records, int max)
+{
+    if (first == 0 || sequence < first)
+    {
+        return 0;
+    }
+
+    ssize_t bytes = pread(fd, records, max * sizeof(OperationRecord), (sequence - first) * sizeof(OperationRecord));
+    return bytes < 0 ? 0 : bytes / sizeof(OperationRecord);
+}
+
+#endif // BANK_OPLOG_H
@@ -0,0 +1,218 @@
+// Token-bucket rate limiting shared between the server and its children
+
+#ifndef BANK_RATELIMIT_H
+#define BANK_RATELIMIT_H
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include "bank_common.h"
+
+#define RATE_TABLE_SIZE 1024
+#define RATE_PROBE_LIMIT 8
+#define RATE_KEY_LENGTH INET6_ADDRSTRLEN
+
+// One bucket per key (client address or account number)
+typedef struct
+{
+    char key[RATE_KEY_LENGTH];
+    double tokens;
+    double lastRefill;
+} TokenBucket;
+
+// Fixed-size bucket table. It lives in shared memory so that every child
+// process draws from the same per-key budget.
+typedef struct
+{
+    pthread_mutex_t lock;
+    double rate;
+    double burst;
+    TokenBucket buckets[RATE_TABLE_SIZE];
+} RateLimiter;
+
+double monotonicSeconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Map anonymous memory that stays shared with forked children
+void *mapShared(size_t size)
+{
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    return memory == MAP_FAILED ? NULL : memory;
+}
+
+// Create a limiter refilling rate tokens per second up to burst tokens
+RateLimiter *createRateLimiter(double rate, double burst)
+{
+    RateLimiter *limiter = mapShared(sizeof(RateLimiter));
+    if (limiter == NULL)
+    {
+        return NULL;
+    }
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&limiter->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    limiter->rate = rate;
+    limiter->burst = burst;
+    return limiter;
+}
+
+unsigned long hashKey(const char *key)
+{
+    unsigned long hash = 14695981039346656037UL;
+    for (; *key; key++)
+    {
+        hash = (hash ^ (unsigned char)*key) * 1099511628211UL;
+    }
+    return hash;
+}
+
+// Seconds until bucket has refilled to burst, 0 when it already has
+double bucketFullIn(const RateLimiter *limiter, const TokenBucket *bucket, double now)
+{
+    double missing = limiter->burst - bucket->tokens - (now - bucket->lastRefill) * limiter->rate;
+    return missing > 0 ? missing / limiter->rate : 0;
+}
+
+// Find the bucket for key, claiming a free slot in its probe window when it
+// has none, or one whose bucket has refilled to burst, which forgets nothing
+// about a key still being limited. When every bucket in the window still
+// owes tokens, returns NULL and sets *retryAfter, so the key is refused
+// rather than let in by evicting someone's penalty. Must be called with the
+// lock held.
+TokenBucket *findBucket(RateLimiter *limiter, const char *key, double now, int *retryAfter)
+{
+    unsigned long index = hashKey(key) % RATE_TABLE_SIZE;
+    TokenBucket *victim = NULL;
+    double soonest = 0;
+
+    for (int i = 0; i < RATE_PROBE_LIMIT; i++)
+    {
+        TokenBucket *bucket = &limiter->buckets[(index + i) % RATE_TABLE_SIZE];
+        if (strcmp(bucket->key, key) == 0)
+        {
+            return bucket;
+        }
+        if (victim != NULL)
+        {
+            continue;
+        }
+        double fullIn = bucket->key[0] == '\0' ? 0 : bucketFullIn(limiter, bucket, now);
+        if (fullIn == 0)
+        {
+            victim = bucket;
+        }
+        else if (soonest == 0 || fullIn < soonest)
+        {
+            soonest = fullIn;
+        }
+    }
+
+    if (victim == NULL)
+    {
+        *retryAfter = (int)soonest + 1;
+        return NULL;
+    }
+
+    strncpy(victim->key, key, RATE_KEY_LENGTH - 1);
+    victim->key[RATE_KEY_LENGTH - 1] = '\0';
+    victim->tokens = limiter->burst;
+    victim->lastRefill = now;
+    return victim;
+}
+
+void refillBucket(const RateLimiter *limiter, TokenBucket *bucket, double now)
+{
+    bucket->tokens += (now - bucket->lastRefill) * limiter->rate;
+    if (bucket->tokens > limiter->burst)
+    {
+        bucket->tokens = limiter->burst;
+    }
+    bucket->lastRefill = now;
+}
+
+// Take cost tokens for key. Returns 0 when allowed, otherwise the number of
+// seconds until the request would be allowed. A NULL limiter allows all.
+int rateLimitAcquire(RateLimiter *limiter, const char *key, double cost)
+{
+    if (limiter == NULL)
+    {
+        return 0;
+    }
+
+    double now = monotonicSeconds();
+    int retryAfter = 0;
+
+    pthread_mutex_lock(&limiter->lock);
+    TokenBucket *bucket = findBucket(limiter, key, now, &retryAfter);
+    if (bucket != NULL)
+    {
+        refillBucket(limiter, bucket, now);
+        if (bucket->tokens >= cost)
+        {
+            bucket->tokens -= cost;
+        }
+        else
+        {
+            retryAfter = (int)((cost - bucket->tokens) / limiter->rate) + 1;
+        }
+    }
+    pthread_mutex_unlock(&limiter->lock);
+
+    return retryAfter;
+}
+
+// Seconds until key would have cost tokens, or 0 when it has them now.
+// Takes nothing. A NULL limiter allows all.
+int rateLimitCheck(RateLimiter *limiter, const char *key, double cost)
+{
+    if (limiter == NULL)
+    {
+        return 0;
+    }
+
+    double now = monotonicSeconds();
+    int retryAfter = 0;
+
+    pthread_mutex_lock(&limiter->lock);
+    TokenBucket *bucket = findBucket(limiter, key, now, &retryAfter);
+    if (bucket != NULL)
+    {
+        refillBucket(limiter, bucket, now);
+        retryAfter = bucket->tokens >= cost ? 0 : (int)((cost - bucket->tokens) / limiter->rate) + 1;
+    }
+    pthread_mutex_unlock(&limiter->lock);
+
+    return retryAfter;
+}
+
+// Charge a penalty to key without refusing anything now. The balance may go
+// negative, which pushes back the next allowed request. A key without a
+// bucket is refused until one frees up anyway, so it has nothing to charge.
+void rateLimitPenalize(RateLimiter *limiter, const char *key, double cost)
+{
+    if (limiter == NULL)
+    {
+        return;
+    }
+
+    double now = monotonicSeconds();
+    int retryAfter;
+
+    pthread_mutex_lock(&limiter->lock);
+    TokenBucket *bucket = findBucket(limiter, key, now, &retryAfter);
+    if (bucket != NULL)
+    {
+        refillBucket(limiter, bucket, now);
+        bucket->tokens -= cost;
+    }
+    pthread_mutex_unlock(&limiter->lock);
+}
+
+#endif // BANK_RATELIMIT_H
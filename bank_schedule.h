@@ -0,0 +1,296 @@
+// Standing orders and the timer wheel that runs them
+
+#ifndef BANK_SCHEDULE_H
+#define BANK_SCHEDULE_H
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "bank_common.h"
+
+#define SCHEDULE_FILE_SUFFIX ".orders"
+#define SCHEDULE_MAGIC 0x424e4b4f52444552UL // "BNKORDER"
+#define MAX_STANDING_ORDERS (1 << 21)
+#define SCHEDULE_BATCH 1024 // Orders taken off the wheel and run together
+
+// Wheel geometry, as in the classic Linux timer wheel: 256 slots of one
+// second, then four levels of 64 slots, each slot 64 times wider than one
+// of the level below. Together they reach 2^32 seconds ahead. A level's
+// slot is redistributed to the levels below once, when the root wraps to
+// it, so each tick does a bounded amount of work however many orders wait.
+#define WHEEL_ROOT_BITS 8
+#define WHEEL_LEVEL_BITS 6
+#define WHEEL_LEVELS 4 // Above the root
+#define WHEEL_ROOT_SIZE (1 << WHEEL_ROOT_BITS)
+#define WHEEL_LEVEL_SIZE (1 << WHEEL_LEVEL_BITS)
+#define WHEEL_SLOTS (WHEEL_ROOT_SIZE + WHEEL_LEVELS * WHEEL_LEVEL_SIZE)
+
+typedef enum
+{
+    ORDER_FREE,
+    ORDER_SCHEDULED
+} OrderState;
+
+// A deposit, withdrawal or transfer to run at nextRun and then every
+// interval seconds. Orders sit in a doubly linked list per wheel slot, or
+// on the free list, linked by index so the links survive remapping.
+typedef struct
+{
+    unsigned long id; // Serial times MAX_STANDING_ORDERS plus the index
+    OrderState state;
+    RequestType type; // DEPOSIT_FUNDS, WITHDRAW or TRANSFER
+    char accountNumber[ACC_NUM_LENGTH + 1];
+    char targetAccount[ACC_NUM_LENGTH + 1];
+    double amount;
+    time_t nextRun;
+    long interval; // 0 runs the order once
+    int slot;
+    int next;
+    int prev;
+} StandingOrder;
+
+// The schedule is a file mapped shared, so forked children, reactor
+// threads and the next server process after a hot restart all see the same
+// orders, and the orders survive a restart. Only the orders themselves are
+// relied on after a cold start; the wheel and free list are rebuilt.
+// The lock is taken after any account lock, never before.
+typedef struct
+{
+    unsigned long magic;
+    size_t size;
+    pthread_mutex_t lock;
+    unsigned long nextSerial;
+    time_t base; // The next second the wheel will run
+    int used;    // Orders ever handed out; those past it are free
+    int freeList;
+    int scheduled;
+    int slots[WHEEL_SLOTS];
+    StandingOrder orders[MAX_STANDING_ORDERS];
+} Schedule;
+
+// Slot for an order due at expires, given that the wheel is at base
+int wheelSlot(const Schedule *schedule, time_t expires)
+{
+    long ahead = expires - schedule->base;
+    if (ahead < 0)
+    {
+        // Overdue: run on the next tick
+        return schedule->base & (WHEEL_ROOT_SIZE - 1);
+    }
+    if (ahead > 0xffffffffL)
+    {
+        expires = schedule->base + 0xffffffffL;
+        ahead = 0xffffffffL;
+    }
+    if (ahead < WHEEL_ROOT_SIZE)
+    {
+        return expires & (WHEEL_ROOT_SIZE - 1);
+    }
+
+    int level = 0;
+    int shift = WHEEL_ROOT_BITS + WHEEL_LEVEL_BITS;
+    while (level < WHEEL_LEVELS - 1 && ahead >= 1L << shift)
+    {
+        level++;
+        shift += WHEEL_LEVEL_BITS;
+    }
+    shift -= WHEEL_LEVEL_BITS;
+    return WHEEL_ROOT_SIZE + level * WHEEL_LEVEL_SIZE + ((expires >> shift) & (WHEEL_LEVEL_SIZE - 1));
+}
+
+void wheelInsert(Schedule *schedule, int index)
+{
+    StandingOrder *order = &schedule->orders[index];
+    order->slot = wheelSlot(schedule, order->nextRun);
+    order->prev = -1;
+    order->next = schedule->slots[order->slot];
+    if (order->next >= 0)
+    {
+        schedule->orders[order->next].prev = index;
+    }
+    schedule->slots[order->slot] = index;
+}
+
+void wheelRemove(Schedule *schedule, int index)
+{
+    StandingOrder *order = &schedule->orders[index];
+    if (order->prev >= 0)
+    {
+        schedule->orders[order->prev].next = order->next;
+    }
+    else
+    {
+        schedule->slots[order->slot] = order->next;
+    }
+    if (order->next >= 0)
+    {
+        schedule->orders[order->next].prev = order->prev;
+    }
+}
+
+// Move every order in a level's slot down to where it now belongs
+void wheelCascade(Schedule *schedule, int slot)
+{
+    int index = schedule->slots[slot];
+    schedule->slots[slot] = -1;
+    while (index >= 0)
+    {
+        int next = schedule->orders[index].next;
+        wheelInsert(schedule, index);
+        index = next;
+    }
+}
+
+// Advance the wheel up to now, taking due orders off it into due (room for
+// max). Stops early, leaving the rest for the next call, once due is full.
+// Returns the number taken. Called with the lock held.
+int wheelAdvance(Schedule *schedule, time_t now, int *due, int max)
+{
+    int count = 0;
+    while (schedule->base <= now && count < max)
+    {
+        int root = schedule->base & (WHEEL_ROOT_SIZE - 1);
+        if (root == 0)
+        {
+            // Refill the root from the next level up, and that level from
+            // the one above it whenever it wraps too
+            int shift = WHEEL_ROOT_BITS;
+            for (int level = 0; level < WHEEL_LEVELS; level++, shift += WHEEL_LEVEL_BITS)
+            {
+                int slot = (schedule->base >> shift) & (WHEEL_LEVEL_SIZE - 1);
+                wheelCascade(schedule, WHEEL_ROOT_SIZE + level * WHEEL_LEVEL_SIZE + slot);
+                if (slot != 0)
+                {
+                    break;
+                }
+            }
+        }
+
+        while (schedule->slots[root] >= 0 && count < max)
+        {
+            int index = schedule->slots[root];
+            wheelRemove(schedule, index);
+            due[count++] = index;
+        }
+        if (schedule->slots[root] < 0)
+        {
+            schedule->base++;
+        }
+    }
+    return count;
+}
+
+// Take a free order, or -1 when the schedule is full. Called with the lock held.
+int claimOrder(Schedule *schedule)
+{
+    int index = schedule->freeList;
+    if (index >= 0)
+    {
+        schedule->freeList = schedule->orders[index].next;
+    }
+    else if (schedule->used < MAX_STANDING_ORDERS)
+    {
+        index = schedule->used++;
+    }
+    else
+    {
+        return -1;
+    }
+
+    schedule->orders[index].id = ++schedule->nextSerial * MAX_STANDING_ORDERS + index;
+    schedule->orders[index].state = ORDER_SCHEDULED;
+    schedule->scheduled++;
+    return index;
+}
+
+// Return an order, already off the wheel, to the free list
+void releaseOrder(Schedule *schedule, int index)
+{
+    schedule->orders[index].state = ORDER_FREE;
+    schedule->orders[index].next = schedule->freeList;
+    schedule->freeList = index;
+    schedule->scheduled--;
+}
+
+// Rebuild the wheel at now and the free list from the orders
+void rebuildSchedule(Schedule *schedule, time_t now)
+{
+    schedule->base = now;
+    schedule->freeList = -1;
+    schedule->scheduled = 0;
+    for (int i = 0; i < WHEEL_SLOTS; i++)
+    {
+        schedule->slots[i] = -1;
+    }
+    for (int i = schedule->used - 1; i >= 0; i--)
+    {
+        if (schedule->orders[i].state == ORDER_SCHEDULED)
+        {
+            wheelInsert(schedule, i);
+            schedule->scheduled++;
+        }
+        else
+        {
+            schedule->orders[i].next = schedule->freeList;
+            schedule->freeList = i;
+        }
+    }
+}
+
+// Map the schedule file at path, creating it if needed. Unless resuming
+// a schedule the previous server process is still using, its lock is
+// reset and the wheel rebuilt. Returns NULL with errno set on failure, or
+// EINVAL when the file was written with a different layout.
+Schedule *openSchedule(const char *path, int resuming, int *fd)
+{
+    *fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    struct stat st;
+    if (*fd < 0 || fstat(*fd, &st) < 0)
+    {
+        return NULL;
+    }
+
+    // A new file is sparse; only pages holding orders take up disk space
+    int created = st.st_size == 0;
+    if ((created && ftruncate(*fd, sizeof(Schedule)) < 0) ||
+        (!created && (size_t)st.st_size != sizeof(Schedule)))
+    {
+        int saved = created ? errno : EINVAL;
+        close(*fd);
+        errno = saved;
+        return NULL;
+    }
+
+    Schedule *schedule = mmap(NULL, sizeof(Schedule), PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+    if (schedule == MAP_FAILED)
+    {
+        int saved = errno;
+        close(*fd);
+        errno = saved;
+        return NULL;
+    }
+    if (!created && (schedule->magic != SCHEDULE_MAGIC || schedule->size != sizeof(Schedule) ||
+                     schedule->used < 0 || schedule->used > MAX_STANDING_ORDERS))
+    {
+        munmap(schedule, sizeof(Schedule));
+        close(*fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (created || !resuming)
+    {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutex_init(&schedule->lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+
+        schedule->magic = SCHEDULE_MAGIC;
+        schedule->size = sizeof(Schedule);
+        rebuildSchedule(schedule, time(NULL));
+    }
+    return schedule;
+}
+
+#endif // BANK_SCHEDULE_H
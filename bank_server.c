@@ -1,73 +1,64 @@
+#define _GNU_SOURCE
 #include "bank_common.h"
+#include "bank_lifecycle.h"
+#include "bank_auth.h"
+#include "bank_storage.h"
+#include "bank_history.h"
 #include <asm-generic/socket.h>
 
 Account accounts[MAX_ACCOUNTS];
 int accountCount = 0;
+unsigned long nextAccountSequence = 1;
+CredentialCache session_credentials; // PINs proven by the client being served
+time_t statement_times[MAX_TRANSACTIONS];         // History timestamps of the statement being answered
+Transaction statement_buffer[MAX_TRANSACTIONS]; // and the page of it being sent
 const char *DATABASE_FILE = "bank_data.dat";
 
 // Function to save accounts to file
 void saveAccountsToFile()
 {
-    FILE *file = fopen(DATABASE_FILE, "wb");
-    if (file == NULL)
+    if (saveAccountFile(DATABASE_FILE, accounts, accountCount) < 0)
     {
-        perror("Error opening file for writing");
+        perror("Error saving account data");
         return;
     }
-
-    // First write the accountCount
-    fwrite(&accountCount, sizeof(int), 1, file);
-
-    // Then write all accounts
-    fwrite(accounts, sizeof(Account), accountCount, file);
-
-    fclose(file);
     printf("Account data saved to file successfully.\n");
 }
 
 // Function to load accounts from file
 void loadAccountsFromFile()
 {
-    FILE *file = fopen(DATABASE_FILE, "rb");
-    if (file == NULL)
+    int converted;
+    int count = loadAccountFile(DATABASE_FILE, accounts, MAX_ACCOUNTS, &converted);
+    if (count < 0 && errno == ENOENT)
     {
         perror("No existing account database found");
         accountCount = 0;
         return;
     }
-
-    // First read the accountCount
-    fread(&accountCount, sizeof(int), 1, file);
-
-    // Then read all accounts
-    fread(accounts, sizeof(Account), accountCount, file);
-
-    fclose(file);
+    if (count < 0)
+    {
+        // Starting empty would overwrite the damaged file on the first save
+        fprintf(stderr, "Refusing to start: %s cannot be loaded. Restore it from a backup or move it aside.\n",
+                DATABASE_FILE);
+        exit(EXIT_FAILURE);
+    }
+    accountCount = count;
+    nextAccountSequence = accountCount + 1;
     printf("Loaded %d accounts from database file.\n", accountCount);
+
+    // Rewrite older files in the versioned format, so plaintext PINs from
+    // before hashing do not stay on disk either
+    if (converted)
+    {
+        saveAccountsToFile();
+    }
 }
 
 // Function to add a transaction to an account
 void addTransaction(Account *account, TransactionType type, double amount, const char *description)
 {
-    if (account->transactionCount >= MAX_TRANSACTIONS)
-    {
-        // Shift transactions to make room for the new one
-        for (int i = 0; i < MAX_TRANSACTIONS - 1; i++)
-        {
-            account->transactions[i] = account->transactions[i + 1];
-        }
-        account->transactionCount = MAX_TRANSACTIONS - 1;
-    }
-
-    Transaction transaction;
-    transaction.timestamp = time(NULL);
-    transaction.type = type;
-    transaction.amount = amount;
-    strncpy(transaction.description, description, sizeof(transaction.description) - 1);
-    transaction.description[sizeof(transaction.description) - 1] = '\0';
-
-    account->transactions[account->transactionCount] = transaction;
-    account->transactionCount++;
+    appendHistory(account, time(NULL), type, amount, description);
 
     // Save accounts to file after any transaction
     saveAccountsToFile();
@@ -86,10 +77,26 @@ Account *findAccount(const char *accountNumber)
     return NULL;
 }
 
+// Function to check whether any account, open or closed, has a number.
+// Only accounts from before sequence numbering can collide with a new one.
+int accountNumberTaken(const char *accountNumber)
+{
+    for (int i = 0; i < accountCount; i++)
+    {
+        if (strcmp(accounts[i].accountNumber, accountNumber) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
 // Function to validate PIN
+// The PIN hash is deliberately slow, so a PIN the client has already
+// proven in this session is let through from the credential cache.
 int validatePIN(const Account *account, const char *pin)
 {
-    return strcmp(account->pin, pin) == 0;
+    return verifyPINCached(&session_credentials, account, pin);
 }
 
 // Function to handle account opening
@@ -121,10 +128,18 @@ Response openAccount(const Request *request)
     newAccount.type = request->accountType;
     newAccount.balance = request->amount;
     newAccount.transactionCount = 0;
+    newAccount.historyLength = 0;
     newAccount.isActive = 1;
+    newAccount.accruedPeriod = accrualPeriod(time(NULL));
+
+    do
+    {
+        generateAccountNumber(newAccount.accountNumber, nextAccountSequence++);
+    } while (accountNumberTaken(newAccount.accountNumber));
 
-    generateAccountNumber(newAccount.accountNumber);
-    generatePIN(newAccount.pin);
+    char pin[PIN_LENGTH + 1];
+    generatePIN(pin);
+    setAccountPIN(&newAccount, pin);
 
     addTransaction(&newAccount, DEPOSIT, request->amount, "Initial deposit");
 
@@ -136,9 +151,9 @@ Response openAccount(const Request *request)
 
     response.success = 1;
     strcpy(response.accountNumber, newAccount.accountNumber);
-    strcpy(response.pin, newAccount.pin);
+    strcpy(response.pin, pin);
     sprintf(response.message, "Account created successfully!\nAccount Number: %s\nPIN: %s\nInitial Balance: %.2f",
-            newAccount.accountNumber, newAccount.pin, newAccount.balance);
+            newAccount.accountNumber, pin, newAccount.balance);
 
     return response;
 }
@@ -170,7 +185,7 @@ Response closeAccount(const Request *request)
 
     response.success = 1;
     response.balance = account->balance;
-    sprintf(response.message, "Account closed successfully. Remaining balance: %.2f", account->balance);
+    formatAmount(stpcpy(response.message, "Account closed successfully. Remaining balance: "), account->balance);
 
     return response;
 }
@@ -221,7 +236,7 @@ Response withdraw(const Request *request)
 
     response.success = 1;
     response.balance = account->balance;
-    sprintf(response.message, "Withdrawal successful. New balance: %.2f", account->balance);
+    formatAmount(stpcpy(response.message, "Withdrawal successful. New balance: "), account->balance);
 
     return response;
 }
@@ -258,7 +273,7 @@ Response deposit(const Request *request)
 
     response.success = 1;
     response.balance = account->balance;
-    sprintf(response.message, "Deposit successful. New balance: %.2f", account->balance);
+    formatAmount(stpcpy(response.message, "Deposit successful. New balance: "), account->balance);
 
     return response;
 }
@@ -285,13 +300,38 @@ Response checkBalance(const Request *request)
 
     response.success = 1;
     response.balance = account->balance;
-    sprintf(response.message, "Current balance: %.2f", account->balance);
+    formatAmount(stpcpy(response.message, "Current balance: "), account->balance);
 
     return response;
 }
 
+// Function to find the first transaction with a timestamp not before
+// (or, with after set, strictly after) the given time. History is appended
+// in time order, so this is a binary search rather than a scan.
+int findTransactionIndex(const time_t *times, int count, time_t timestamp, int after)
+{
+    int low = 0;
+    int high = count;
+    while (low < high)
+    {
+        int mid = low + (high - low) / 2;
+        time_t current = times[mid];
+        if (current < timestamp || (after && current == timestamp))
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return low;
+}
+
 // Function to get account statement
-Response getStatement(const Request *request)
+// Only the page being sent is decoded, into statement_buffer; payload
+// points at it so the transactions are gathered from it on send.
+Response getStatement(const Request *request, ResponsePayload *payload)
 {
     Response response = {0};
 
@@ -310,26 +350,76 @@ Response getStatement(const Request *request)
         return response;
     }
 
+    int count = decodeHistoryTimes(account, statement_times);
+
+    // The offset comes from the client; anything past the history is not a
+    // cursor this server handed out
+    if (request->pageSize > 0 && request->cursor.timestamp > 0 &&
+        (request->cursor.offset < 0 || request->cursor.offset > count))
+    {
+        response.success = 0;
+        strcpy(response.message, "Error: Invalid statement cursor.");
+        return response;
+    }
+
     response.success = 1;
     response.balance = account->balance;
 
-    int start = account->transactionCount > MAX_TRANSACTIONS_IN_STATEMENT ? account->transactionCount - MAX_TRANSACTIONS_IN_STATEMENT : 0;
+    int start;
+    int end = count;
 
-    response.transactionCount = account->transactionCount - start;
-
-    for (int i = 0; i < response.transactionCount; i++)
+    if (request->pageSize <= 0)
+    {
+        start = count > MAX_TRANSACTIONS_IN_STATEMENT ? count - MAX_TRANSACTIONS_IN_STATEMENT : 0;
+    }
+    else
     {
-        response.transactions[i] = account->transactions[start + i];
+        int pageSize = request->pageSize < MAX_STATEMENT_PAGE ? request->pageSize : MAX_STATEMENT_PAGE;
+        int limit = request->toTime > 0 ? findTransactionIndex(statement_times, count, request->toTime, 1) : count;
+
+        start = findTransactionIndex(statement_times, count, request->fromTime, 0);
+        if (request->cursor.timestamp > 0)
+        {
+            int resume = findTransactionIndex(statement_times, count, request->cursor.timestamp, 0) + request->cursor.offset;
+            if (resume > start)
+            {
+                start = resume;
+            }
+        }
+        if (start > limit)
+        {
+            start = limit;
+        }
+        end = start + pageSize < limit ? start + pageSize : limit;
+
+        response.hasMore = end < limit;
+        response.nextCursor = request->cursor;
+        if (end > start)
+        {
+            time_t last = statement_times[end - 1];
+            response.nextCursor.timestamp = last;
+            response.nextCursor.offset = end - findTransactionIndex(statement_times, count, last, 0);
+        }
     }
 
+    response.transactionCount = end - start;
+    decodeHistoryRange(account, start, end, statement_buffer);
+
+    payload->iov[0].iov_base = statement_buffer;
+    payload->iov[0].iov_len = response.transactionCount * sizeof(Transaction);
+    payload->iovcnt = 1;
+
     strcpy(response.message, "Statement retrieved successfully.");
 
     return response;
 }
 
 // Process client request and generate response
-Response processRequest(const Request *request)
+// Any records to send after the response are described by payload.
+Response processRequest(const Request *request, ResponsePayload *payload)
 {
+    payload->iovcnt = 0;
+
     switch (request->type)
     {
     case OPEN_ACCOUNT:
@@ -343,7 +433,7 @@ Response processRequest(const Request *request)
     case CHECK_BALANCE:
         return checkBalance(request);
     case GET_STATEMENT:
-        return getStatement(request);
+        return getStatement(request, payload);
     default:
         Response response = {0};
         response.success = 0;
@@ -352,85 +442,181 @@ Response processRequest(const Request *request)
     }
 }
 
-int main()
+// Serve requests from one client until it disconnects. Returns 1 when a
+// hot restart was requested between requests and the connection should be
+// handed over, 0 once the connection has been closed.
+int handleClient(int client_socket)
 {
-    srand(time(NULL));
+    time_t drainStarted = 0;
+    credentialCacheInit(&session_credentials);
 
-    // Load accounts from file at startup
-    loadAccountsFromFile();
+    while (1)
+    {
+        if (restart_requested)
+        {
+            return 1;
+        }
+        if (shutdown_requested && drainStarted == 0)
+        {
+            printf("Draining: finishing the current session before shutdown...\n");
+            drainStarted = time(NULL);
+        }
+        if (drainStarted && drainExpired(drainStarted))
+        {
+            printf("Drain timeout reached. Closing client connection.\n");
+            break;
+        }
 
-    int server_fd, new_socket;
-    struct sockaddr_in address;
-    int opt = 1;
-    int addrlen = sizeof(address);
+        // Signals only ever interrupt this wait, never a request in progress
+        int ready = waitReadable(client_socket, 1000);
+        if (ready == 0)
+        {
+            continue;
+        }
 
-    // Creating socket file descriptor
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0)
-    {
-        perror("Socket creation failed");
-        exit(EXIT_FAILURE);
+        // Wait for the whole request; pipelined requests can arrive split
+        Request request;
+        if (ready < 0 || recvAll(client_socket, &request, sizeof(request)) < 0)
+        {
+            printf("Client disconnected\n");
+            break;
+        }
+
+        ResponsePayload payload;
+        Response response = processRequest(&request, &payload);
+        sendResponse(client_socket, &response, &payload);
     }
 
-    // Set socket options
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt)))
+    close(client_socket);
+    return 0;
+}
+
+// Hand the listening socket and the current client, if any, to a newly
+// executed server binary. Only returns if the new binary failed to start.
+void hotRestart(int server_fd, int client_socket, char *argv[])
+{
+    restart_requested = 0;
+    printf("Hot restart: starting new server binary...\n");
+
+    int channel = startSuccessor(argv);
+    if (channel < 0)
     {
-        perror("Setsockopt failed");
-        exit(EXIT_FAILURE);
+        printf("Hot restart aborted. Continuing to serve.\n");
+        return;
     }
 
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(PORT);
+    // The successor loads the database only after receiving the handoff
+    saveAccountsToFile();
 
-    // Bind socket to the address and port
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0)
+    int fds[2] = {server_fd, client_socket};
+    if (sendHandoff(channel, fds, client_socket >= 0 ? 2 : 1) < 0)
     {
-        perror("Bind failed");
+        perror("Handoff failed");
         exit(EXIT_FAILURE);
     }
 
-    // Listen for connections
-    if (listen(server_fd, 3) < 0)
+    printf("Hot restart: handed over to the new server. Exiting.\n");
+    exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    (void)argc;
+    installLifecycleHandlers();
+
+    // A hot restart passes in the listening socket and the client being served
+    int handoff[HANDOFF_MAX_FDS];
+    int handoffCount = receiveHandoff(handoff, HANDOFF_MAX_FDS);
+
+    // Load accounts from file at startup
+    loadAccountsFromFile();
+
+    int server_fd, new_socket = -1;
+    struct sockaddr_in address;
+    int opt = 1;
+    int addrlen = sizeof(address);
+
+    if (handoffCount > 0)
     {
-        perror("Listen failed");
-        exit(EXIT_FAILURE);
+        server_fd = handoff[0];
+        new_socket = handoffCount > 1 ? handoff[1] : -1;
+        printf("Bank server took over from the previous process on port %d...\n", PORT);
     }
+    else
+    {
+        // Creating socket file descriptor
+        if ((server_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) == 0)
+        {
+            perror("Socket creation failed");
+            exit(EXIT_FAILURE);
+        }
 
-    printf("Bank server started on port %d...\n", PORT);
+        // Set socket options
+        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt)))
+        {
+            perror("Setsockopt failed");
+            exit(EXIT_FAILURE);
+        }
 
-    // Server main loop
-    while (1)
-    {
-        printf("Waiting for connections...\n");
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = INADDR_ANY;
+        address.sin_port = htons(PORT);
 
-        // Accept a new connection
-        if ((new_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t *)&addrlen)) < 0)
+        // Bind socket to the address and port
+        if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0)
         {
-            perror("Accept failed");
-            continue;
+            perror("Bind failed");
+            exit(EXIT_FAILURE);
         }
 
-        printf("Client connected\n");
+        // Listen for connections
+        if (listen(server_fd, 3) < 0)
+        {
+            perror("Listen failed");
+            exit(EXIT_FAILURE);
+        }
 
-        // Handle communication with the client
-        while (1)
+        printf("Bank server started on port %d...\n", PORT);
+    }
+
+    // Server main loop
+    while (!shutdown_requested)
+    {
+        if (new_socket < 0)
         {
-            Request request;
-            ssize_t bytes_received = recv(new_socket, &request, sizeof(request), 0);
+            if (restart_requested)
+            {
+                hotRestart(server_fd, -1, argv);
+                continue;
+            }
 
-            if (bytes_received <= 0)
+            printf("Waiting for connections...\n");
+
+            // Accept a new connection
+            if ((new_socket = accept4(server_fd, (struct sockaddr *)&address, (socklen_t *)&addrlen, SOCK_CLOEXEC)) < 0)
             {
-                printf("Client disconnected\n");
-                break;
+                if (errno != EINTR)
+                {
+                    perror("Accept failed");
+                }
+                continue;
             }
 
-            Response response = processRequest(&request);
-            send(new_socket, &response, sizeof(response), 0);
+            printf("Client connected\n");
         }
 
-        close(new_socket);
+        // Handle communication with the client
+        if (handleClient(new_socket))
+        {
+            hotRestart(server_fd, new_socket, argv);
+            continue;
+        }
+        new_socket = -1;
     }
 
+    // Stop accepting, then make sure everything is on disk before exiting
     close(server_fd);
+    saveAccountsToFile();
+    printf("Bank server shut down.\n");
     return 0;
-}
\ No newline at end of file
+}
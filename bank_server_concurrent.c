@@ -1,105 +1,747 @@
 #define _GNU_SOURCE
 #include "bank_common.h"
+#include "bank_ratelimit.h"
+#include "bank_fraud.h"
+#include "bank_lifecycle.h"
+#include "bank_oplog.h"
+#include "bank_cdc.h"
+#include "bank_shard.h"
+#include "bank_auth.h"
+#include "bank_storage.h"
+#include "bank_history.h"
+#include "bank_uring.h"
+#include "bank_schedule.h"
+#include "bank_dedup.h"
+#include "bank_customer.h"
+#include "bank_slots.h"
+#include "bank_checkpoint.h"
+#include "bank_trace.h"
 #include <asm-generic/socket.h>
 #include <signal.h>
+#include <poll.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <errno.h>
 #include <string.h>
 #include <unistd.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 
-Account accounts[MAX_ACCOUNTS];
-int accountCount = 0;
+#define MAX_CLIENTS 5
+#define MAX_PENDING_CLIENTS 16
+#define PENDING_TIMEOUT 10 // Seconds a queued connection waits for a free slot
+#define LISTEN_BACKLOG 128
+
+// Reactor mode: one thread, listener and epoll loop per core
+#define MAX_REACTORS 64
+#define MAX_REACTOR_CONNECTIONS 1024
+#define REACTOR_EVENTS 64
+#define REACTOR_REQUEST_BUDGET 16 // Requests served per connection per wakeup
+#define URING_QUEUE_DEPTH 256
+#define URING_LISTENER_SLOT 0 // Fixed files: the listener, the log, then one per connection
+#define URING_LOG_SLOT 1
+#define URING_FIRST_CONNECTION_SLOT 2
+#define URING_ACCEPT 1 // Completion tags of the ring operations not owned by a connection
+#define URING_FSYNC 2
+#define URING_CANCEL 3
+
+// Token bucket settings: tokens per second and burst size
+#define IP_RATE 10.0
+#define IP_BURST 20.0
+#define ACCOUNT_RATE 2.0
+#define ACCOUNT_BURST 10.0
+#define FAILED_PIN_PENALTY 5.0
+#define PIN_FAILURE_RATE 0.2 // Wrong PINs hashed per second for one address
+#define PIN_FAILURE_BURST 5.0
+
+#define MAX_PENDING_TRANSFERS 256
+#define MAX_REQUEST_AMOUNT 1e12 // Larger amounts, NaN and infinities are refused outright
+
+// bank_simulate.c stops the server here, as a crash would, to check what
+// survives a restart
+#ifndef SIMULATE_CRASH_POINT
+#define SIMULATE_CRASH_POINT()
+#endif
+#define TRANSFER_RETRY_INTERVAL 1 // Seconds between resending undelivered commits and aborts
+#define TRANSFER_ID_BITS 48       // Transfer IDs are the shard index above a counter this wide
+#define TRANSFER_ID_MASK ((1UL << TRANSFER_ID_BITS) - 1)
+
+// Monthly batch: interest on savings, a fee on checking
+#define SAVINGS_INTEREST_RATE 0.03 // Yearly, paid monthly
+#define CHECKING_MONTHLY_FEE 25.0
+#define ACCRUAL_CHUNK 16 // Accounts a batch thread claims at a time
+#define ACCRUAL_MAX_THREADS 8
+
+// Closed accounts are archived and their slots freed this often, or at once
+// when the table is full
+#define COMPACTION_INTERVAL 60
+
+#define STORE_MAGIC 0x424e4b53544f5245UL // "BNKSTORE"
+
+// Connection accepted while all client slots were busy
+typedef struct
+{
+    int socket;
+    char ip[INET_ADDRSTRLEN];
+    double queuedAt;
+} PendingClient;
+
+// Cross-shard transfer state. The source shard coordinates: it reserves the
+// funds, asks the target shard to prepare, then commits or aborts. An entry
+// stays COMMITTING or ABORTING until the target acknowledges the outcome.
+typedef enum
+{
+    TRANSFER_FREE,
+    TRANSFER_PREPARED,
+    TRANSFER_COMMITTING,
+    TRANSFER_COMMITTED,
+    TRANSFER_ABORTING,
+    TRANSFER_ABORTED
+} TransferState;
+
+typedef struct
+{
+    unsigned long id;
+    TransferState state;
+    int coordinator; // 1 on the source shard, 0 on the target shard
+    char account[ACC_NUM_LENGTH + 1];     // Our side of the transfer
+    char peerAccount[ACC_NUM_LENGTH + 1]; // The other shard's side
+    double amount;
+    time_t updated;
+} PendingTransfer;
+
+// All account state, kept in a shared memfd mapping so forked children,
+// reactor threads and, across a hot restart, the next server process work
+// on the same accounts. Adding an account or freeing a slot takes
+// tableLock exclusively; everything else takes it shared and then locks the
+// one account it uses.
+// The customer index has its own lock, since closing an account changes it
+// without holding tableLock.
+// Lock order: applyLock, tableLock, account locks, persistLock,
+// customerLock, transferLock, logLock.
+typedef struct
+{
+    unsigned long magic;
+    size_t size;
+    pthread_rwlock_t tableLock;
+    pthread_mutex_t persistLock;
+    pthread_rwlock_t accountLocks[MAX_ACCOUNTS];
+    int accountCount; // Slots in use or on the free list
+    Account accounts[MAX_ACCOUNTS];
+    Account savedAccounts[MAX_ACCOUNTS]; // Each slot as the database file last got it, under persistLock
+    AccountSlots slots;
+    int closedCount;   // Closed accounts still in their slots, waiting to be archived
+    int archivedCount; // Accounts in the archive
+    unsigned long nextAccountSequence; // Advanced atomically, without a lock
+
+    // Open accounts by national ID
+    pthread_mutex_t customerLock;
+    CustomerIndex customers;
+
+    // Operation log position, signalled to replication senders on append
+    pthread_mutex_t logLock;
+    pthread_cond_t logCond;
+    unsigned long firstSequence;
+    unsigned long lastSequence;
+
+    // Replicas apply the primary's records one at a time and refuse writes
+    pthread_mutex_t applyLock;
+    int readOnly;
+
+    // Cross-shard transfers in flight, and recently finished ones so that
+    // a repeated commit or abort is answered consistently
+    pthread_mutex_t transferLock;
+    unsigned long nextTransferId;
+    PendingTransfer transfers[MAX_PENDING_TRANSFERS];
+
+    int accruedPeriod; // Month the interest and fee batch last finished
+} AccountStore;
+
+// Client connection owned by a reactor thread
+typedef struct Connection
+{
+    int socket;
+    char ip[INET_ADDRSTRLEN];
+    Request request;
+    size_t received;
+    CredentialCache credentials;
+    struct Connection *prev;
+    struct Connection *next;
+    // epoll backend only: the rest of an answer the socket would not take
+    // yet, and since when it has been waiting
+    char *output;
+    size_t outputLength;
+    size_t outputSent;
+    time_t outputSince;
+    // io_uring backend only: the answer in flight, a copy of its records,
+    // and the fixed file slot
+    int slot;
+    int sending;
+    time_t sendingSince;
+    Response response;
+    void *records;
+    struct iovec iov[RESPONSE_MAX_IOV + 1];
+    struct msghdr message;
+    struct Connection *nextUnsynced;
+} Connection;
+
+typedef struct
+{
+    int id;
+    int listener;
+    int epoll_fd;
+    int connectionCount;
+    Connection *connections;
+    pthread_t thread;
+    // io_uring backend only. Connections live in one pool so a single
+    // registered buffer covers every request they receive into.
+    Ring ring;
+    Connection *pool;
+    int fixedBuffers;
+    int *freeSlots;
+    int freeCount;
+    int accepting;
+    struct sockaddr_in acceptAddress;
+    socklen_t acceptLength;
+    Connection *unsynced; // Answers to changes waiting for the next log fsync
+    Connection *syncing;  // Answers waiting for the fsync in flight
+} Reactor;
+
+AccountStore *store = NULL;
+int store_fd = -1;
 const char *DATABASE_FILE = "bank_data.dat";
-int active_clients = 0;
-pid_t client_pids[5]; // Store up to 5 client PIDs
+int server_port = PORT;
+char log_path[512];
+char archive_path[512];
+int log_fd = -1;
+__thread unsigned long operations_logged = 0; // Changes this thread has appended to the log
+__thread time_t statement_times[MAX_TRANSACTIONS];         // History timestamps of the statement being answered
+__thread Transaction statement_buffer[MAX_TRANSACTIONS]; // and the page of it being sent
+__thread AccountSummary listing_buffer[MAX_LISTED_ACCOUNTS]; // Account listing being sent
+int use_io_uring = 0;
+int replication_port = 0;           // Serve replicas on this port when set
+int cdc_port = 0;                   // Stream committed events to subscribers on this port when set
+char primary_host[256] = "";        // Follow this primary when set
+int primary_port = 0;
+volatile int follower_socket = -1;
+volatile sig_atomic_t promote_requested = 0;
+int shard_index = 0;
+int shard_count = 1;
+ShardAddress shards[MAX_SHARDS];
+const char *cluster_secret = NULL; // Authenticates shard-to-shard requests
+const char *tls_cert_file = NULL;   // Serve clients over TLS with this certificate
+const char *tls_key_file = NULL;    // and key when set
+#ifdef BANK_TLS
+SSL_CTX *tls_context = NULL;
+#endif
+__thread CredentialCache *session_credentials = NULL; // PINs proven by the connection being served
+__thread const char *session_ip = NULL;              // and the address it comes from
+__thread int pin_retry_after = 0;                    // Set when validatePIN would not even hash the PIN
+__thread const Account *held_accounts[2];           // Accounts this thread has locked exclusively
+__thread int held_first = 0, held_end = 0;          // and a run of slots the monthly batch holds
+volatile sig_atomic_t active_clients = 0;
+pid_t client_pids[MAX_CLIENTS];
+PendingClient pending_clients[MAX_PENDING_CLIENTS];
+int pending_head = 0;
+int pending_count = 0;
+int listeners[HANDOFF_MAX_FDS];
+int listener_count = 0;
+volatile int handed_over = 0;        // Set once a successor owns the listeners
+RateLimiter *ip_limiter = NULL;      // Per source address, shared with children
+RateLimiter *account_limiter = NULL; // Per account number, shared with children
+RateLimiter *pin_failure_limiter = NULL; // Wrong PINs per source address, shared with children
+FraudMonitor *fraud_monitor = NULL;  // Withdrawal checks, shared with children
+Schedule *schedule = NULL;           // Standing orders, shared with children
+int schedule_fd = -1;
+DedupTable *dedup_table = NULL;      // Recently applied request IDs, shared with children
+__thread int running_standing_orders = 0; // Set while the scheduler runs a batch
 
-// Function to save accounts to file
-void saveAccountsToFile()
+// Function to create the account store in a memfd
+int createAccountStore()
 {
-    FILE *file = fopen(DATABASE_FILE, "wb");
-    if (file == NULL)
+    store_fd = memfd_create("bank_store", MFD_CLOEXEC);
+    if (store_fd < 0 || ftruncate(store_fd, sizeof(AccountStore)) < 0)
     {
-        perror("Error opening file for writing");
-        return;
+        return -1;
+    }
+
+    store = mmap(NULL, sizeof(AccountStore), PROT_READ | PROT_WRITE, MAP_SHARED, store_fd, 0);
+    if (store == MAP_FAILED)
+    {
+        store = NULL;
+        return -1;
+    }
+
+    pthread_rwlockattr_t rwattr;
+    pthread_rwlockattr_init(&rwattr);
+    pthread_rwlockattr_setpshared(&rwattr, PTHREAD_PROCESS_SHARED);
+    pthread_rwlock_init(&store->tableLock, &rwattr);
+    for (int i = 0; i < MAX_ACCOUNTS; i++)
+    {
+        pthread_rwlock_init(&store->accountLocks[i], &rwattr);
+    }
+    pthread_rwlockattr_destroy(&rwattr);
+
+    pthread_mutexattr_t mattr;
+    pthread_mutexattr_init(&mattr);
+    pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&store->persistLock, &mattr);
+    pthread_mutex_init(&store->logLock, &mattr);
+    pthread_mutex_init(&store->applyLock, &mattr);
+    pthread_mutex_init(&store->transferLock, &mattr);
+    pthread_mutex_init(&store->customerLock, &mattr);
+    pthread_mutexattr_destroy(&mattr);
+
+    pthread_condattr_t cattr;
+    pthread_condattr_init(&cattr);
+    pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+    pthread_cond_init(&store->logCond, &cattr);
+    pthread_condattr_destroy(&cattr);
+
+    store->magic = STORE_MAGIC;
+    store->size = sizeof(AccountStore);
+    store->accountCount = 0;
+    slotsBuild(&store->slots, store->accounts, 0);
+    customerIndexClear(&store->customers);
+    return 0;
+}
+
+// Function to map the store handed over by the previous server process.
+// Returns -1 if it was built with a different layout.
+int attachAccountStore(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size != sizeof(AccountStore))
+    {
+        return -1;
+    }
+
+    AccountStore *shared = mmap(NULL, sizeof(AccountStore), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (shared == MAP_FAILED)
+    {
+        return -1;
+    }
+    if (shared->magic != STORE_MAGIC || shared->size != sizeof(AccountStore))
+    {
+        munmap(shared, sizeof(AccountStore));
+        return -1;
     }
 
-    // First write the accountCount
-    fwrite(&accountCount, sizeof(int), 1, file);
+    store = shared;
+    store_fd = fd;
+    return 0;
+}
+
+// Function to remember that this thread holds an account exclusively
+void holdAccount(const Account *account)
+{
+    held_accounts[held_accounts[0] != NULL] = account;
+}
+
+int holdsAccount(const Account *account)
+{
+    int slot = account - store->accounts;
+    return held_accounts[0] == account || held_accounts[1] == account || (slot >= held_first && slot < held_end);
+}
 
-    // Then write all accounts
-    fwrite(accounts, sizeof(Account), accountCount, file);
+// Function to save accounts to file
+// Free slots are left out, so the file shrinks once closed accounts have
+// been archived. Each account is copied under its read lock, so the file
+// never holds one half changed. Callers may hold account locks, so waiting
+// for one could deadlock: an account another thread is changing goes in as
+// the last save had it, and that thread saves again once it is done.
+void saveAccountsToFile()
+{
+    TRACE_BEGIN(trace);
+    pthread_mutex_lock(&store->persistLock);
+    int count = store->accountCount;
+    Account *packed = malloc(sizeof(Account) * (count > 0 ? count : 1));
+    int used = 0;
+    for (int i = 0; i < count && packed != NULL; i++)
+    {
+        if (holdsAccount(&store->accounts[i]))
+        {
+            store->savedAccounts[i] = store->accounts[i];
+        }
+        else if (pthread_rwlock_tryrdlock(&store->accountLocks[i]) == 0)
+        {
+            store->savedAccounts[i] = store->accounts[i];
+            pthread_rwlock_unlock(&store->accountLocks[i]);
+        }
+        if (store->savedAccounts[i].accountNumber[0] != '\0')
+        {
+            packed[used++] = store->savedAccounts[i];
+        }
+    }
+    int saved = packed != NULL ? saveAccountFile(DATABASE_FILE, packed, used) : -1;
+    pthread_mutex_unlock(&store->persistLock);
+    free(packed);
+    TRACE_END(trace, "saveAccountsToFile", used);
 
-    fclose(file);
+    if (saved < 0)
+    {
+        perror("Error saving account data");
+        return;
+    }
     printf("Account data saved to file successfully.\n");
 }
 
 // Function to load accounts from file
 void loadAccountsFromFile()
 {
-    FILE *file = fopen(DATABASE_FILE, "rb");
-    if (file == NULL)
+    int converted;
+    int count = loadAccountFile(DATABASE_FILE, store->accounts, MAX_ACCOUNTS, &converted);
+    if (count < 0 && errno == ENOENT)
     {
         perror("No existing account database found");
-        accountCount = 0;
+        store->accountCount = 0;
         return;
     }
+    if (count < 0)
+    {
+        // Starting empty would overwrite the damaged file on the first save
+        fprintf(stderr, "Refusing to start: %s cannot be loaded. Restore it from a backup or move it aside.\n",
+                DATABASE_FILE);
+        exit(EXIT_FAILURE);
+    }
+    store->accountCount = count;
+    store->closedCount = slotsBuild(&store->slots, store->accounts, count);
+    customerIndexBuild(&store->customers, store->accounts, count);
+    memcpy(store->savedAccounts, store->accounts, sizeof(Account) * count);
+    printf("Loaded %d accounts from database file.\n", store->accountCount);
 
-    // First read the accountCount
-    fread(&accountCount, sizeof(int), 1, file);
+    // Rewrite older files in the versioned format, so plaintext PINs from
+    // before hashing do not stay on disk either
+    if (converted)
+    {
+        saveAccountsToFile();
+    }
+}
 
-    // Then read all accounts
-    fread(accounts, sizeof(Account), accountCount, file);
+// Function to add a transaction with a given time, made by client request
+// requestId (0 for none), to an account
+void recordTransaction(Account *account, time_t timestamp, TransactionType type, double amount, const char *description,
+                       unsigned long requestId)
+{
+    TRACE_BEGIN(trace);
+    appendRequestHistory(account, timestamp, type, amount, description, requestId);
+    TRACE_END(trace, "appendHistory", type);
 
-    fclose(file);
-    printf("Loaded %d accounts from database file.\n", accountCount);
+    // Save accounts to file after any transaction; a batch of standing
+    // orders saves once when it is done. The request ID is saved with the
+    // balance, so the simulation also crashes after the save, before the
+    // caller logs the change.
+    if (!running_standing_orders)
+    {
+        SIMULATE_CRASH_POINT();
+        saveAccountsToFile();
+        SIMULATE_CRASH_POINT();
+    }
 }
 
 // Function to add a transaction to an account
 void addTransaction(Account *account, TransactionType type, double amount, const char *description)
 {
-    if (account->transactionCount >= MAX_TRANSACTIONS)
+    recordTransaction(account, time(NULL), type, amount, description, 0);
+}
+
+// Function to number a record and append it to the operation log
+void appendOperationRecord(OperationRecord *record)
+{
+    pthread_mutex_lock(&store->logLock);
+    record->sequence = store->lastSequence + 1;
+    if (write(log_fd, record, sizeof(*record)) != sizeof(*record))
+    {
+        perror("Error appending to operation log");
+    }
+    else
     {
-        // Shift transactions to make room for the new one
-        for (int i = 0; i < MAX_TRANSACTIONS - 1; i++)
+        if (store->firstSequence == 0)
         {
-            account->transactions[i] = account->transactions[i + 1];
+            store->firstSequence = record->sequence;
         }
-        account->transactionCount = MAX_TRANSACTIONS - 1;
+        store->lastSequence = record->sequence;
+        pthread_cond_broadcast(&store->logCond);
+        operations_logged++;
+    }
+    pthread_mutex_unlock(&store->logLock);
+}
+
+// Function to append a committed change to the operation log. Called with
+// the account locked, so each account's records are in commit order. A
+// deposit or withdrawal's request ID goes into the record, so the dedup
+// table can be rebuilt from the log after a restart.
+void logOperation(RequestType type, const Account *account, double amount, unsigned long requestId)
+{
+    TRACE_BEGIN(trace);
+    OperationRecord record = {0};
+    record.type = type;
+    record.timestamp = type == CLOSE_ACCOUNT || account->transactionCount == 0 ? time(NULL) : account->historyLast;
+    strcpy(record.accountNumber, account->accountNumber);
+    if (type == OPEN_ACCOUNT)
+    {
+        memcpy(record.pinSalt, account->pinSalt, PIN_SALT_LENGTH);
+        memcpy(record.pinHash, account->pinHash, PIN_HASH_LENGTH);
+        strcpy(record.name, account->name);
+        strcpy(record.nationalID, account->nationalID);
+        record.accountType = account->type;
+    }
+    else if (type == TRANSFER || type == ACCRUAL)
+    {
+        // Transfers and accruals carry their description, and a signed amount
+        Transaction last;
+        lastTransaction(account, &last);
+        memcpy(record.name, last.description, MAX_NAME_LENGTH);
+    }
+    else if (requestId != 0)
+    {
+        snprintf(record.name, sizeof(record.name), "%lx", requestId);
+        dedupRemember(dedup_table, account->accountNumber, requestId, type, amount, account->balance, record.timestamp);
     }
+    record.amount = amount;
+    record.balance = account->balance;
 
-    Transaction transaction;
-    transaction.timestamp = time(NULL);
-    transaction.type = type;
-    transaction.amount = amount;
-    strncpy(transaction.description, description, sizeof(transaction.description) - 1);
-    transaction.description[sizeof(transaction.description) - 1] = '\0';
+    appendOperationRecord(&record);
+    TRACE_END(trace, "logOperation", type);
+}
 
-    account->transactions[account->transactionCount] = transaction;
-    account->transactionCount++;
+// Function to log a step of a cross-shard transfer on either shard. Called
+// with the account locked; amount is what the step did to its balance.
+void logTransferStep(RequestType type, const Account *account, unsigned long id, const char *peerAccount, double amount)
+{
+    OperationRecord record = {0};
+    record.type = type;
+    record.timestamp = amount != 0 ? account->historyLast : time(NULL);
+    strcpy(record.accountNumber, account->accountNumber);
+    snprintf(record.name, sizeof(record.name), "%lx", id);
+    strcpy(record.nationalID, peerAccount);
+    record.amount = amount;
+    record.balance = account->balance;
 
-    // Save accounts to file after any transaction
-    saveAccountsToFile();
+    appendOperationRecord(&record);
+}
+
+// Function to add an account that was just opened to the customer index
+void indexCustomerAccount(const Account *account)
+{
+    pthread_mutex_lock(&store->customerLock);
+    customerIndexAdd(&store->customers, store->accounts, account - store->accounts);
+    pthread_mutex_unlock(&store->customerLock);
+}
+
+// Function to drop an account that was just closed from the customer index
+void unindexCustomerAccount(const Account *account)
+{
+    pthread_mutex_lock(&store->customerLock);
+    customerIndexRemove(&store->customers, store->accounts, account - store->accounts);
+    pthread_mutex_unlock(&store->customerLock);
 }
 
 // Function to find an account by account number
+// Callers hold tableLock.
 Account *findAccount(const char *accountNumber)
 {
-    for (int i = 0; i < accountCount; i++)
+    int slot = slotsFind(&store->slots, store->accounts, accountNumber);
+    return slot >= 0 && store->accounts[slot].isActive ? &store->accounts[slot] : NULL;
+}
+
+// Function to check whether any account still in the table, open or
+// closed, has a number. Only accounts from before sequence numbering or
+// from a lost counter can collide with a new number; archived accounts are
+// counted by resetAccountSequence instead. Callers hold tableLock.
+int accountNumberTaken(const char *accountNumber)
+{
+    return slotsFind(&store->slots, store->accounts, accountNumber) >= 0;
+}
+
+// Function to place a new account in a free slot, or at the end of the
+// table. Returns it, or NULL when the table is full. Callers hold tableLock
+// exclusively.
+Account *addAccount(const Account *newAccount)
+{
+    int slot = slotsTake(&store->slots);
+    if (slot < 0 && store->accountCount < MAX_ACCOUNTS)
+    {
+        slot = store->accountCount++;
+    }
+    if (slot < 0)
+    {
+        return NULL;
+    }
+
+    // saveAccountsToFile reads slots without tableLock
+    pthread_rwlock_wrlock(&store->accountLocks[slot]);
+    store->accounts[slot] = *newAccount;
+    pthread_mutex_lock(&store->persistLock);
+    store->savedAccounts[slot] = *newAccount;
+    pthread_mutex_unlock(&store->persistLock);
+    pthread_rwlock_unlock(&store->accountLocks[slot]);
+    slotsAdd(&store->slots, store->accounts, slot);
+    indexCustomerAccount(&store->accounts[slot]);
+    return &store->accounts[slot];
+}
+
+// Function to tell whether the table has no slot left for a new account
+int accountTableFull()
+{
+    return store->accountCount >= MAX_ACCOUNTS && store->slots.freeCount == 0;
+}
+
+// Function to take the next account number from this shard's sequence
+void allocateAccountNumber(char *accountNumber)
+{
+    unsigned long next = __atomic_fetch_add(&store->nextAccountSequence, 1, __ATOMIC_RELAXED);
+    generateAccountNumber(accountNumber, next * shard_count + shard_index);
+}
+
+// Function to restart the sequence past the accounts we have, archived ones
+// included. Numbers it hands out again are skipped by accountNumberTaken.
+void resetAccountSequence()
+{
+    unsigned long accounts = store->accountCount - store->slots.freeCount + store->archivedCount;
+    if (store->nextAccountSequence <= accounts)
+    {
+        store->nextAccountSequence = accounts + 1;
+    }
+}
+
+// Function to find an account and lock it, exclusively to change it or
+// shared to read it. Returns NULL if there is no such active account.
+Account *lockAccount(const char *accountNumber, int exclusive)
+{
+    TRACE_BEGIN(trace);
+    pthread_rwlock_rdlock(&store->tableLock);
+
+    Account *account = findAccount(accountNumber);
+    if (account != NULL)
+    {
+        pthread_rwlock_t *lock = &store->accountLocks[account - store->accounts];
+        if (exclusive)
+        {
+            pthread_rwlock_wrlock(lock);
+        }
+        else
+        {
+            pthread_rwlock_rdlock(lock);
+        }
+
+        // It may have been closed while we waited for the lock
+        if (!account->isActive)
+        {
+            pthread_rwlock_unlock(lock);
+            account = NULL;
+        }
+        else if (exclusive)
+        {
+            holdAccount(account);
+        }
+    }
+
+    pthread_rwlock_unlock(&store->tableLock);
+    TRACE_END(trace, "lockAccount", exclusive);
+    return account;
+}
+
+void unlockAccount(const Account *account)
+{
+    for (int i = 0; i < 2; i++)
     {
-        if (strcmp(accounts[i].accountNumber, accountNumber) == 0 && accounts[i].isActive)
+        if (held_accounts[i] == account)
         {
-            return &accounts[i];
+            held_accounts[i] = NULL;
         }
     }
-    return NULL;
+    pthread_rwlock_unlock(&store->accountLocks[account - store->accounts]);
 }
 
 // Function to validate PIN
+// The PIN hash is deliberately slow, so a connection that has already
+// proven this PIN is let through from its credential cache.
 int validatePIN(const Account *account, const char *pin)
 {
-    return strcmp(account->pin, pin) == 0;
+    // Standing orders were authorised with the PIN when they were set up
+    if (running_standing_orders || credentialCached(session_credentials, account, pin))
+    {
+        return 1;
+    }
+
+    // On a reactor thread the hash holds up every other connection, so an
+    // address that keeps getting PINs wrong gets no more hashes for a while
+    int retryAfter = session_ip != NULL ? rateLimitCheck(pin_failure_limiter, session_ip, 1) : 0;
+    if (retryAfter > 0)
+    {
+        pin_retry_after = retryAfter;
+        return 0;
+    }
+
+    TRACE_BEGIN(trace);
+    int valid = verifyPINCached(session_credentials, account, pin);
+    TRACE_END(trace, "validatePIN", valid);
+    if (valid)
+    {
+        return 1;
+    }
+
+    // Failed attempts drain the account's budget to slow down PIN guessing,
+    // and too many of them block its withdrawals for a while
+    if (session_ip != NULL)
+    {
+        rateLimitPenalize(pin_failure_limiter, session_ip, 1);
+    }
+    rateLimitPenalize(account_limiter, account->accountNumber, FAILED_PIN_PENALTY);
+    fraudRecordPinFailure(fraud_monitor, account->accountNumber);
+    return 0;
+}
+
+// Function to validate a PIN for an account about to be changed. Only the
+// read lock is taken, to copy the salt and hash into credentials, and the
+// slow hash runs with no lock held, so requests waiting for the write lock
+// do not wait for it too. Returns 1 or 0, or -1 if there is no such account.
+int validatePINUnlocked(const char *accountNumber, const char *pin, Account *credentials)
+{
+    Account *account = lockAccount(accountNumber, 0);
+    if (account == NULL)
+    {
+        return -1;
+    }
+    memset(credentials, 0, sizeof(*credentials));
+    strcpy(credentials->accountNumber, account->accountNumber);
+    memcpy(credentials->pinSalt, account->pinSalt, PIN_SALT_LENGTH);
+    memcpy(credentials->pinHash, account->pinHash, PIN_HASH_LENGTH);
+    unlockAccount(account);
+
+    return validatePIN(credentials, pin);
+}
+
+// Whether the account, now locked, still has the PIN hash that was checked
+int pinUnchanged(const Account *account, const Account *credentials)
+{
+    return memcmp(account->pinHash, credentials->pinHash, PIN_HASH_LENGTH) == 0;
+}
+
+// Function to validate a request's PIN and then lock its account
+// exclusively. Returns NULL if there is no such account; otherwise sets
+// *pinValid, which is 0 if the PIN was wrong or changed while it was checked.
+Account *lockAccountWithPIN(const char *accountNumber, const char *pin, int *pinValid)
+{
+    Account credentials;
+    *pinValid = validatePINUnlocked(accountNumber, pin, &credentials);
+    if (*pinValid < 0)
+    {
+        return NULL;
+    }
+
+    Account *account = lockAccount(accountNumber, 1);
+    if (account != NULL && !pinUnchanged(account, &credentials))
+    {
+        *pinValid = 0;
+    }
+    return account;
 }
 
 // Function to handle account opening
@@ -107,7 +749,7 @@ Response openAccount(const Request *request)
 {
     Response response = {0};
 
-    if (accountCount >= MAX_ACCOUNTS)
+    if (accountTableFull())
     {
         response.success = 0;
         strcpy(response.message, "Error: Maximum account limit reached.");
@@ -131,34 +773,66 @@ Response openAccount(const Request *request)
     newAccount.type = request->accountType;
     newAccount.balance = request->amount;
     newAccount.transactionCount = 0;
+    newAccount.historyLength = 0;
     newAccount.isActive = 1;
+    newAccount.accruedPeriod = accrualPeriod(time(NULL)); // First posting next month
 
-    generateAccountNumber(newAccount.accountNumber);
-    generatePIN(newAccount.pin);
+    char pin[PIN_LENGTH + 1];
+    allocateAccountNumber(newAccount.accountNumber);
+    generatePIN(pin);
+    setAccountPIN(&newAccount, pin);
 
     addTransaction(&newAccount, DEPOSIT, request->amount, "Initial deposit");
 
-    accounts[accountCount] = newAccount;
-    accountCount++;
+    pthread_rwlock_wrlock(&store->tableLock);
+    while (accountNumberTaken(newAccount.accountNumber))
+    {
+        allocateAccountNumber(newAccount.accountNumber);
+    }
+    if (addAccount(&newAccount) == NULL)
+    {
+        pthread_rwlock_unlock(&store->tableLock);
+        response.success = 0;
+        strcpy(response.message, "Error: Maximum account limit reached.");
+        return response;
+    }
+    logOperation(OPEN_ACCOUNT, &newAccount, request->amount, 0);
+    pthread_rwlock_unlock(&store->tableLock);
 
     // Save accounts to file after creating a new account
     saveAccountsToFile();
 
     response.success = 1;
     strcpy(response.accountNumber, newAccount.accountNumber);
-    strcpy(response.pin, newAccount.pin);
+    strcpy(response.pin, pin);
     sprintf(response.message, "Account created successfully!\nAccount Number: %s\nPIN: %s\nInitial Balance: %.2f",
-            newAccount.accountNumber, newAccount.pin, newAccount.balance);
+            newAccount.accountNumber, pin, newAccount.balance);
 
     return response;
 }
 
+// Function to check for an unfinished cross-shard transfer on an account
+int hasPendingTransfer(const char *accountNumber)
+{
+    int found = 0;
+    pthread_mutex_lock(&store->transferLock);
+    for (int i = 0; i < MAX_PENDING_TRANSFERS && !found; i++)
+    {
+        TransferState state = store->transfers[i].state;
+        found = (state == TRANSFER_PREPARED || state == TRANSFER_COMMITTING || state == TRANSFER_ABORTING) &&
+                strcmp(store->transfers[i].account, accountNumber) == 0;
+    }
+    pthread_mutex_unlock(&store->transferLock);
+    return found;
+}
+
 // Function to handle account closing
 Response closeAccount(const Request *request)
 {
     Response response = {0};
 
-    Account *account = findAccount(request->accountNumber);
+    int pinValid;
+    Account *account = lockAccountWithPIN(request->accountNumber, request->pin, &pinValid);
     if (!account)
     {
         response.success = 0;
@@ -166,25 +840,67 @@ Response closeAccount(const Request *request)
         return response;
     }
 
-    if (!validatePIN(account, request->pin))
+    if (!pinValid)
     {
         response.success = 0;
         strcpy(response.message, "Error: Invalid PIN.");
+        unlockAccount(account);
+        return response;
+    }
+
+    // A prepared transfer must still be able to commit
+    if (hasPendingTransfer(account->accountNumber))
+    {
+        response.success = 0;
+        strcpy(response.message, "Error: A transfer to this account is in progress. Please try again shortly.");
+        unlockAccount(account);
         return response;
     }
 
     account->isActive = 0;
+    unindexCustomerAccount(account);
+    __atomic_fetch_add(&store->closedCount, 1, __ATOMIC_RELAXED);
 
     // Save accounts to file after closing an account
     saveAccountsToFile();
+    logOperation(CLOSE_ACCOUNT, account, 0, 0);
 
     response.success = 1;
     response.balance = account->balance;
-    sprintf(response.message, "Account closed successfully. Remaining balance: %.2f", account->balance);
+    formatAmount(stpcpy(response.message, "Account closed successfully. Remaining balance: "), account->balance);
 
+    unlockAccount(account);
     return response;
 }
 
+// Function to answer a deposit or withdrawal whose request ID was already
+// applied to the account, as it was answered the first time. Returns 0 for
+// a new request. Called with the account locked exclusively, so two copies
+// of a request cannot both get past it.
+int answerRetry(const Request *request, const Account *account, Response *response)
+{
+    DedupEntry entry;
+    if (request->requestId == 0 ||
+        !dedupLookup(dedup_table, account->accountNumber, request->requestId, time(NULL), &entry))
+    {
+        return 0;
+    }
+
+    if (entry.type != request->type || entry.amount != request->amount)
+    {
+        response->success = 0;
+        strcpy(response->message, "Error: Request ID already used for a different request.");
+        return 1;
+    }
+
+    response->success = 1;
+    response->balance = entry.balance;
+    formatAmount(stpcpy(response->message, entry.type == WITHDRAW ? "Withdrawal successful. New balance: "
+                                                                  : "Deposit successful. New balance: "),
+                 entry.balance);
+    return 1;
+}
+
 // Function to handle withdrawals
 Response withdraw(const Request *request)
 {
@@ -197,14 +913,15 @@ Response withdraw(const Request *request)
         return response;
     }
 
-    if ((int)request->amount % MIN_TRANSACTION != 0)
+    if ((long)request->amount % MIN_TRANSACTION != 0)
     {
         response.success = 0;
         sprintf(response.message, "Error: Withdrawal amount must be in units of %.2f.", (double)MIN_TRANSACTION);
         return response;
     }
 
-    Account *account = findAccount(request->accountNumber);
+    int pinValid;
+    Account *account = lockAccountWithPIN(request->accountNumber, request->pin, &pinValid);
     if (!account)
     {
         response.success = 0;
@@ -212,10 +929,17 @@ Response withdraw(const Request *request)
         return response;
     }
 
-    if (!validatePIN(account, request->pin))
+    if (!pinValid)
     {
         response.success = 0;
         strcpy(response.message, "Error: Invalid PIN.");
+        unlockAccount(account);
+        return response;
+    }
+
+    if (answerRetry(request, account, &response))
+    {
+        unlockAccount(account);
         return response;
     }
 
@@ -223,16 +947,33 @@ Response withdraw(const Request *request)
     {
         response.success = 0;
         sprintf(response.message, "Error: Insufficient funds. Minimum balance of %.2f must be maintained.", (double)MIN_BALANCE);
+        unlockAccount(account);
+        return response;
+    }
+
+    // Velocity and unusual-amount checks; only withdrawals let through count
+    const char *rule;
+    int retryAfter = fraudAdmitWithdrawal(fraud_monitor, account->accountNumber, request->amount, &rule);
+    if (retryAfter > 0)
+    {
+        printf("Fraud check: withdrawal of %.2f from %s refused (%s)\n", request->amount, account->accountNumber, rule);
+        response.success = 0;
+        response.retryAfter = retryAfter;
+        sprintf(response.message, "Error: Withdrawals from this account are blocked after unusual activity. Please retry in %d seconds.",
+                retryAfter);
+        unlockAccount(account);
         return response;
     }
 
     account->balance -= request->amount;
-    addTransaction(account, WITHDRAWAL, request->amount, "Withdrawal");
+    recordTransaction(account, time(NULL), WITHDRAWAL, request->amount, "Withdrawal", request->requestId);
+    logOperation(WITHDRAW, account, request->amount, request->requestId);
 
     response.success = 1;
     response.balance = account->balance;
-    sprintf(response.message, "Withdrawal successful. New balance: %.2f", account->balance);
+    formatAmount(stpcpy(response.message, "Withdrawal successful. New balance: "), account->balance);
 
+    unlockAccount(account);
     return response;
 }
 
@@ -248,7 +989,8 @@ Response deposit(const Request *request)
         return response;
     }
 
-    Account *account = findAccount(request->accountNumber);
+    int pinValid;
+    Account *account = lockAccountWithPIN(request->accountNumber, request->pin, &pinValid);
     if (!account)
     {
         response.success = 0;
@@ -256,20 +998,29 @@ Response deposit(const Request *request)
         return response;
     }
 
-    if (!validatePIN(account, request->pin))
+    if (!pinValid)
     {
         response.success = 0;
         strcpy(response.message, "Error: Invalid PIN.");
+        unlockAccount(account);
+        return response;
+    }
+
+    if (answerRetry(request, account, &response))
+    {
+        unlockAccount(account);
         return response;
     }
 
     account->balance += request->amount;
-    addTransaction(account, DEPOSIT, request->amount, "Deposit");
+    recordTransaction(account, time(NULL), DEPOSIT, request->amount, "Deposit", request->requestId);
+    logOperation(DEPOSIT_FUNDS, account, request->amount, request->requestId);
 
     response.success = 1;
     response.balance = account->balance;
-    sprintf(response.message, "Deposit successful. New balance: %.2f", account->balance);
+    formatAmount(stpcpy(response.message, "Deposit successful. New balance: "), account->balance);
 
+    unlockAccount(account);
     return response;
 }
 
@@ -278,7 +1029,7 @@ Response checkBalance(const Request *request)
 {
     Response response = {0};
 
-    Account *account = findAccount(request->accountNumber);
+    Account *account = lockAccount(request->accountNumber, 0);
     if (!account)
     {
         response.success = 0;
@@ -290,22 +1041,49 @@ Response checkBalance(const Request *request)
     {
         response.success = 0;
         strcpy(response.message, "Error: Invalid PIN.");
+        unlockAccount(account);
         return response;
     }
 
     response.success = 1;
     response.balance = account->balance;
-    sprintf(response.message, "Current balance: %.2f", account->balance);
+    formatAmount(stpcpy(response.message, "Current balance: "), account->balance);
 
+    unlockAccount(account);
     return response;
 }
 
+// Function to find the first transaction with a timestamp not before
+// (or, with after set, strictly after) the given time. History is appended
+// in time order, so this is a binary search rather than a scan.
+int findTransactionIndex(const time_t *times, int count, time_t timestamp, int after)
+{
+    int low = 0;
+    int high = count;
+    while (low < high)
+    {
+        int mid = low + (high - low) / 2;
+        time_t current = times[mid];
+        if (current < timestamp || (after && current == timestamp))
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+    return low;
+}
+
 // Function to get account statement
-Response getStatement(const Request *request)
+// Only the page being sent is decoded, into this thread's statement_buffer;
+// payload points at it so the transactions are gathered from it on send.
+Response getStatement(const Request *request, ResponsePayload *payload)
 {
     Response response = {0};
 
-    Account *account = findAccount(request->accountNumber);
+    Account *account = lockAccount(request->accountNumber, 0);
     if (!account)
     {
         response.success = 0;
@@ -317,53 +1095,1924 @@ Response getStatement(const Request *request)
     {
         response.success = 0;
         strcpy(response.message, "Error: Invalid PIN.");
+        unlockAccount(account);
+        return response;
+    }
+
+    int count = decodeHistoryTimes(account, statement_times);
+
+    // The offset comes from the client; anything past the history is not a
+    // cursor this server handed out
+    if (request->pageSize > 0 && request->cursor.timestamp > 0 &&
+        (request->cursor.offset < 0 || request->cursor.offset > count))
+    {
+        response.success = 0;
+        strcpy(response.message, "Error: Invalid statement cursor.");
+        unlockAccount(account);
         return response;
     }
 
     response.success = 1;
     response.balance = account->balance;
 
-    int start = account->transactionCount > MAX_TRANSACTIONS_IN_STATEMENT ? account->transactionCount - MAX_TRANSACTIONS_IN_STATEMENT : 0;
+    int start;
+    int end = count;
 
-    response.transactionCount = account->transactionCount - start;
-
-    for (int i = 0; i < response.transactionCount; i++)
+    if (request->pageSize <= 0)
+    {
+        start = count > MAX_TRANSACTIONS_IN_STATEMENT ? count - MAX_TRANSACTIONS_IN_STATEMENT : 0;
+    }
+    else
     {
-        response.transactions[i] = account->transactions[start + i];
+        int pageSize = request->pageSize < MAX_STATEMENT_PAGE ? request->pageSize : MAX_STATEMENT_PAGE;
+        int limit = request->toTime > 0 ? findTransactionIndex(statement_times, count, request->toTime, 1) : count;
+
+        start = findTransactionIndex(statement_times, count, request->fromTime, 0);
+        if (request->cursor.timestamp > 0)
+        {
+            int resume = findTransactionIndex(statement_times, count, request->cursor.timestamp, 0) + request->cursor.offset;
+            if (resume > start)
+            {
+                start = resume;
+            }
+        }
+        if (start > limit)
+        {
+            start = limit;
+        }
+        end = start + pageSize < limit ? start + pageSize : limit;
+
+        response.hasMore = end < limit;
+        response.nextCursor = request->cursor;
+        if (end > start)
+        {
+            time_t last = statement_times[end - 1];
+            response.nextCursor.timestamp = last;
+            response.nextCursor.offset = end - findTransactionIndex(statement_times, count, last, 0);
+        }
     }
 
+    response.transactionCount = end - start;
+    decodeHistoryRange(account, start, end, statement_buffer);
+    unlockAccount(account);
+
+    payload->iov[0].iov_base = statement_buffer;
+    payload->iov[0].iov_len = response.transactionCount * sizeof(Transaction);
+    payload->iovcnt = 1;
+
     strcpy(response.message, "Statement retrieved successfully.");
 
     return response;
 }
 
-// Process client request and generate response
-Response processRequest(const Request *request)
-{
-    switch (request->type)
-    {
-    case OPEN_ACCOUNT:
-        return openAccount(request);
-    case CLOSE_ACCOUNT:
-        return closeAccount(request);
-    case WITHDRAW:
-        return withdraw(request);
-    case DEPOSIT_FUNDS:
-        return deposit(request);
-    case CHECK_BALANCE:
-        return checkBalance(request);
-    case GET_STATEMENT:
-        return getStatement(request);
-    default:
-        Response response = {0};
+// Function to list every open account of the customer who holds the
+// account in the request, found through the customer index. The summaries
+// go into this thread's listing buffer and payload points at it. Accounts
+// on other shards are not listed.
+Response listAccounts(const Request *request, ResponsePayload *payload)
+{
+    Response response = {0};
+
+    Account *account = lockAccount(request->accountNumber, 0);
+    if (!account)
+    {
         response.success = 0;
-        strcpy(response.message, "Error: Invalid request type.");
+        strcpy(response.message, "Error: Account not found.");
         return response;
     }
-}
 
-// Signal handler for child processes
-void handle_sigchld(int sig) {
+    if (!validatePIN(account, request->pin))
+    {
+        response.success = 0;
+        strcpy(response.message, "Error: Invalid PIN.");
+        unlockAccount(account);
+        return response;
+    }
+
+    char nationalID[ID_LENGTH + 1];
+    strcpy(nationalID, account->nationalID);
+    response.balance = account->balance;
+    int slots[MAX_LISTED_ACCOUNTS];
+    int total = 1;
+    slots[0] = account - store->accounts;
+    unlockAccount(account);
+
+    // Accounts opened without a national ID have no customer to group by
+    pthread_rwlock_rdlock(&store->tableLock);
+    if (nationalID[0] != '\0')
+    {
+        pthread_mutex_lock(&store->customerLock);
+        total = customerIndexFind(&store->customers, store->accounts, nationalID, slots, MAX_LISTED_ACCOUNTS);
+        pthread_mutex_unlock(&store->customerLock);
+    }
+
+    int count = 0;
+    for (int i = 0; i < total && i < MAX_LISTED_ACCOUNTS; i++)
+    {
+        const Account *listed = &store->accounts[slots[i]];
+        pthread_rwlock_rdlock(&store->accountLocks[slots[i]]);
+        if (listed->isActive)
+        {
+            AccountSummary *summary = &listing_buffer[count++];
+            strcpy(summary->accountNumber, listed->accountNumber);
+            summary->type = listed->type;
+            summary->balance = listed->balance;
+        }
+        pthread_rwlock_unlock(&store->accountLocks[slots[i]]);
+    }
+    pthread_rwlock_unlock(&store->tableLock);
+
+    response.success = 1;
+    response.accountCount = count;
+    response.hasMore = total > MAX_LISTED_ACCOUNTS;
+    payload->iov[0].iov_base = listing_buffer;
+    payload->iov[0].iov_len = count * sizeof(AccountSummary);
+    payload->iovcnt = 1;
+    sprintf(response.message, "%d accounts found.", count);
+
+    return response;
+}
+
+// Function to answer what an account held at a past moment, from the
+// newest checkpoint before it and the log records after that
+Response balanceAt(const Request *request)
+{
+    Response response = {0};
+
+    Account *account = lockAccount(request->accountNumber, 0);
+    if (!account)
+    {
+        response.success = 0;
+        strcpy(response.message, "Error: Account not found.");
+        return response;
+    }
+
+    if (!validatePIN(account, request->pin))
+    {
+        response.success = 0;
+        strcpy(response.message, "Error: Invalid PIN.");
+        unlockAccount(account);
+        return response;
+    }
+    unlockAccount(account);
+
+    pthread_mutex_lock(&store->logLock);
+    unsigned long first = store->firstSequence;
+    pthread_mutex_unlock(&store->logLock);
+
+    AccountState state;
+    struct tm local;
+    char when[32];
+    localtime_r(&request->toTime, &local);
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &local);
+    if (accountStateAt(DATABASE_FILE, log_fd, first, request->accountNumber, request->toTime, &state) < 0)
+    {
+        response.success = 0;
+        strcpy(response.message, "Error: No history is kept from that far back.");
+        return response;
+    }
+    if (!state.existed)
+    {
+        response.success = 0;
+        sprintf(response.message, "Error: The account did not exist at %s.", when);
+        return response;
+    }
+
+    response.success = 1;
+    response.balance = state.balance;
+    formatAmount(stpcpy(stpcpy(stpcpy(response.message, "Balance at "), when), state.isActive ? ": " : " (closed): "),
+                 state.balance);
+    return response;
+}
+
+// Function to find two accounts and lock both exclusively, in table order
+// so that concurrent transfers cannot deadlock. Either may come back NULL,
+// in which case neither is locked.
+void lockAccountPair(const char *sourceNumber, const char *targetNumber, Account **source, Account **target)
+{
+    pthread_rwlock_rdlock(&store->tableLock);
+
+    *source = findAccount(sourceNumber);
+    *target = findAccount(targetNumber);
+    if (*source != NULL && *target != NULL)
+    {
+        Account *first = *source < *target ? *source : *target;
+        Account *second = *source < *target ? *target : *source;
+        pthread_rwlock_wrlock(&store->accountLocks[first - store->accounts]);
+        pthread_rwlock_wrlock(&store->accountLocks[second - store->accounts]);
+
+        // Either may have been closed while we waited for the locks
+        if (!first->isActive || !second->isActive)
+        {
+            pthread_rwlock_unlock(&store->accountLocks[second - store->accounts]);
+            pthread_rwlock_unlock(&store->accountLocks[first - store->accounts]);
+            *source = (*source)->isActive ? *source : NULL;
+            *target = (*target)->isActive ? *target : NULL;
+        }
+        else
+        {
+            holdAccount(first);
+            holdAccount(second);
+        }
+    }
+
+    pthread_rwlock_unlock(&store->tableLock);
+}
+
+// Function to find a transfer entry by id
+// Callers hold transferLock.
+PendingTransfer *findTransfer(unsigned long id)
+{
+    for (int i = 0; i < MAX_PENDING_TRANSFERS; i++)
+    {
+        if (store->transfers[i].state != TRANSFER_FREE && store->transfers[i].id == id)
+        {
+            return &store->transfers[i];
+        }
+    }
+    return NULL;
+}
+
+// Function to claim an entry for a new transfer, reusing the longest
+// finished one when the table is full. Returns NULL if every entry is still
+// in flight. Callers hold transferLock.
+PendingTransfer *claimTransfer(unsigned long id, int coordinator, const char *account, const char *peerAccount, double amount)
+{
+    PendingTransfer *entry = NULL;
+    for (int i = 0; i < MAX_PENDING_TRANSFERS; i++)
+    {
+        PendingTransfer *candidate = &store->transfers[i];
+        if (candidate->state == TRANSFER_FREE)
+        {
+            entry = candidate;
+            break;
+        }
+        if ((candidate->state == TRANSFER_COMMITTED || candidate->state == TRANSFER_ABORTED) &&
+            (entry == NULL || candidate->updated < entry->updated))
+        {
+            entry = candidate;
+        }
+    }
+
+    if (entry != NULL)
+    {
+        entry->id = id;
+        entry->state = TRANSFER_PREPARED;
+        entry->coordinator = coordinator;
+        strcpy(entry->account, account);
+        strcpy(entry->peerAccount, peerAccount);
+        entry->amount = amount;
+        entry->updated = time(NULL);
+    }
+    return entry;
+}
+
+void setTransferState(unsigned long id, TransferState state)
+{
+    pthread_mutex_lock(&store->transferLock);
+    PendingTransfer *entry = findTransfer(id);
+    if (entry != NULL)
+    {
+        entry->state = state;
+        entry->updated = time(NULL);
+    }
+    pthread_mutex_unlock(&store->transferLock);
+}
+
+// Function to move the funds of a cross-shard transfer, with the account
+// locked: a reservation or its reversal on the source shard, or the credit
+// on the target. A restart gives back every reservation the log holds no
+// decision for, so the database file gets the change before the step is
+// logged, even in a batch of standing orders. The history entry keeps the
+// transfer ID, so a credit saved but not logged is not made again.
+void moveTransferFunds(Account *account, RequestType step, unsigned long id, const char *peerAccount, double amount)
+{
+    char description[100];
+    sprintf(description,
+            step == PREPARE_TRANSFER  ? "Transfer to %s"
+            : step == COMMIT_TRANSFER ? "Transfer from %s"
+                                      : "Reversed transfer to %s",
+            peerAccount);
+    account->balance += amount;
+    appendRequestHistory(account, time(NULL), amount < 0 ? WITHDRAWAL : DEPOSIT, amount < 0 ? -amount : amount,
+                         description, id);
+    SIMULATE_CRASH_POINT();
+    saveAccountsToFile();
+    SIMULATE_CRASH_POINT();
+    logTransferStep(step, account, id, peerAccount, amount);
+}
+
+// Function to record that the target shard acknowledged the outcome of a
+// transfer, so it is not sent again after a restart
+void transferDelivered(unsigned long id, const char *accountNumber, const char *peerAccount, TransferState state)
+{
+    Account *account = lockAccount(accountNumber, 0);
+    setTransferState(id, state);
+    if (account != NULL)
+    {
+        logTransferStep(TRANSFER_DELIVERED, account, id, peerAccount, 0);
+        unlockAccount(account);
+    }
+}
+
+// Function to send one step of a cross-shard transfer to another shard and
+// wait for its answer. An unreachable shard is reported as a failure.
+Response sendToShard(int shard, RequestType type, unsigned long id, const char *account, const char *peerAccount, double amount)
+{
+    Request request = {0};
+    request.type = type;
+    request.transferId = id;
+    strcpy(request.accountNumber, account);
+    strcpy(request.targetAccount, peerAccount);
+    strcpy(request.name, cluster_secret);
+    request.amount = amount;
+
+    Response response = {0};
+    int sock = connectTo(shards[shard].host, shards[shard].port + SHARD_PEER_PORT_OFFSET);
+
+    // A stalled shard must not hold up our client forever
+    struct timeval timeout = {SEND_TIMEOUT / 1000, 0};
+    if (sock >= 0)
+    {
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    }
+    if (sock < 0 || sendAll(sock, &request, sizeof(request)) < 0 ||
+        recvAll(sock, &response, sizeof(response)) < 0)
+    {
+        response.success = 0;
+        strcpy(response.message, "Error: The target account's shard is unavailable. Please try again later.");
+    }
+    if (sock >= 0)
+    {
+        close(sock);
+    }
+    return response;
+}
+
+// Function to move funds to an account on another shard with a two-phase
+// commit. The funds are reserved here first, so the source cannot be
+// overdrawn while the target shard prepares. Each step is logged, so
+// replicas see the reservation and a restart can finish or undo it.
+Response remoteTransfer(const Request *request, int targetShard)
+{
+    Response response = {0};
+
+    if (cluster_secret == NULL)
+    {
+        response.success = 0;
+        strcpy(response.message, "Error: Transfers to other shards are not enabled on this server.");
+        return response;
+    }
+
+    int pinValid;
+    Account *source = lockAccountWithPIN(request->accountNumber, request->pin, &pinValid);
+    if (!source)
+    {
+        response.success = 0;
+        strcpy(response.message, "Error: Account not found.");
+        return response;
+    }
+
+    if (!pinValid)
+    {
+        response.success = 0;
+        strcpy(response.message, "Error: Invalid PIN.");
+        unlockAccount(source);
+        return response;
+    }
+
+    if (source->balance - request->amount < MIN_BALANCE)
+    {
+        response.success = 0;
+        sprintf(response.message, "Error: Insufficient funds. Minimum balance of %.2f must be maintained.", (double)MIN_BALANCE);
+        unlockAccount(source);
+        return response;
+    }
+
+    pthread_mutex_lock(&store->transferLock);
+    unsigned long id = ((unsigned long)shard_index << TRANSFER_ID_BITS) | ++store->nextTransferId;
+    PendingTransfer *entry = claimTransfer(id, 1, source->accountNumber, request->targetAccount, request->amount);
+    pthread_mutex_unlock(&store->transferLock);
+    if (entry == NULL)
+    {
+        response.success = 0;
+        strcpy(response.message, "Error: Too many transfers in progress. Please try again shortly.");
+        unlockAccount(source);
+        return response;
+    }
+
+    // Reserve the funds; the account cannot be closed while the entry is open
+    moveTransferFunds(source, PREPARE_TRANSFER, id, request->targetAccount, -request->amount);
+    unlockAccount(source);
+
+    Response reply = sendToShard(targetShard, PREPARE_TRANSFER, id, request->targetAccount, request->accountNumber, request->amount);
+
+    source = lockAccount(request->accountNumber, 1);
+    if (source == NULL)
+    {
+        // The open entry keeps the account from closing, so this should not
+        // happen; the reservation stays logged for a restart to give back
+        fprintf(stderr, "Transfer %lx: account %s is gone\n", id, request->accountNumber);
+        setTransferState(id, TRANSFER_ABORTING);
+        response.success = 0;
+        strcpy(response.message, "Error: The transfer could not be completed.");
+        return response;
+    }
+
+    if (!reply.success)
+    {
+        // The target may have prepared even if its answer was lost, so the
+        // abort is resent until the target shard acknowledges it
+        moveTransferFunds(source, ABORT_TRANSFER, id, request->targetAccount, request->amount);
+        setTransferState(id, TRANSFER_ABORTING);
+        unlockAccount(source);
+
+        Response aborted = sendToShard(targetShard, ABORT_TRANSFER, id, request->targetAccount, request->accountNumber,
+                                       request->amount);
+        if (aborted.success)
+        {
+            transferDelivered(id, request->accountNumber, request->targetAccount, TRANSFER_ABORTED);
+        }
+        return reply;
+    }
+
+    // The decision is made once it is logged; from here on the commit is
+    // resent until the target shard acknowledges it
+    logTransferStep(COMMIT_TRANSFER, source, id, request->targetAccount, 0);
+    setTransferState(id, TRANSFER_COMMITTING);
+
+    response.success = 1;
+    response.balance = source->balance;
+    formatAmount(stpcpy(response.message, "Transfer successful. New balance: "), source->balance);
+    unlockAccount(source);
+
+    reply = sendToShard(targetShard, COMMIT_TRANSFER, id, request->targetAccount, request->accountNumber, request->amount);
+    if (reply.success)
+    {
+        transferDelivered(id, request->accountNumber, request->targetAccount, TRANSFER_COMMITTED);
+    }
+
+    return response;
+}
+
+// Function to handle transfers between accounts
+Response transfer(const Request *request)
+{
+    Response response = {0};
+
+    if (request->amount < MIN_TRANSACTION)
+    {
+        response.success = 0;
+        sprintf(response.message, "Error: Minimum transfer amount is %.2f.", (double)MIN_TRANSACTION);
+        return response;
+    }
+
+    if (strcmp(request->accountNumber, request->targetAccount) == 0)
+    {
+        response.success = 0;
+        strcpy(response.message, "Error: Cannot transfer to the same account.");
+        return response;
+    }
+
+    int targetShard = shardForAccount(request->targetAccount, shard_count);
+    if (targetShard != shard_index)
+    {
+        return remoteTransfer(request, targetShard);
+    }
+
+    // Check the PIN first, so the slow hash runs with neither account locked
+    Account credentials;
+    int pinValid = validatePINUnlocked(request->accountNumber, request->pin, &credentials);
+
+    Account *source;
+    Account *target;
+    lockAccountPair(request->accountNumber, request->targetAccount, &source, &target);
+    if (!source || !target)
+    {
+        response.success = 0;
+        strcpy(response.message, source ? "Error: Target account not found." : "Error: Account not found.");
+        return response;
+    }
+
+    if (pinValid <= 0 || !pinUnchanged(source, &credentials))
+    {
+        response.success = 0;
+        strcpy(response.message, "Error: Invalid PIN.");
+        unlockAccount(target);
+        unlockAccount(source);
+        return response;
+    }
+
+    if (source->balance - request->amount < MIN_BALANCE)
+    {
+        response.success = 0;
+        sprintf(response.message, "Error: Insufficient funds. Minimum balance of %.2f must be maintained.", (double)MIN_BALANCE);
+        unlockAccount(target);
+        unlockAccount(source);
+        return response;
+    }
+
+    // Move the money before the first save, so no file ever has it debited
+    // and not yet credited
+    char description[100];
+    source->balance -= request->amount;
+    target->balance += request->amount;
+    sprintf(description, "Transfer to %s", target->accountNumber);
+    addTransaction(source, WITHDRAWAL, request->amount, description);
+    logOperation(TRANSFER, source, -request->amount, 0);
+
+    sprintf(description, "Transfer from %s", source->accountNumber);
+    addTransaction(target, DEPOSIT, request->amount, description);
+    logOperation(TRANSFER, target, request->amount, 0);
+
+    response.success = 1;
+    response.balance = source->balance;
+    formatAmount(stpcpy(response.message, "Transfer successful. New balance: "), source->balance);
+
+    unlockAccount(target);
+    unlockAccount(source);
+    return response;
+}
+
+// Function to prepare the receiving side of a cross-shard transfer. Nothing
+// is credited yet; the entry only promises that the commit will succeed.
+Response prepareTransfer(const Request *request)
+{
+    Response response = {0};
+
+    Account *account = lockAccount(request->accountNumber, 0);
+    if (!account)
+    {
+        response.success = 0;
+        strcpy(response.message, "Error: Target account not found.");
+        return response;
+    }
+
+    // The prepare is logged before it is acknowledged, so a restart still
+    // knows the transfer when the commit or abort comes
+    pthread_mutex_lock(&store->transferLock);
+    PendingTransfer *entry = findTransfer(request->transferId);
+    if (entry == NULL)
+    {
+        entry = claimTransfer(request->transferId, 0, account->accountNumber, request->targetAccount, request->amount);
+        if (entry != NULL)
+        {
+            logTransferStep(PREPARE_TRANSFER, account, request->transferId, request->targetAccount, 0);
+        }
+    }
+    response.success = entry != NULL && entry->state == TRANSFER_PREPARED;
+    pthread_mutex_unlock(&store->transferLock);
+
+    strcpy(response.message, response.success ? "Transfer prepared." : "Error: Transfer cannot be prepared.");
+    unlockAccount(account);
+    return response;
+}
+
+// Function to apply the receiving side of a committed transfer. Repeated
+// commits of the same transfer succeed without crediting twice.
+Response commitTransfer(const Request *request)
+{
+    Response response = {0};
+
+    Account *account = lockAccount(request->accountNumber, 1);
+    if (account == NULL)
+    {
+        response.success = 0;
+        strcpy(response.message, "Error: Unknown transfer.");
+        return response;
+    }
+
+    // The exclusive account lock keeps a resent commit waiting until this
+    // one is done; COMMITTING keeps an abort from overtaking it
+    pthread_mutex_lock(&store->transferLock);
+    PendingTransfer *entry = findTransfer(request->transferId);
+    TransferState state = TRANSFER_FREE;
+    char peerAccount[ACC_NUM_LENGTH + 1] = "";
+    double amount = 0;
+    if (entry != NULL && strcmp(entry->account, account->accountNumber) == 0)
+    {
+        state = entry->state;
+        strcpy(peerAccount, entry->peerAccount);
+        // A prepare recovered from the log leaves the amount to the commit
+        amount = entry->amount != 0 ? entry->amount : request->amount;
+        if (state == TRANSFER_PREPARED)
+        {
+            entry->state = TRANSFER_COMMITTING;
+        }
+    }
+    pthread_mutex_unlock(&store->transferLock);
+
+    if (state == TRANSFER_PREPARED)
+    {
+        moveTransferFunds(account, COMMIT_TRANSFER, request->transferId, peerAccount, amount);
+        setTransferState(request->transferId, TRANSFER_COMMITTED);
+    }
+    unlockAccount(account);
+
+    response.success = state == TRANSFER_PREPARED || state == TRANSFER_COMMITTED;
+    strcpy(response.message, state == TRANSFER_PREPARED    ? "Transfer committed."
+                             : state == TRANSFER_COMMITTED ? "Transfer already committed."
+                                                           : "Error: Unknown transfer.");
+    return response;
+}
+
+// Function to drop the receiving side of an aborted transfer. An abort that
+// overtakes its prepare is remembered so the late prepare is refused.
+Response abortTransfer(const Request *request)
+{
+    Response response = {0};
+
+    // Logged like the prepare, so a late prepare is still refused and the
+    // entry does not come back PREPARED after a restart
+    Account *account = lockAccount(request->accountNumber, 0);
+    pthread_mutex_lock(&store->transferLock);
+    PendingTransfer *entry = findTransfer(request->transferId);
+    if (entry == NULL)
+    {
+        entry = claimTransfer(request->transferId, 0, request->accountNumber, request->targetAccount, request->amount);
+    }
+    if (entry != NULL && entry->state == TRANSFER_PREPARED)
+    {
+        entry->state = TRANSFER_ABORTED;
+        entry->updated = time(NULL);
+        if (account != NULL)
+        {
+            logTransferStep(ABORT_TRANSFER, account, request->transferId, request->targetAccount, 0);
+        }
+    }
+    response.success = entry != NULL && entry->state == TRANSFER_ABORTED;
+    pthread_mutex_unlock(&store->transferLock);
+    if (account != NULL)
+    {
+        unlockAccount(account);
+    }
+
+    strcpy(response.message, response.success ? "Transfer aborted." : "Error: Transfer already committed.");
+    return response;
+}
+
+// Function to set up a standing order. The PIN is checked now; each run
+// then goes through the usual deposit, withdrawal or transfer.
+Response scheduleOrder(const Request *request)
+{
+    Response response = {0};
+
+    if (request->orderType != DEPOSIT_FUNDS && request->orderType != WITHDRAW && request->orderType != TRANSFER)
+    {
+        response.success = 0;
+        strcpy(response.message, "Error: A standing order must be a deposit, withdrawal or transfer.");
+        return response;
+    }
+
+    if (request->amount < MIN_TRANSACTION)
+    {
+        response.success = 0;
+        sprintf(response.message, "Error: Minimum standing order amount is %.2f.", (double)MIN_TRANSACTION);
+        return response;
+    }
+
+    if (request->orderType == WITHDRAW && (long)request->amount % MIN_TRANSACTION != 0)
+    {
+        response.success = 0;
+        sprintf(response.message, "Error: Withdrawal amount must be in units of %.2f.", (double)MIN_TRANSACTION);
+        return response;
+    }
+
+    if (request->orderType == TRANSFER && strcmp(request->accountNumber, request->targetAccount) == 0)
+    {
+        response.success = 0;
+        strcpy(response.message, "Error: Cannot transfer to the same account.");
+        return response;
+    }
+
+    if (request->interval < 0)
+    {
+        response.success = 0;
+        strcpy(response.message, "Error: Invalid standing order interval.");
+        return response;
+    }
+
+    Account *account = lockAccount(request->accountNumber, 0);
+    if (!account)
+    {
+        response.success = 0;
+        strcpy(response.message, "Error: Account not found.");
+        return response;
+    }
+
+    if (!validatePIN(account, request->pin))
+    {
+        response.success = 0;
+        strcpy(response.message, "Error: Invalid PIN.");
+        unlockAccount(account);
+        return response;
+    }
+
+    pthread_mutex_lock(&schedule->lock);
+    int index = claimOrder(schedule);
+    if (index >= 0)
+    {
+        StandingOrder *order = &schedule->orders[index];
+        order->type = request->orderType;
+        strcpy(order->accountNumber, account->accountNumber);
+        strcpy(order->targetAccount, request->orderType == TRANSFER ? request->targetAccount : "");
+        order->amount = request->amount;
+        order->nextRun = request->runAt > 0 ? request->runAt : time(NULL);
+        order->interval = request->interval;
+        wheelInsert(schedule, index);
+
+        response.success = 1;
+        struct tm run;
+        char when[32];
+        localtime_r(&order->nextRun, &run);
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", &run);
+        sprintf(response.message, "Standing order %lu set up. First run: %s", order->id, when);
+    }
+    pthread_mutex_unlock(&schedule->lock);
+    unlockAccount(account);
+
+    if (index < 0)
+    {
+        response.success = 0;
+        strcpy(response.message, "Error: Too many standing orders. Please try again later.");
+        return response;
+    }
+    if (fdatasync(schedule_fd) < 0)
+    {
+        perror("Error saving standing orders");
+    }
+    return response;
+}
+
+// Function to take a standing order off the wheel for good. With an
+// account number, only that account's order is cancelled. Returns 0 if
+// there is no such order.
+int cancelStandingOrder(unsigned long id, const char *accountNumber)
+{
+    int index = id % MAX_STANDING_ORDERS;
+    pthread_mutex_lock(&schedule->lock);
+    StandingOrder *order = &schedule->orders[index];
+    int found = index < schedule->used && order->state == ORDER_SCHEDULED && order->id == id &&
+                (accountNumber == NULL || strcmp(order->accountNumber, accountNumber) == 0);
+    if (found)
+    {
+        wheelRemove(schedule, index);
+        releaseOrder(schedule, index);
+    }
+    pthread_mutex_unlock(&schedule->lock);
+    return found;
+}
+
+// Function to cancel a standing order
+Response cancelOrder(const Request *request)
+{
+    Response response = {0};
+
+    Account *account = lockAccount(request->accountNumber, 0);
+    if (!account)
+    {
+        response.success = 0;
+        strcpy(response.message, "Error: Account not found.");
+        return response;
+    }
+
+    if (!validatePIN(account, request->pin))
+    {
+        response.success = 0;
+        strcpy(response.message, "Error: Invalid PIN.");
+        unlockAccount(account);
+        return response;
+    }
+
+    response.success = cancelStandingOrder(request->orderId, account->accountNumber);
+    unlockAccount(account);
+
+    if (!response.success)
+    {
+        strcpy(response.message, "Error: Standing order not found.");
+        return response;
+    }
+    if (fdatasync(schedule_fd) < 0)
+    {
+        perror("Error saving standing orders");
+    }
+    sprintf(response.message, "Standing order %lu cancelled.", request->orderId);
+    return response;
+}
+
+// Function to post a month's interest (savings) or fee (checking) to an
+// account the caller holds locked, unless that month is already posted.
+// Fees never take the balance below MIN_BALANCE. Nothing is logged; the
+// caller logs the posting once it is saved. Returns the amount posted.
+double accrueAccount(Account *account, int period, time_t now)
+{
+    if (!account->isActive || account->accruedPeriod >= period)
+    {
+        return 0;
+    }
+
+    // Amounts are whole cents, rounded in the bank's favour
+    double amount;
+    if (account->type == SAVINGS)
+    {
+        amount = (double)(long)(account->balance * SAVINGS_INTEREST_RATE / 12 * 100) / 100;
+    }
+    else
+    {
+        double spare = (double)(long)((account->balance - MIN_BALANCE) * 100) / 100;
+        amount = spare <= 0 ? 0 : -(spare < CHECKING_MONTHLY_FEE ? spare : CHECKING_MONTHLY_FEE);
+    }
+
+    account->accruedPeriod = period;
+    if (amount != 0)
+    {
+        account->balance += amount;
+        appendHistory(account, now, amount > 0 ? DEPOSIT : WITHDRAWAL, amount > 0 ? amount : -amount,
+                      amount > 0 ? "Interest" : "Monthly fee");
+    }
+    return amount;
+}
+
+// Process a transfer step from another shard. These arrive on the peer
+// port only and must carry the cluster secret.
+Response processShardRequest(const Request *request)
+{
+    if (cluster_secret != NULL && strncmp(request->name, cluster_secret, sizeof(request->name)) == 0)
+    {
+        switch (request->type)
+        {
+        case PREPARE_TRANSFER:
+            return prepareTransfer(request);
+        case COMMIT_TRANSFER:
+            return commitTransfer(request);
+        case ABORT_TRANSFER:
+            return abortTransfer(request);
+        default:
+            break;
+        }
+    }
+
+    Response response = {0};
+    response.success = 0;
+    strcpy(response.message, "Error: Invalid request type.");
+    return response;
+}
+
+// How each client request type is served. Request types index the table
+// directly, so dispatch is one bounds check and one indirect call.
+typedef struct
+{
+    Response (*handle)(const Request *request);
+    Response (*handleWithPayload)(const Request *request, ResponsePayload *payload);
+    int readOnly; // Served by read-only replicas too
+    int anyShard; // Not tied to an account's shard
+} RequestRoute;
+
+static const RequestRoute REQUEST_ROUTES[INVALID_REQUEST] = {
+    [OPEN_ACCOUNT] = {openAccount, NULL, 0, 1},
+    [CLOSE_ACCOUNT] = {closeAccount, NULL, 0, 0},
+    [WITHDRAW] = {withdraw, NULL, 0, 0},
+    [DEPOSIT_FUNDS] = {deposit, NULL, 0, 0},
+    [CHECK_BALANCE] = {checkBalance, NULL, 1, 0},
+    [GET_STATEMENT] = {NULL, getStatement, 1, 0},
+    [TRANSFER] = {transfer, NULL, 0, 0},
+    [SCHEDULE_ORDER] = {scheduleOrder, NULL, 0, 0},
+    [CANCEL_ORDER] = {cancelOrder, NULL, 0, 0},
+    [LIST_ACCOUNTS] = {NULL, listAccounts, 1, 0},
+    [BALANCE_AT] = {balanceAt, NULL, 1, 0},
+};
+
+// Process client request and generate response
+// Any records to send after the response are described by payload.
+Response processRequest(const Request *request, ResponsePayload *payload)
+{
+    payload->iovcnt = 0;
+
+    Response response = {0};
+    const RequestRoute *route = (unsigned)request->type < INVALID_REQUEST ? &REQUEST_ROUTES[request->type] : NULL;
+    if (route == NULL || (route->handle == NULL && route->handleWithPayload == NULL))
+    {
+        response.success = 0;
+        strcpy(response.message, "Error: Invalid request type.");
+        return response;
+    }
+
+    // Replicas only serve reads; changes arrive from the primary
+    if (store->readOnly && !route->readOnly)
+    {
+        response.success = 0;
+        strcpy(response.message, "Error: This server is a read-only replica.");
+        return response;
+    }
+
+    // Account requests must reach the shard that owns the account
+    if (!route->anyShard && shard_count > 1 && shardForAccount(request->accountNumber, shard_count) != shard_index)
+    {
+        response.success = 0;
+        strcpy(response.message, "Error: Account belongs to another shard.");
+        return response;
+    }
+
+    return route->handle != NULL ? route->handle(request) : route->handleWithPayload(request, payload);
+}
+
+// Function to put a logged deposit or withdrawal's request ID, if it had
+// one, into the dedup table
+void rememberLoggedRequest(const OperationRecord *record)
+{
+    if ((record->type == WITHDRAW || record->type == DEPOSIT_FUNDS) && record->name[0] != '\0')
+    {
+        dedupRemember(dedup_table, record->accountNumber, strtoul(record->name, NULL, 16), record->type,
+                      record->amount, record->balance, record->timestamp);
+    }
+}
+
+// Function to rebuild the dedup table from the newest records in the log,
+// so a retry of a request applied before a restart is still recognized.
+// A crash between saving a deposit or withdrawal and logging it leaves its
+// request ID only in the account's history, so that is searched too.
+// Returns the number of request IDs remembered.
+int rebuildDedupTable()
+{
+    OperationRecord batch[REPLICATION_BATCH];
+    unsigned long first = store->firstSequence;
+    unsigned long next = store->lastSequence >= first + DEDUP_CAPACITY ? store->lastSequence - DEDUP_CAPACITY + 1 : first;
+    time_t oldest = time(NULL) - DEDUP_TTL;
+    int remembered = 0;
+
+    // History is only searched as far back as the log tail reaches
+    unsigned long start = next;
+    time_t since = oldest;
+    int count;
+    while ((count = readOperationRecords(log_fd, first, next, batch, REPLICATION_BATCH)) > 0)
+    {
+        if (next == start && start > first && batch[0].timestamp > since)
+        {
+            since = batch[0].timestamp;
+        }
+        for (int i = 0; i < count; i++)
+        {
+            if (batch[i].timestamp > oldest && batch[i].name[0] != '\0' &&
+                (batch[i].type == WITHDRAW || batch[i].type == DEPOSIT_FUNDS))
+            {
+                rememberLoggedRequest(&batch[i]);
+                remembered++;
+            }
+        }
+        next += count;
+    }
+
+    Transaction transactions[MAX_TRANSACTIONS];
+    unsigned long requestIds[MAX_TRANSACTIONS];
+    time_t now = time(NULL);
+    for (int i = 0; i < store->accountCount; i++)
+    {
+        const Account *account = &store->accounts[i];
+        if (!account->isActive)
+        {
+            continue;
+        }
+
+        // Walk back from the current balance to the one after each entry
+        double balance = account->balance;
+        for (int j = decodeHistoryRequests(account, transactions, requestIds) - 1; j >= 0; j--)
+        {
+            DedupEntry found;
+            // Transfer steps keep their transfer ID there too
+            int request = strcmp(transactions[j].description, "Withdrawal") == 0 ||
+                          strcmp(transactions[j].description, "Deposit") == 0;
+            if (request && requestIds[j] != 0 && transactions[j].timestamp > since &&
+                !dedupLookup(dedup_table, account->accountNumber, requestIds[j], now, &found))
+            {
+                dedupRemember(dedup_table, account->accountNumber, requestIds[j],
+                              transactions[j].type == WITHDRAWAL ? WITHDRAW : DEPOSIT_FUNDS, transactions[j].amount,
+                              balance, transactions[j].timestamp);
+                remembered++;
+            }
+            balance += transactions[j].type == WITHDRAWAL ? transactions[j].amount : -transactions[j].amount;
+        }
+    }
+    return remembered;
+}
+
+// Function to apply a record received from the primary. Records are
+// applied strictly in sequence; anything else is a duplicate and skipped.
+void applyOperation(const OperationRecord *record)
+{
+    pthread_mutex_lock(&store->applyLock);
+    if (record->sequence != store->lastSequence + 1)
+    {
+        pthread_mutex_unlock(&store->applyLock);
+        return;
+    }
+
+    if (record->type == OPEN_ACCOUNT)
+    {
+        Account newAccount;
+        accountFromOpenRecord(&newAccount, record);
+
+        pthread_rwlock_wrlock(&store->tableLock);
+        addAccount(&newAccount);
+        pthread_rwlock_unlock(&store->tableLock);
+        saveAccountsToFile();
+    }
+    else
+    {
+        Account *account = lockAccount(record->accountNumber, 1);
+        if (account != NULL)
+        {
+            if (record->type == CLOSE_ACCOUNT)
+            {
+                account->isActive = 0;
+                unindexCustomerAccount(account);
+                __atomic_fetch_add(&store->closedCount, 1, __ATOMIC_RELAXED);
+                saveAccountsToFile();
+            }
+            else
+            {
+                // Interest and fees keep their month, so a promoted replica
+                // does not post them again
+                applyRecordToAccount(account, record);
+                rememberLoggedRequest(record);
+            }
+            unlockAccount(account);
+        }
+        else
+        {
+            fprintf(stderr, "Replication: record %lu names unknown account %s\n", record->sequence, record->accountNumber);
+        }
+    }
+
+    // Keep the same log, so this replica can be promoted or followed
+    pthread_mutex_lock(&store->logLock);
+    if (write(log_fd, record, sizeof(*record)) != sizeof(*record))
+    {
+        perror("Error appending to operation log");
+    }
+    if (store->firstSequence == 0)
+    {
+        store->firstSequence = record->sequence;
+    }
+    store->lastSequence = record->sequence;
+    pthread_cond_broadcast(&store->logCond);
+    pthread_mutex_unlock(&store->logLock);
+
+    pthread_mutex_unlock(&store->applyLock);
+}
+
+// Function to copy every account together with the log sequence it
+// reflects. Returns the copy, which the caller frees.
+Account *takeSnapshot(int *count, unsigned long *sequence)
+{
+    pthread_mutex_lock(&store->applyLock);
+    pthread_rwlock_wrlock(&store->tableLock);
+    for (int i = 0; i < store->accountCount; i++)
+    {
+        pthread_rwlock_rdlock(&store->accountLocks[i]);
+    }
+
+    *count = store->accountCount;
+    pthread_mutex_lock(&store->logLock);
+    *sequence = store->lastSequence;
+    pthread_mutex_unlock(&store->logLock);
+
+    Account *copy = malloc(sizeof(Account) * (*count > 0 ? *count : 1));
+    if (copy != NULL)
+    {
+        memcpy(copy, store->accounts, sizeof(Account) * *count);
+    }
+
+    for (int i = 0; i < store->accountCount; i++)
+    {
+        pthread_rwlock_unlock(&store->accountLocks[i]);
+    }
+    pthread_rwlock_unlock(&store->tableLock);
+    pthread_mutex_unlock(&store->applyLock);
+    return copy;
+}
+
+// Function to replace every account with a snapshot from the primary and
+// restart the local log after its sequence
+void installSnapshot(const Account *accounts, int count, unsigned long sequence)
+{
+    pthread_mutex_lock(&store->applyLock);
+    pthread_rwlock_wrlock(&store->tableLock);
+    for (int i = 0; i < MAX_ACCOUNTS; i++)
+    {
+        pthread_rwlock_wrlock(&store->accountLocks[i]);
+    }
+
+    memcpy(store->accounts, accounts, sizeof(Account) * count);
+    store->accountCount = count;
+    pthread_mutex_lock(&store->persistLock);
+    memcpy(store->savedAccounts, accounts, sizeof(Account) * count);
+    pthread_mutex_unlock(&store->persistLock);
+    store->closedCount = slotsBuild(&store->slots, store->accounts, count);
+    customerIndexBuild(&store->customers, store->accounts, count);
+
+    pthread_mutex_lock(&store->logLock);
+    if (ftruncate(log_fd, 0) < 0)
+    {
+        perror("Error truncating operation log");
+    }
+    store->firstSequence = 0;
+    store->lastSequence = sequence;
+    pthread_mutex_unlock(&store->logLock);
+
+    for (int i = 0; i < MAX_ACCOUNTS; i++)
+    {
+        pthread_rwlock_unlock(&store->accountLocks[i]);
+    }
+    pthread_rwlock_unlock(&store->tableLock);
+    pthread_mutex_unlock(&store->applyLock);
+
+    saveAccountsToFile();
+}
+
+// Stream the log to one replica, starting with a snapshot when it asks for
+// one or for records the log no longer holds
+void *serve_replica(void *arg) {
+    int replica_socket = (int)(long)arg;
+    OperationRecord batch[REPLICATION_BATCH];
+
+    // Snapshots carry PIN hashes and national IDs, so only cluster members
+    // get them
+    ReplicationHello hello;
+    char secret[sizeof(hello.secret)] = {0};
+    strcpy(secret, cluster_secret);
+    struct timeval timeout = {SEND_TIMEOUT / 1000, 0};
+    struct timeval none = {0, 0};
+    setsockopt(replica_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (recvAll(replica_socket, &hello, sizeof(hello)) < 0 ||
+        !constantTimeEqual((const unsigned char *)hello.secret, (const unsigned char *)secret, sizeof(secret))) {
+        printf("Replication: refused a replica without the cluster secret\n");
+        close(replica_socket);
+        return NULL;
+    }
+    setsockopt(replica_socket, SOL_SOCKET, SO_RCVTIMEO, &none, sizeof(none));
+    unsigned long next = hello.next;
+
+    pthread_mutex_lock(&store->logLock);
+    int needSnapshot = next == 0 || next > store->lastSequence + 1 ||
+                       (next <= store->lastSequence && next < store->firstSequence);
+    pthread_mutex_unlock(&store->logLock);
+
+    if (needSnapshot) {
+        int count;
+        Account *accounts = takeSnapshot(&count, &next);
+        ReplicationHeader header = {REPLICATION_SNAPSHOT, count, next};
+        int failed = accounts == NULL ||
+                     sendAll(replica_socket, &header, sizeof(header)) < 0 ||
+                     sendAll(replica_socket, accounts, sizeof(Account) * count) < 0;
+        free(accounts);
+        if (failed) {
+            close(replica_socket);
+            return NULL;
+        }
+        printf("Replication: sent snapshot of %d accounts at sequence %lu\n", count, next);
+        next++;
+    }
+
+    while (!shutdown_requested && !handed_over) {
+        pthread_mutex_lock(&store->logLock);
+        if (next > store->lastSequence) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += 1;
+            pthread_cond_timedwait(&store->logCond, &store->logLock, &deadline);
+        }
+        unsigned long first = store->firstSequence;
+        unsigned long last = store->lastSequence;
+        pthread_mutex_unlock(&store->logLock);
+
+        if (next > last) {
+            continue;
+        }
+
+        int count = readOperationRecords(log_fd, first, next, batch, REPLICATION_BATCH);
+        if (count <= 0) {
+            break;
+        }
+
+        ReplicationHeader header = {REPLICATION_RECORDS, count, next};
+        if (sendAll(replica_socket, &header, sizeof(header)) < 0 ||
+            sendAll(replica_socket, batch, sizeof(OperationRecord) * count) < 0) {
+            break;
+        }
+        next += count;
+    }
+
+    printf("Replication: replica disconnected\n");
+    close(replica_socket);
+    return NULL;
+}
+
+// Accept replicas on the replication port, one sender thread each
+void *run_replication_listener(void *arg) {
+    int listener = (int)(long)arg;
+
+    while (!shutdown_requested && !handed_over) {
+        if (waitReadable(listener, 1000) <= 0) {
+            continue;
+        }
+
+        int replica_socket = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (replica_socket < 0) {
+            continue;
+        }
+
+        printf("Replication: replica connected\n");
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serve_replica, (void *)(long)replica_socket) != 0) {
+            close(replica_socket);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    close(listener);
+    return NULL;
+}
+
+// Stream committed events to one change-data-capture subscriber. Like a
+// replication sender it reads the log by itself, so commits never wait for
+// it; its socket buffer is the bounded buffer, and a subscriber that lets
+// it stay full or falls too far behind is dropped.
+void *serve_subscriber(void *arg) {
+    int subscriber = (int)(long)arg;
+    OperationRecord batch[REPLICATION_BATCH];
+    CdcEvent events[REPLICATION_BATCH];
+    unsigned long next;
+
+    int buffer_size = CDC_SEND_BUFFER;
+    struct timeval timeout = {CDC_SEND_TIMEOUT, 0};
+    setsockopt(subscriber, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+    setsockopt(subscriber, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    if (recvAll(subscriber, &next, sizeof(next)) < 0) {
+        close(subscriber);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&store->logLock);
+    unsigned long first = store->firstSequence;
+    unsigned long last = store->lastSequence;
+    pthread_mutex_unlock(&store->logLock);
+
+    CdcHeader header = {CDC_STREAMING, first, next > 0 ? next : first > 0 ? first : last + 1};
+    if (header.next > last + 1 || (header.next <= last && (first == 0 || header.next < first))) {
+        header.status = CDC_OUT_OF_RANGE;
+        header.next = last + 1;
+    }
+    if (sendAll(subscriber, &header, sizeof(header)) < 0 || header.status != CDC_STREAMING) {
+        close(subscriber);
+        return NULL;
+    }
+    next = header.next;
+    printf("CDC: subscriber streaming from sequence %lu\n", next);
+
+    const char *reason = "disconnected";
+    while (!shutdown_requested && !handed_over) {
+        pthread_mutex_lock(&store->logLock);
+        if (next > store->lastSequence) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += 1;
+            pthread_cond_timedwait(&store->logCond, &store->logLock, &deadline);
+        }
+        first = store->firstSequence;
+        last = store->lastSequence;
+        pthread_mutex_unlock(&store->logLock);
+
+        if (next > last) {
+            continue;
+        }
+        if (last - next >= CDC_MAX_LAG) {
+            reason = "fell too far behind";
+            break;
+        }
+
+        // A replica that installed a snapshot restarted its log past us
+        int count = first == 0 || next < first ? 0 : readOperationRecords(log_fd, first, next, batch, REPLICATION_BATCH);
+        if (count <= 0) {
+            reason = "asked for events no longer in the log";
+            break;
+        }
+
+        for (int i = 0; i < count; i++) {
+            cdcEventFromRecord(&batch[i], &events[i]);
+        }
+        if (sendAll(subscriber, events, sizeof(CdcEvent) * count) < 0) {
+            reason = errno == EAGAIN || errno == EWOULDBLOCK ? "stopped reading" : "disconnected";
+            break;
+        }
+        next += count;
+    }
+
+    printf("CDC: subscriber %s at sequence %lu\n", reason, next);
+    close(subscriber);
+    return NULL;
+}
+
+// Accept change-data-capture subscribers, one sender thread each
+void *run_cdc_listener(void *arg) {
+    int listener = (int)(long)arg;
+
+    while (!shutdown_requested && !handed_over) {
+        if (waitReadable(listener, 1000) <= 0) {
+            continue;
+        }
+
+        int subscriber = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (subscriber < 0) {
+            continue;
+        }
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serve_subscriber, (void *)(long)subscriber) != 0) {
+            close(subscriber);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    close(listener);
+    return NULL;
+}
+
+// Follow the primary until promoted: take a snapshot on first contact,
+// then apply its records in order, reconnecting whenever the stream breaks
+void *follow_primary(void *arg) {
+    int synced = (int)(long)arg;
+
+    while (store->readOnly && !shutdown_requested && !handed_over) {
+        int sock = connectTo(primary_host, primary_port);
+        if (sock < 0) {
+            sleep(1);
+            continue;
+        }
+        follower_socket = sock;
+
+        // A replica that just started trusts nothing but a fresh snapshot
+        pthread_mutex_lock(&store->logLock);
+        unsigned long next = synced ? store->lastSequence + 1 : 0;
+        pthread_mutex_unlock(&store->logLock);
+        printf("Replication: following %s:%d from sequence %lu\n", primary_host, primary_port, next);
+
+        ReplicationHello hello = {{0}, next};
+        strcpy(hello.secret, cluster_secret);
+        ReplicationHeader header;
+        if (sendAll(sock, &hello, sizeof(hello)) == 0) {
+            while (recvAll(sock, &header, sizeof(header)) == 0) {
+                if (header.kind == REPLICATION_SNAPSHOT) {
+                    Account *accounts = malloc(sizeof(Account) * (header.count > 0 ? header.count : 1));
+                    if (accounts == NULL || header.count > MAX_ACCOUNTS ||
+                        recvAll(sock, accounts, sizeof(Account) * header.count) < 0) {
+                        free(accounts);
+                        break;
+                    }
+                    installSnapshot(accounts, header.count, header.sequence);
+                    free(accounts);
+                    synced = 1;
+                    printf("Replication: installed snapshot of %d accounts at sequence %lu\n", header.count, header.sequence);
+                    continue;
+                }
+
+                int failed = 0;
+                for (int i = 0; i < header.count; i++) {
+                    OperationRecord record;
+                    if (recvAll(sock, &record, sizeof(record)) < 0) {
+                        failed = 1;
+                        break;
+                    }
+                    applyOperation(&record);
+                }
+                if (failed) {
+                    break;
+                }
+            }
+        }
+
+        follower_socket = -1;
+        close(sock);
+        if (store->readOnly && !shutdown_requested && !handed_over) {
+            printf("Replication: lost primary, reconnecting...\n");
+            sleep(1);
+        }
+    }
+    return NULL;
+}
+
+void handle_sigusr1(int sig) {
+    (void)sig;
+    promote_requested = 1;
+}
+
+// Turn a replica into a primary that accepts writes
+void check_promotion() {
+    if (!promote_requested) {
+        return;
+    }
+    promote_requested = 0;
+    if (store->readOnly) {
+        resetAccountSequence();
+        store->readOnly = 0;
+        if (follower_socket >= 0) {
+            shutdown(follower_socket, SHUT_RDWR);
+        }
+        printf("Promoted to primary at sequence %lu. Accepting writes.\n", store->lastSequence);
+    }
+}
+
+// Answer one transfer step from another shard. Steps only take local locks
+// briefly, so a shard waiting on us is never stuck behind our own clients.
+void *serve_peer(void *arg) {
+    int peer_socket = (int)(long)arg;
+    Request request;
+
+    if (waitReadable(peer_socket, SEND_TIMEOUT) > 0 && recvAll(peer_socket, &request, sizeof(request)) == 0) {
+        request.accountNumber[ACC_NUM_LENGTH] = '\0';
+        request.targetAccount[ACC_NUM_LENGTH] = '\0';
+        Response response = processShardRequest(&request);
+        sendResponse(peer_socket, &response, NULL);
+    }
+
+    close(peer_socket);
+    return NULL;
+}
+
+// Accept other shards on the peer port, one thread per step
+void *run_peer_listener(void *arg) {
+    int listener = (int)(long)arg;
+
+    while (!shutdown_requested && !handed_over) {
+        if (waitReadable(listener, 1000) <= 0) {
+            continue;
+        }
+
+        int peer_socket = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (peer_socket < 0) {
+            continue;
+        }
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serve_peer, (void *)(long)peer_socket) != 0) {
+            close(peer_socket);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    close(listener);
+    return NULL;
+}
+
+// Resend commits and aborts that the target shard has not acknowledged yet.
+// Runs in the main process only; children just leave their entries
+// COMMITTING or ABORTING.
+void *run_transfer_recovery(void *arg) {
+    (void)arg;
+
+    while (!shutdown_requested && !handed_over) {
+        sleep(TRANSFER_RETRY_INTERVAL);
+
+        time_t now = time(NULL);
+        for (int i = 0; i < MAX_PENDING_TRANSFERS; i++) {
+            pthread_mutex_lock(&store->transferLock);
+            PendingTransfer entry = store->transfers[i];
+            int due = (entry.state == TRANSFER_COMMITTING || entry.state == TRANSFER_ABORTING) && entry.coordinator &&
+                      now - entry.updated >= TRANSFER_RETRY_INTERVAL;
+            if (due) {
+                store->transfers[i].updated = now;
+            }
+            pthread_mutex_unlock(&store->transferLock);
+            if (!due) {
+                continue;
+            }
+
+            int committing = entry.state == TRANSFER_COMMITTING;
+            Response reply = sendToShard(shardForAccount(entry.peerAccount, shard_count),
+                                         committing ? COMMIT_TRANSFER : ABORT_TRANSFER, entry.id, entry.peerAccount,
+                                         entry.account, entry.amount);
+            if (reply.success) {
+                transferDelivered(entry.id, entry.account, entry.peerAccount,
+                                  committing ? TRANSFER_COMMITTED : TRANSFER_ABORTED);
+                printf("Transfer %lx: %s delivered to shard %d\n", entry.id, committing ? "commit" : "abort",
+                       shardForAccount(entry.peerAccount, shard_count));
+            }
+        }
+    }
+    return NULL;
+}
+
+// Rebuild the transfers of this shard from the operation log after a cold
+// start, both those it coordinates and those it receives. Reservations that
+// were never decided are given back; the outcomes the target shard has not
+// acknowledged are left for run_transfer_recovery to resend. Returns the
+// number given back.
+int recover_transfers(void) {
+    OperationRecord batch[REPLICATION_BATCH];
+    PendingTransfer undecided[MAX_PENDING_TRANSFERS];
+    int pending = 0;
+
+    pthread_mutex_lock(&store->transferLock);
+    unsigned long next = store->firstSequence;
+    int count;
+    while ((count = readOperationRecords(log_fd, store->firstSequence, next, batch, REPLICATION_BATCH)) > 0) {
+        for (int i = 0; i < count; i++) {
+            const OperationRecord *record = &batch[i];
+            if (record->type != PREPARE_TRANSFER && record->type != COMMIT_TRANSFER &&
+                record->type != ABORT_TRANSFER && record->type != TRANSFER_DELIVERED) {
+                continue;
+            }
+
+            // New transfer IDs must not repeat ones the other shards remember
+            unsigned long id = strtoul(record->name, NULL, 16);
+            int coordinator = (int)(id >> TRANSFER_ID_BITS) == shard_index;
+            if (coordinator && (id & TRANSFER_ID_MASK) > store->nextTransferId) {
+                store->nextTransferId = id & TRANSFER_ID_MASK;
+            }
+
+            // A received transfer's prepare does not know the amount; the
+            // commit brings it. Its abort may have come before the prepare.
+            PendingTransfer *entry = findTransfer(id);
+            int opens = record->type == PREPARE_TRANSFER || (!coordinator && record->type == ABORT_TRANSFER);
+            if (entry == NULL && opens) {
+                entry = claimTransfer(id, coordinator, record->accountNumber, record->nationalID, -record->amount);
+            }
+            if (entry == NULL) {
+                continue;
+            }
+            if (record->type == COMMIT_TRANSFER) {
+                entry->state = coordinator ? TRANSFER_COMMITTING : TRANSFER_COMMITTED;
+            } else if (record->type == ABORT_TRANSFER) {
+                entry->state = coordinator ? TRANSFER_ABORTING : TRANSFER_ABORTED;
+            } else if (record->type == TRANSFER_DELIVERED) {
+                entry->state = entry->state == TRANSFER_COMMITTING ? TRANSFER_COMMITTED : TRANSFER_ABORTED;
+            }
+            entry->updated = record->timestamp;
+        }
+        next += count;
+    }
+    for (int i = 0; i < MAX_PENDING_TRANSFERS; i++) {
+        if (store->transfers[i].state == TRANSFER_PREPARED && store->transfers[i].coordinator) {
+            undecided[pending++] = store->transfers[i];
+        }
+    }
+    pthread_mutex_unlock(&store->transferLock);
+
+    // The target shard may have prepared, so it is told about the abort
+    for (int i = 0; i < pending; i++) {
+        Account *account = lockAccount(undecided[i].account, 1);
+        if (account != NULL) {
+            moveTransferFunds(account, ABORT_TRANSFER, undecided[i].id, undecided[i].peerAccount, undecided[i].amount);
+        } else {
+            fprintf(stderr, "Transfer %lx: account %s is gone\n", undecided[i].id, undecided[i].account);
+        }
+        setTransferState(undecided[i].id, TRANSFER_ABORTING);
+        if (account != NULL) {
+            unlockAccount(account);
+        }
+    }
+
+    // A credit saved just before a crash has no COMMIT_TRANSFER record, but
+    // its history entry has the transfer ID. The record is logged now and
+    // the resent commit is answered without crediting again.
+    for (int i = 0; i < MAX_PENDING_TRANSFERS; i++) {
+        pthread_mutex_lock(&store->transferLock);
+        PendingTransfer entry = store->transfers[i];
+        pthread_mutex_unlock(&store->transferLock);
+        if (entry.state != TRANSFER_PREPARED || entry.coordinator) {
+            continue;
+        }
+
+        Transaction credit;
+        Account *account = lockAccount(entry.account, 1);
+        if (account == NULL) {
+            continue;
+        }
+        if (findRequestHistory(account, entry.id, &credit)) {
+            logTransferStep(COMMIT_TRANSFER, account, entry.id, entry.peerAccount, credit.amount);
+            setTransferState(entry.id, TRANSFER_COMMITTED);
+            printf("Transfer %lx: credit to %s was saved before the crash\n", entry.id, entry.account);
+        }
+        unlockAccount(account);
+    }
+    return pending;
+}
+
+// Take the orders due by now off the wheel, advancing or freeing them, and
+// run them. The schedule is synced before any money moves, so a crash
+// in between skips a run rather than repeating it. Returns the number run.
+int run_due_orders(time_t now) {
+    int due[SCHEDULE_BATCH];
+    StandingOrder batch[SCHEDULE_BATCH];
+
+    pthread_mutex_lock(&schedule->lock);
+    int count = wheelAdvance(schedule, now, due, SCHEDULE_BATCH);
+    for (int i = 0; i < count; i++) {
+        StandingOrder *order = &schedule->orders[due[i]];
+        batch[i] = *order;
+        if (order->interval > 0) {
+            // Runs missed while the server was down are skipped, not repeated
+            order->nextRun += ((now - order->nextRun) / order->interval + 1) * order->interval;
+            wheelInsert(schedule, due[i]);
+        } else {
+            releaseOrder(schedule, due[i]);
+        }
+    }
+    pthread_mutex_unlock(&schedule->lock);
+    if (count == 0) {
+        return 0;
+    }
+    if (fdatasync(schedule_fd) < 0) {
+        perror("Error saving standing orders");
+    }
+
+    int failed = 0;
+    running_standing_orders = 1;
+    for (int i = 0; i < count; i++) {
+        Request request = {0};
+        request.type = batch[i].type;
+        strcpy(request.accountNumber, batch[i].accountNumber);
+        strcpy(request.targetAccount, batch[i].targetAccount);
+        request.amount = batch[i].amount;
+
+        ResponsePayload payload;
+        Response response = processRequest(&request, &payload);
+        if (response.success) {
+            continue;
+        }
+        failed++;
+
+        // Orders on a closed account stop for good
+        Account *account = lockAccount(batch[i].accountNumber, 0);
+        if (account == NULL) {
+            cancelStandingOrder(batch[i].id, NULL);
+        } else {
+            unlockAccount(account);
+        }
+    }
+    running_standing_orders = 0;
+
+    saveAccountsToFile();
+    printf("Ran %d standing orders (%d failed).\n", count, failed);
+    return count;
+}
+
+// One monthly batch, shared by its threads
+typedef struct {
+    int period;
+    time_t now;
+    int accountCount;
+    int nextChunk;
+    int posted;
+} AccrualBatch;
+
+// Claim chunks of accounts until none are left. A chunk stays locked until
+// it is saved and only then are its ACCRUAL records logged, so the log never
+// has a posting the file lacks: a crash loses the chunk in hand, whose
+// accounts are not marked on disk either, and the rerun posts them once.
+void *accrue_chunks(void *arg) {
+    AccrualBatch *batch = arg;
+    double amounts[ACCRUAL_CHUNK];
+
+    for (;;) {
+        int first = __atomic_fetch_add(&batch->nextChunk, 1, __ATOMIC_RELAXED) * ACCRUAL_CHUNK;
+        if (first >= batch->accountCount) {
+            break;
+        }
+        int end = first + ACCRUAL_CHUNK < batch->accountCount ? first + ACCRUAL_CHUNK : batch->accountCount;
+
+        // In slot order, as lockAccountPair takes them
+        int posted = 0;
+        pthread_rwlock_rdlock(&store->tableLock);
+        for (int i = first; i < end; i++) {
+            pthread_rwlock_wrlock(&store->accountLocks[i]);
+            amounts[i - first] = accrueAccount(&store->accounts[i], batch->period, batch->now);
+            posted += amounts[i - first] != 0;
+        }
+        held_first = first;
+        held_end = end;
+
+        if (posted > 0) {
+            saveAccountsToFile();
+            for (int i = first; i < end; i++) {
+                if (amounts[i - first] != 0) {
+                    logOperation(ACCRUAL, &store->accounts[i], amounts[i - first], 0);
+                }
+            }
+            __atomic_fetch_add(&batch->posted, posted, __ATOMIC_RELAXED);
+        }
+
+        held_first = held_end = 0;
+        for (int i = first; i < end; i++) {
+            pthread_rwlock_unlock(&store->accountLocks[i]);
+        }
+        pthread_rwlock_unlock(&store->tableLock);
+    }
+    return NULL;
+}
+
+// Post this month's interest and fees to every account on several threads.
+// Accounts already posted for the month are skipped, so a batch cut short
+// by a crash or restart is simply run again.
+void run_accrual_batch(int period, time_t now) {
+    AccrualBatch batch = {period, now, 0, 0, 0};
+    pthread_rwlock_rdlock(&store->tableLock);
+    batch.accountCount = store->accountCount;
+    pthread_rwlock_unlock(&store->tableLock);
+
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int chunks = (batch.accountCount + ACCRUAL_CHUNK - 1) / ACCRUAL_CHUNK;
+    if (threads > ACCRUAL_MAX_THREADS) {
+        threads = ACCRUAL_MAX_THREADS;
+    }
+    if (threads > chunks) {
+        threads = chunks;
+    }
+
+    pthread_t workers[ACCRUAL_MAX_THREADS];
+    int started = 0;
+    while (started < threads - 1 && pthread_create(&workers[started], NULL, accrue_chunks, &batch) == 0) {
+        started++;
+    }
+    accrue_chunks(&batch);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    store->accruedPeriod = period;
+    printf("Monthly batch: posted interest or fees to %d of %d accounts.\n", batch.posted, batch.accountCount);
+}
+
+// Move closed accounts to the archive and free their slots, then rewrite
+// the database file without them. Closed accounts never change again, so
+// they are copied out and made durable in the archive before the table is
+// locked, which keeps the exclusive section down to emptying the slots.
+// Returns the number of slots freed, or -1 if the archive could not be
+// written, in which case the accounts stay where they are.
+int compact_closed_accounts(void) {
+    int slots[MAX_ACCOUNTS];
+    int count = 0;
+    Account *closed = malloc(sizeof(Account) * MAX_ACCOUNTS);
+    if (closed == NULL) {
+        return -1;
+    }
+
+    pthread_rwlock_rdlock(&store->tableLock);
+    for (int i = 0; i < store->accountCount; i++) {
+        pthread_rwlock_rdlock(&store->accountLocks[i]);
+        if (store->accounts[i].accountNumber[0] != '\0' && !store->accounts[i].isActive) {
+            closed[count] = store->accounts[i];
+            slots[count++] = i;
+        }
+        pthread_rwlock_unlock(&store->accountLocks[i]);
+    }
+    pthread_rwlock_unlock(&store->tableLock);
+
+    if (count == 0 || appendAccountArchive(archive_path, closed, count, time(NULL)) < 0) {
+        if (count > 0) {
+            perror("Error writing account archive");
+        }
+        free(closed);
+        return count == 0 ? 0 : -1;
+    }
+
+    // A snapshot from the primary may have replaced the table meanwhile
+    int freed = 0;
+    pthread_rwlock_wrlock(&store->tableLock);
+    for (int i = 0; i < count; i++) {
+        // Wait out anyone still holding the slot, such as the monthly batch
+        pthread_rwlock_wrlock(&store->accountLocks[slots[i]]);
+        if (strcmp(store->accounts[slots[i]].accountNumber, closed[i].accountNumber) == 0 &&
+            !store->accounts[slots[i]].isActive) {
+            slotsRelease(&store->slots, store->accounts, slots[i]);
+            pthread_mutex_lock(&store->persistLock);
+            memset(&store->savedAccounts[slots[i]], 0, sizeof(Account));
+            pthread_mutex_unlock(&store->persistLock);
+            freed++;
+        }
+        pthread_rwlock_unlock(&store->accountLocks[slots[i]]);
+    }
+    store->archivedCount += freed;
+    __atomic_fetch_sub(&store->closedCount, freed, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&store->tableLock);
+    free(closed);
+
+    saveAccountsToFile();
+    printf("Archived %d closed accounts to %s.\n", freed, archive_path);
+    return freed;
+}
+
+// Checkpoint every account for point-in-time queries. Returns 0 once the
+// checkpoint is listed, or -1.
+int take_checkpoint(CheckpointEntry *last) {
+    int count;
+    unsigned long sequence;
+    Account *accounts = takeSnapshot(&count, &sequence);
+    if (accounts == NULL) {
+        return -1;
+    }
+    time_t now = time(NULL);
+    int written = writeCheckpoint(DATABASE_FILE, accounts, count, sequence, now);
+    free(accounts);
+    if (written < 0) {
+        perror("Error writing checkpoint");
+        return -1;
+    }
+    last->sequence = sequence;
+    last->timestamp = now;
+    printf("Checkpoint written at log sequence %lu.\n", sequence);
+    return 0;
+}
+
+#ifdef BANK_TRACE
+// Write this process's trace to bank_trace.PID.json if SIGQUIT asked for it
+void dump_trace_if_requested(void) {
+    if (!trace_dump_requested) {
+        return;
+    }
+    trace_dump_requested = 0;
+
+    char path[64];
+    snprintf(path, sizeof(path), "bank_trace.%d.json", getpid());
+    if (traceDump(path) < 0) {
+        perror(path);
+    } else {
+        printf("Trace written to %s\n", path);
+    }
+}
+#endif
+
+// Run standing orders as they fall due, once a second, and the interest
+// and fee batch when a new month starts. Runs in the main process only;
+// replicas leave both alone until promoted, but compact and checkpoint
+// their own table.
+void *run_scheduler(void *arg) {
+    (void)arg;
+    time_t next_compaction = time(NULL) + COMPACTION_INTERVAL;
+
+    CheckpointEntry last = {0, 0};
+    int have_checkpoint = lastCheckpoint(DATABASE_FILE, &last) == 0;
+
+    while (!shutdown_requested && !handed_over) {
+        // time() may lag the precise clock by a tick, and so miss the
+        // second we just woke up for
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        if (!store->readOnly && accrualPeriod(now.tv_sec) > store->accruedPeriod) {
+            run_accrual_batch(accrualPeriod(now.tv_sec), now.tv_sec);
+        }
+        if (!store->readOnly && run_due_orders(now.tv_sec) == SCHEDULE_BATCH) {
+            continue;
+        }
+        if (__atomic_load_n(&store->closedCount, __ATOMIC_RELAXED) > 0 &&
+            (now.tv_sec >= next_compaction || accountTableFull())) {
+            compact_closed_accounts();
+            next_compaction = now.tv_sec + COMPACTION_INTERVAL;
+        }
+        pthread_mutex_lock(&store->logLock);
+        unsigned long first = store->firstSequence;
+        unsigned long logged = store->lastSequence;
+        pthread_mutex_unlock(&store->logLock);
+        // Checkpoint at once when there is none yet or the log no longer
+        // follows on from the last one; never when nothing has changed
+        if (!have_checkpoint ||
+            (logged > last.sequence && (now.tv_sec >= last.timestamp + CHECKPOINT_INTERVAL ||
+                                        logged - last.sequence >= CHECKPOINT_RECORDS || first > last.sequence + 1))) {
+            if (take_checkpoint(&last) < 0) {
+                // Try again after an interval rather than every second
+                last.sequence = logged;
+                last.timestamp = now.tv_sec;
+            }
+            have_checkpoint = 1;
+        }
+
+#ifdef BANK_TRACE
+        // Forked children each write their own trace
+        if (trace_dump_requested) {
+            for (int i = 0; i < MAX_CLIENTS; i++) {
+                if (client_pids[i] > 0) {
+                    kill(client_pids[i], SIGQUIT);
+                }
+            }
+            dump_trace_if_requested();
+        }
+#endif
+
+        // Wake at the start of the next second
+        clock_gettime(CLOCK_REALTIME, &now);
+        struct timespec pause = {0, 1000000000L - now.tv_nsec};
+        nanosleep(&pause, NULL);
+    }
+    return NULL;
+}
+
+// Signal handler for child processes
+void handle_sigchld(int sig) {
+    (void)sig;
     int saved_errno = errno;
     pid_t pid;
     int status;
@@ -371,7 +3020,7 @@ void handle_sigchld(int sig) {
     // Reap all terminated child processes
     while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
         // Remove the terminated client from our tracking list
-        for (int i = 0; i < 5; i++) {
+        for (int i = 0; i < MAX_CLIENTS; i++) {
             if (client_pids[i] == pid) {
                 client_pids[i] = 0;
                 active_clients--;
@@ -380,54 +3029,1189 @@ void handle_sigchld(int sig) {
             }
         }
     }
-    
-    errno = saved_errno;
+    
+    errno = saved_errno;
+}
+
+// Send an explanatory error response and close the connection
+void reject_client(int client_socket, const char *message, int retryAfter) {
+    Response response = {0};
+    response.success = 0;
+    response.retryAfter = retryAfter;
+    snprintf(response.message, sizeof(response.message), "%s", message);
+    // A TLS client is still waiting for its handshake; just hang up
+    if (tls_cert_file == NULL) {
+        sendResponse(client_socket, &response, NULL);
+    }
+    close(client_socket);
+}
+
+// Rate-limit and process one request, returning the answer to send
+Response answer_request(const char *client_ip, Request *request, CredentialCache *credentials, ResponsePayload *payload) {
+    request->accountNumber[ACC_NUM_LENGTH] = '\0';
+    request->pin[PIN_LENGTH] = '\0';
+    request->name[MAX_NAME_LENGTH] = '\0';
+    request->nationalID[ID_LENGTH] = '\0';
+    request->targetAccount[ACC_NUM_LENGTH] = '\0';
+    if (!(request->amount > -MAX_REQUEST_AMOUNT && request->amount < MAX_REQUEST_AMOUNT)) {
+        Response response = {0};
+        response.success = 0;
+        strcpy(response.message, "Error: Invalid amount.");
+        payload->iovcnt = 0;
+        return response;
+    }
+
+    // Both the source address and the target account must have budget left
+    int retryAfter = rateLimitAcquire(ip_limiter, client_ip, 1);
+    if (retryAfter == 0 && request->accountNumber[0] != '\0') {
+        retryAfter = rateLimitAcquire(account_limiter, request->accountNumber, 1);
+    }
+    if (retryAfter > 0) {
+        printf("Rate limited request from %s (Account: %s)\n", client_ip,
+               request->accountNumber[0] != '\0' ? request->accountNumber : "None");
+        Response response = {0};
+        response.success = 0;
+        response.retryAfter = retryAfter;
+        sprintf(response.message, "Error: Too many requests. Please retry in %d seconds.", retryAfter);
+        payload->iovcnt = 0;
+        return response;
+    }
+
+    session_credentials = credentials;
+    session_ip = client_ip;
+    pin_retry_after = 0;
+    TRACE_BEGIN(trace);
+    Response response = processRequest(request, payload);
+    TRACE_END(trace, "processRequest", request->type);
+    session_credentials = NULL;
+    session_ip = NULL;
+
+    // Nothing was changed: the request stopped at its PIN check
+    if (pin_retry_after > 0) {
+        memset(&response, 0, sizeof(response));
+        response.success = 0;
+        response.retryAfter = pin_retry_after;
+        sprintf(response.message, "Error: Too many wrong PINs from your address. Please retry in %d seconds.",
+                pin_retry_after);
+        payload->iovcnt = 0;
+    }
+    return response;
+}
+
+// Rate-limit, process and answer one request in a forked child, waiting
+// for the socket to take the answer. Reactor threads never wait on one
+// client; see reactor_answer.
+void serve_request(int client_socket, const char *client_ip, Request *request, CredentialCache *credentials) {
+    ResponsePayload payload;
+    Response response = answer_request(client_ip, request, credentials, &payload);
+    TRACE_BEGIN(trace);
+    sendResponse(client_socket, &response, &payload);
+    TRACE_END(trace, "send", response.transactionCount);
+}
+
+// Function to handle a client connection in a child process
+void handle_client(int client_socket) {
+    // Get client info from socket
+    struct sockaddr_in client_addr;
+    socklen_t addr_size = sizeof(client_addr);
+    getpeername(client_socket, (struct sockaddr*)&client_addr, &addr_size);
+    char client_ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
+    
+    printf("Child process %d handling client from %s:%d\n", 
+           getpid(), client_ip, ntohs(client_addr.sin_port));
+
+#ifdef BANK_TLS
+    // The handshake happens here rather than in the parent, so a slow one
+    // holds up no other client
+    if (tls_context != NULL && tlsAccept(tls_context, client_socket) < 0) {
+        printf("TLS handshake with %s failed in child process %d\n", client_ip, getpid());
+        close(client_socket);
+        exit(0);
+    }
+#endif
+
+    // Handle communication with the client
+    char current_account[ACC_NUM_LENGTH + 1] = "None";
+    time_t drainStarted = 0;
+    CredentialCache credentials;
+    credentialCacheInit(&credentials);
+    
+    while (1) {
+        if (shutdown_requested && drainStarted == 0) {
+            drainStarted = time(NULL);
+        }
+        if (drainStarted && drainExpired(drainStarted)) {
+            printf("Child process %d closing client connection for shutdown\n", getpid());
+            break;
+        }
+#ifdef BANK_TRACE
+        dump_trace_if_requested();
+#endif
+
+        // Signals only ever interrupt this wait, never a request in progress
+#ifdef BANK_TLS
+        int ready = tlsPending(client_socket) ? 1 : waitReadable(client_socket, 1000);
+#else
+        int ready = waitReadable(client_socket, 1000);
+#endif
+        if (ready == 0) {
+            continue;
+        }
+
+        // Wait for the whole request; pipelined requests can arrive split
+        Request request;
+        TRACE_BEGIN(trace);
+        int failed = ready < 0 || recvAll(client_socket, &request, sizeof(request)) < 0;
+        TRACE_END(trace, "recv", failed);
+        if (failed) {
+            printf("Client disconnected from child process %d\n", getpid());
+            break;
+        }
+        request.accountNumber[ACC_NUM_LENGTH] = '\0';
+
+        // Update current account if available in the request
+        if (strlen(request.accountNumber) > 0) {
+            strncpy(current_account, request.accountNumber, ACC_NUM_LENGTH);
+            current_account[ACC_NUM_LENGTH] = '\0';
+        }
+
+        printf("Processing request from client (PID: %d, Account: %s)\n", 
+               getpid(), current_account);
+
+        serve_request(client_socket, client_ip, &request, &credentials);
+    }
+
+#ifdef BANK_TLS
+    tlsDetach(client_socket);
+#endif
+    close(client_socket);
+    exit(0); // Child process exits
+}
+
+// Fork a child process to serve the client. Returns 0 on success.
+int spawn_client(int client_socket) {
+    // Keep the SIGCHLD handler from running before the child is tracked
+    sigset_t block, previous;
+    sigemptyset(&block);
+    sigaddset(&block, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &block, &previous);
+
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        perror("Fork failed");
+        sigprocmask(SIG_SETMASK, &previous, NULL);
+        return -1;
+    }
+
+    if (pid == 0) {
+        // Child process; hot restarts are the parent's business
+        restart_requested = 0;
+#ifdef BANK_TRACE
+        traceForked();
+#endif
+        sigprocmask(SIG_SETMASK, &previous, NULL);
+        for (int i = 0; i < listener_count; i++) {
+            close(listeners[i]); // Close the listening sockets in the child
+        }
+        for (int i = 0; i < pending_count; i++) {
+            close(pending_clients[(pending_head + i) % MAX_PENDING_CLIENTS].socket);
+        }
+        handle_client(client_socket);
+        // Child process exits in handle_client function
+    }
+
+    // Parent process
+    close(client_socket); // Close the client socket in the parent
+
+    // Add child to our tracking array
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (client_pids[i] == 0) {
+            client_pids[i] = pid;
+            active_clients++;
+            printf("New client connected. Active clients: %d/%d\n", active_clients, MAX_CLIENTS);
+            break;
+        }
+    }
+
+    sigprocmask(SIG_SETMASK, &previous, NULL);
+    return 0;
+}
+
+// Hand queued connections to free slots and turn away those that waited too long
+void dispatch_pending_clients() {
+    double now = monotonicSeconds();
+
+    while (pending_count > 0) {
+        PendingClient pending = pending_clients[pending_head];
+
+        if (now - pending.queuedAt <= PENDING_TIMEOUT && active_clients >= MAX_CLIENTS) {
+            break;
+        }
+
+        // Dequeue first so the child does not close its own socket
+        pending_head = (pending_head + 1) % MAX_PENDING_CLIENTS;
+        pending_count--;
+
+        if (now - pending.queuedAt > PENDING_TIMEOUT) {
+            printf("Queued client from %s timed out.\n", pending.ip);
+            reject_client(pending.socket, "Error: Server busy. Please try again later.", PENDING_TIMEOUT);
+        } else if (spawn_client(pending.socket) < 0) {
+            reject_client(pending.socket, "Error: Server busy. Please try again later.", 1);
+        }
+    }
+}
+
+// Queue a connection until a client slot frees up. Returns -1 when full.
+int queue_client(int client_socket, const char *client_ip) {
+    if (pending_count >= MAX_PENDING_CLIENTS) {
+        return -1;
+    }
+
+    PendingClient *pending = &pending_clients[(pending_head + pending_count) % MAX_PENDING_CLIENTS];
+    pending->socket = client_socket;
+    strcpy(pending->ip, client_ip);
+    pending->queuedAt = monotonicSeconds();
+    pending_count++;
+    return 0;
+}
+
+// Wait for every child to finish its session. Children drain on their own
+// when they receive a shutdown signal; a further signal is passed on to
+// cut their drain short.
+void wait_for_children(int forward_signals) {
+    sig_atomic_t forwarded = 0;
+
+    while (active_clients > 0) {
+        if (forward_signals && forwarded < shutdown_requested) {
+            forwarded = shutdown_requested;
+            for (int i = 0; i < MAX_CLIENTS; i++) {
+                if (client_pids[i] != 0) {
+                    kill(client_pids[i], SIGTERM);
+                }
+            }
+        }
+        poll(NULL, 0, 200);
+    }
+}
+
+// Pass the account store, the listening sockets and any queued connections
+// to a newly executed server binary. Returns 0 once it owns them.
+int handoff_to_successor(char *argv[]) {
+    restart_requested = 0;
+    printf("Hot restart: starting new server binary...\n");
+
+    int channel = startSuccessor(argv);
+    if (channel < 0) {
+        printf("Hot restart aborted. Continuing to serve.\n");
+        return -1;
+    }
+
+    int fds[HANDOFF_MAX_FDS];
+    int count = 0;
+    fds[count++] = store_fd;
+    for (int i = 0; i < listener_count && count < HANDOFF_MAX_FDS; i++) {
+        fds[count++] = listeners[i];
+    }
+    while (pending_count > 0 && count < HANDOFF_MAX_FDS) {
+        fds[count++] = pending_clients[pending_head].socket;
+        pending_head = (pending_head + 1) % MAX_PENDING_CLIENTS;
+        pending_count--;
+    }
+    if (sendHandoff(channel, fds, count) < 0) {
+        perror("Handoff failed");
+        exit(EXIT_FAILURE);
+    }
+    close(channel);
+
+    // Our copies are no longer needed; the successor holds its own
+    for (int i = 1 + listener_count; i < count; i++) {
+        close(fds[i]);
+    }
+    handed_over = 1;
+    return 0;
+}
+
+// Create a listening socket on port. SO_REUSEPORT lets several of them
+// share the port, and the kernel spreads new connections across them.
+int create_listener(int port)
+{
+    int server_fd;
+    struct sockaddr_in address;
+    int opt = 1;
+
+    // Creating socket file descriptor
+    if ((server_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+    {
+        perror("Socket creation failed");
+        exit(EXIT_FAILURE);
+    }
+
+    // Set socket options
+    // Accepted sockets inherit TCP_NODELAY, so answers to pipelined
+    // requests are not held back waiting for the client's ACK
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) ||
+        setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) ||
+        setsockopt(server_fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt)))
+    {
+        perror("Setsockopt failed");
+        exit(EXIT_FAILURE);
+    }
+
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+
+    // Bind socket to the address and port
+    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0)
+    {
+        perror("Bind failed");
+        exit(EXIT_FAILURE);
+    }
+
+    // Listen for connections
+    if (listen(server_fd, LISTEN_BACKLOG) < 0)
+    {
+        perror("Listen failed");
+        exit(EXIT_FAILURE);
+    }
+
+    return server_fd;
+}
+
+// Register a connection with a reactor's epoll loop
+void add_connection(Reactor *reactor, int client_socket, const char *client_ip) {
+    Connection *connection = calloc(1, sizeof(Connection));
+    if (connection == NULL) {
+        reject_client(client_socket, "Error: Server busy. Please try again later.", 1);
+        return;
+    }
+
+    connection->socket = client_socket;
+    strcpy(connection->ip, client_ip);
+    credentialCacheInit(&connection->credentials);
+    fcntl(client_socket, F_SETFL, fcntl(client_socket, F_GETFL) | O_NONBLOCK);
+
+    struct epoll_event event = {0};
+    event.events = EPOLLIN;
+    event.data.ptr = connection;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, client_socket, &event) < 0) {
+        perror("epoll_ctl failed");
+        close(client_socket);
+        free(connection);
+        return;
+    }
+
+    connection->next = reactor->connections;
+    if (reactor->connections != NULL) {
+        reactor->connections->prev = connection;
+    }
+    reactor->connections = connection;
+    reactor->connectionCount++;
+}
+
+void close_connection(Reactor *reactor, Connection *connection) {
+    epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, connection->socket, NULL);
+    close(connection->socket);
+    free(connection->output);
+
+    if (connection->prev != NULL) {
+        connection->prev->next = connection->next;
+    } else {
+        reactor->connections = connection->next;
+    }
+    if (connection->next != NULL) {
+        connection->next->prev = connection->prev;
+    }
+    reactor->connectionCount--;
+    free(connection);
+}
+
+// Accept everything waiting on the reactor's own listener
+void reactor_accept(Reactor *reactor) {
+    while (1) {
+        struct sockaddr_in address;
+        socklen_t addrlen = sizeof(address);
+        int client_socket = accept4(reactor->listener, (struct sockaddr *)&address, &addrlen, SOCK_CLOEXEC);
+        if (client_socket < 0) {
+            return;
+        }
+
+        char client_ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &address.sin_addr, client_ip, INET_ADDRSTRLEN);
+
+        int retryAfter = rateLimitAcquire(ip_limiter, client_ip, 1);
+        if (retryAfter > 0) {
+            reject_client(client_socket, "Error: Too many connections from your address. Please retry later.", retryAfter);
+            continue;
+        }
+        if (reactor->connectionCount >= MAX_REACTOR_CONNECTIONS) {
+            reject_client(client_socket, "Error: Server busy. Please try again later.", 1);
+            continue;
+        }
+
+        add_connection(reactor, client_socket, client_ip);
+    }
+}
+
+// Wait for the socket to become readable again, or writable
+void reactor_watch(Reactor *reactor, Connection *connection, uint32_t events) {
+    struct epoll_event event = {0};
+    event.events = events;
+    event.data.ptr = connection;
+    epoll_ctl(reactor->epoll_fd, EPOLL_CTL_MOD, connection->socket, &event);
+}
+
+// Answer a complete request without waiting on the socket. Whatever it
+// will not take now is copied aside and sent once epoll reports room; the
+// connection's requests are not read meanwhile. Returns -1 if the
+// connection failed.
+int reactor_answer(Reactor *reactor, Connection *connection) {
+    ResponsePayload payload;
+    Response response = answer_request(connection->ip, &connection->request, &connection->credentials, &payload);
+
+    struct iovec iov[RESPONSE_MAX_IOV + 1];
+    iov[0].iov_base = &response;
+    iov[0].iov_len = sizeof(response);
+    for (int i = 0; i < payload.iovcnt; i++) {
+        iov[i + 1] = payload.iov[i];
+    }
+    struct msghdr message = {0};
+    message.msg_iov = iov;
+    message.msg_iovlen = payload.iovcnt + 1;
+    TRACE_BEGIN(trace);
+    int left = sendAvailable(connection->socket, &message);
+    TRACE_END(trace, "send", response.transactionCount);
+    if (left <= 0) {
+        return left;
+    }
+
+    // The response and the statement buffer are gone after this call
+    size_t length = 0;
+    for (int i = 0; i < left; i++) {
+        length += message.msg_iov[i].iov_len;
+    }
+    connection->output = malloc(length);
+    if (connection->output == NULL) {
+        return -1;
+    }
+    connection->outputLength = 0;
+    for (int i = 0; i < left; i++) {
+        memcpy(connection->output + connection->outputLength, message.msg_iov[i].iov_base, message.msg_iov[i].iov_len);
+        connection->outputLength += message.msg_iov[i].iov_len;
+    }
+    connection->outputSent = 0;
+    connection->outputSince = time(NULL);
+    reactor_watch(reactor, connection, EPOLLOUT);
+    return 0;
+}
+
+// Send more of an answer that was held back, and go back to reading
+// requests once it is all out
+void reactor_write(Reactor *reactor, Connection *connection) {
+    while (connection->outputSent < connection->outputLength) {
+        ssize_t sent = send(connection->socket, connection->output + connection->outputSent,
+                            connection->outputLength - connection->outputSent, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (sent <= 0) {
+            close_connection(reactor, connection);
+            return;
+        }
+        connection->outputSent += sent;
+    }
+    free(connection->output);
+    connection->output = NULL;
+    reactor_watch(reactor, connection, EPOLLIN);
+}
+
+// Drop connections whose answer has waited SEND_TIMEOUT for room, as a
+// blocking send would have given up on them
+void reactor_drop_stalled(Reactor *reactor) {
+    time_t now = time(NULL);
+    Connection *next;
+    for (Connection *connection = reactor->connections; connection != NULL; connection = next) {
+        next = connection->next;
+        if (connection->output != NULL && (now - connection->outputSince) * 1000 >= SEND_TIMEOUT) {
+            printf("Dropping client %s, which stopped reading its answers\n", connection->ip);
+            close_connection(reactor, connection);
+        }
+    }
+}
+
+// Read whatever has arrived and serve each complete request. A connection
+// gets a bounded number of requests per wakeup so it cannot starve others.
+void reactor_read(Reactor *reactor, Connection *connection) {
+    for (int served = 0; served < REACTOR_REQUEST_BUDGET && connection->output == NULL;) {
+        TRACE_BEGIN(trace);
+        ssize_t received = recv(connection->socket, (char *)&connection->request + connection->received,
+                                sizeof(Request) - connection->received, 0);
+        TRACE_END(trace, "recv", (int)received);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (received <= 0) {
+            close_connection(reactor, connection);
+            return;
+        }
+
+        connection->received += received;
+        if (connection->received == sizeof(Request)) {
+            connection->received = 0;
+            if (reactor_answer(reactor, connection) < 0) {
+                close_connection(reactor, connection);
+                return;
+            }
+            served++;
+        }
+    }
+}
+
+// Event loop of one reactor thread
+void *run_reactor(void *arg) {
+    Reactor *reactor = arg;
+    struct epoll_event events[REACTOR_EVENTS];
+    time_t drainStarted = 0;
+    time_t lastSweep = 0;
+
+    while (1) {
+        // On shutdown or handoff stop accepting and drain our connections
+        if ((shutdown_requested || handed_over) && reactor->listener >= 0) {
+            epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, reactor->listener, NULL);
+            close(reactor->listener);
+            reactor->listener = -1;
+            drainStarted = time(NULL);
+        }
+        if (reactor->listener < 0) {
+            if (reactor->connections == NULL) {
+                break;
+            }
+            if (shutdown_requested && drainExpired(drainStarted)) {
+                while (reactor->connections != NULL) {
+                    close_connection(reactor, reactor->connections);
+                }
+                break;
+            }
+        }
+
+        int count = epoll_wait(reactor->epoll_fd, events, REACTOR_EVENTS, 1000);
+        for (int i = 0; i < count; i++) {
+            Connection *connection = events[i].data.ptr;
+            if (connection == NULL) {
+                reactor_accept(reactor);
+            } else if (connection->output != NULL) {
+                reactor_write(reactor, connection);
+            } else {
+                reactor_read(reactor, connection);
+            }
+        }
+        if (time(NULL) != lastSweep) {
+            lastSweep = time(NULL);
+            reactor_drop_stalled(reactor);
+        }
+    }
+
+    close(reactor->epoll_fd);
+    return NULL;
 }
 
-// Function to handle a client connection in a child process
-void handle_client(int client_socket) {
-    // Get client info from socket
-    struct sockaddr_in client_addr;
-    socklen_t addr_size = sizeof(client_addr);
-    getpeername(client_socket, (struct sockaddr*)&client_addr, &addr_size);
+// Ring-based reactor. Each connection has at most one operation in flight:
+// a receive of the rest of its request, or the send of its answer. Every
+// receive, send, accept and log fsync of a loop turn goes to the kernel in
+// one io_uring_enter, which also collects the completions.
+
+// Queue a receive of the rest of the request, into the registered pool
+// when the kernel pinned it
+void uring_receive(Reactor *reactor, Connection *connection) {
+    struct io_uring_sqe *sqe = ringGetSqe(&reactor->ring);
+    sqe->opcode = reactor->fixedBuffers ? IORING_OP_READ_FIXED : IORING_OP_RECV;
+    sqe->fd = connection->slot;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (unsigned long)((char *)&connection->request + connection->received);
+    sqe->len = sizeof(Request) - connection->received;
+    sqe->buf_index = 0;
+    sqe->user_data = (unsigned long)connection;
+}
+
+void uring_send(Reactor *reactor, Connection *connection) {
+    struct io_uring_sqe *sqe = ringGetSqe(&reactor->ring);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = connection->slot;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (unsigned long)&connection->message;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (unsigned long)connection;
+    if (!connection->sending) {
+        connection->sending = 1;
+        connection->sendingSince = time(NULL);
+    }
+}
+
+void uring_accept(Reactor *reactor) {
+    struct io_uring_sqe *sqe = ringGetSqe(&reactor->ring);
+    reactor->acceptLength = sizeof(reactor->acceptAddress);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = URING_LISTENER_SLOT;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (unsigned long)&reactor->acceptAddress;
+    sqe->addr2 = (unsigned long)&reactor->acceptLength;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = URING_ACCEPT;
+    reactor->accepting = 1;
+}
+
+// One fsync of the log makes every change answered since the last one durable
+void uring_sync(Reactor *reactor) {
+    struct io_uring_sqe *sqe = ringGetSqe(&reactor->ring);
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fd = URING_LOG_SLOT;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    sqe->user_data = URING_FSYNC;
+    reactor->syncing = reactor->unsynced;
+    reactor->unsynced = NULL;
+}
+
+void uring_add_connection(Reactor *reactor, int client_socket, const char *client_ip) {
+    int slot = reactor->freeSlots[--reactor->freeCount];
+    if (ringSetFile(&reactor->ring, URING_FIRST_CONNECTION_SLOT + slot, client_socket) < 0) {
+        reactor->freeCount++;
+        reject_client(client_socket, "Error: Server busy. Please try again later.", 1);
+        return;
+    }
+
+    Connection *connection = &reactor->pool[slot];
+    connection->socket = client_socket;
+    connection->slot = URING_FIRST_CONNECTION_SLOT + slot;
+    connection->received = 0;
+    connection->sending = 0;
+    strcpy(connection->ip, client_ip);
+    credentialCacheInit(&connection->credentials);
+    reactor->connectionCount++;
+    uring_receive(reactor, connection);
+}
+
+void uring_close_connection(Reactor *reactor, Connection *connection) {
+    ringSetFile(&reactor->ring, connection->slot, -1);
+    close(connection->socket);
+    connection->socket = -1;
+    free(connection->records);
+    connection->records = NULL;
+    reactor->freeSlots[reactor->freeCount++] = connection - reactor->pool;
+    reactor->connectionCount--;
+}
+
+// Answer a complete request. Answers to changes wait for the log fsync.
+void uring_serve(Reactor *reactor, Connection *connection) {
+    ResponsePayload payload;
+    unsigned long logged = operations_logged;
+    connection->response = answer_request(connection->ip, &connection->request, &connection->credentials, &payload);
+
+    connection->iov[0].iov_base = &connection->response;
+    connection->iov[0].iov_len = sizeof(Response);
+    memset(&connection->message, 0, sizeof(connection->message));
+    connection->message.msg_iov = connection->iov;
+    connection->message.msg_iovlen = 1;
+
+    // A statement's records sit in this thread's statement buffer, which the
+    // next request overwrites, so the send takes a copy of them
+    size_t length = 0;
+    for (int i = 0; i < payload.iovcnt; i++) {
+        length += payload.iov[i].iov_len;
+    }
+    if (length > 0) {
+        connection->records = malloc(length);
+        if (connection->records == NULL) {
+            uring_close_connection(reactor, connection);
+            return;
+        }
+        length = 0;
+        for (int i = 0; i < payload.iovcnt; i++) {
+            memcpy((char *)connection->records + length, payload.iov[i].iov_base, payload.iov[i].iov_len);
+            length += payload.iov[i].iov_len;
+        }
+        connection->iov[1].iov_base = connection->records;
+        connection->iov[1].iov_len = length;
+        connection->message.msg_iovlen = 2;
+    }
+    if (operations_logged != logged) {
+        connection->nextUnsynced = reactor->unsynced;
+        reactor->unsynced = connection;
+        return;
+    }
+    uring_send(reactor, connection);
+}
+
+void uring_accepted(Reactor *reactor, int client_socket) {
+    reactor->accepting = 0;
+    if (reactor->listener >= 0) {
+        uring_accept(reactor);
+    }
+    if (client_socket < 0) {
+        // Once the listener is gone its accept fails with ECANCELED or EBADF
+        if (reactor->listener >= 0) {
+            fprintf(stderr, "Accept failed: %s\n", strerror(-client_socket));
+        }
+        return;
+    }
+
     char client_ip[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
-    
-    printf("Child process %d handling client from %s:%d\n", 
-           getpid(), client_ip, ntohs(client_addr.sin_port));
+    inet_ntop(AF_INET, &reactor->acceptAddress.sin_addr, client_ip, INET_ADDRSTRLEN);
 
-    // Handle communication with the client
-    char current_account[ACC_NUM_LENGTH + 1] = "None";
-    
+    int retryAfter = rateLimitAcquire(ip_limiter, client_ip, 1);
+    if (retryAfter > 0) {
+        reject_client(client_socket, "Error: Too many connections from your address. Please retry later.", retryAfter);
+        return;
+    }
+    if (reactor->freeCount == 0) {
+        reject_client(client_socket, "Error: Server busy. Please try again later.", 1);
+        return;
+    }
+    uring_add_connection(reactor, client_socket, client_ip);
+}
+
+void uring_synced(Reactor *reactor, int result) {
+    if (result < 0) {
+        fprintf(stderr, "Operation log fsync failed: %s\n", strerror(-result));
+    }
+    // The changes are applied either way, so the answers are still true
+    while (reactor->syncing != NULL) {
+        Connection *connection = reactor->syncing;
+        reactor->syncing = connection->nextUnsynced;
+        uring_send(reactor, connection);
+    }
+}
+
+void uring_completed(Reactor *reactor, Connection *connection, int result) {
+    if (connection->sending) {
+        connection->sending = 0;
+        if (result < 0) {
+            uring_close_connection(reactor, connection);
+        } else if (skipSent(&connection->message, result) > 0) {
+            // The rest goes out as another submission; nothing waits for it
+            connection->sending = 1;
+            uring_send(reactor, connection);
+        } else {
+            free(connection->records);
+            connection->records = NULL;
+            uring_receive(reactor, connection);
+        }
+        return;
+    }
+
+    if (result <= 0) {
+        uring_close_connection(reactor, connection);
+        return;
+    }
+    connection->received += result;
+    if (connection->received < sizeof(Request)) {
+        uring_receive(reactor, connection);
+        return;
+    }
+    connection->received = 0;
+    uring_serve(reactor, connection);
+}
+
+// Set up a reactor's ring, its fixed files and its connection pool.
+// Returns -1 with errno set when io_uring is unavailable.
+int uring_setup(Reactor *reactor) {
+    if (ringSetup(&reactor->ring, URING_QUEUE_DEPTH, 2 * MAX_REACTOR_CONNECTIONS) < 0) {
+        return -1;
+    }
+    if (ringRegisterFiles(&reactor->ring, URING_FIRST_CONNECTION_SLOT + MAX_REACTOR_CONNECTIONS) < 0 ||
+        ringSetFile(&reactor->ring, URING_LISTENER_SLOT, reactor->listener) < 0 ||
+        ringSetFile(&reactor->ring, URING_LOG_SLOT, log_fd) < 0) {
+        int saved = errno;
+        ringClose(&reactor->ring);
+        errno = saved;
+        return -1;
+    }
+    fcntl(reactor->listener, F_SETFL, fcntl(reactor->listener, F_GETFL) & ~O_NONBLOCK);
+
+    reactor->pool = calloc(MAX_REACTOR_CONNECTIONS, sizeof(Connection));
+    reactor->freeSlots = malloc(MAX_REACTOR_CONNECTIONS * sizeof(int));
+    if (reactor->pool == NULL || reactor->freeSlots == NULL) {
+        perror("Connection pool allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < MAX_REACTOR_CONNECTIONS; i++) {
+        reactor->pool[i].socket = -1;
+        reactor->freeSlots[reactor->freeCount++] = MAX_REACTOR_CONNECTIONS - 1 - i;
+    }
+
+    // Pinned memory counts against RLIMIT_MEMLOCK; past it, receive without fixed buffers
+    reactor->fixedBuffers =
+        ringRegisterBuffer(&reactor->ring, reactor->pool, MAX_REACTOR_CONNECTIONS * sizeof(Connection)) == 0;
+    return 0;
+}
+
+// Shut down connections whose answer has waited SEND_TIMEOUT for room.
+// That completes the send in flight with an error, which closes them.
+void uring_drop_stalled(Reactor *reactor) {
+    time_t now = time(NULL);
+    for (int i = 0; i < MAX_REACTOR_CONNECTIONS; i++) {
+        Connection *connection = &reactor->pool[i];
+        if (connection->socket >= 0 && connection->sending && (now - connection->sendingSince) * 1000 >= SEND_TIMEOUT) {
+            printf("Dropping client %s, which stopped reading its answers\n", connection->ip);
+            shutdown(connection->socket, SHUT_RDWR);
+            connection->sendingSince = now; // Once is enough
+        }
+    }
+}
+
+// Event loop of one ring-based reactor thread
+void *run_uring_reactor(void *arg) {
+    Reactor *reactor = arg;
+    time_t drainStarted = 0;
+    time_t lastSweep = 0;
+
+    uring_accept(reactor);
     while (1) {
-        Request request;
-        ssize_t bytes_received = recv(client_socket, &request, sizeof(request), 0);
+        // On shutdown or handoff cancel the accept and drain our connections
+        if ((shutdown_requested || handed_over) && reactor->listener >= 0) {
+            struct io_uring_sqe *sqe = ringGetSqe(&reactor->ring);
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = URING_ACCEPT;
+            sqe->user_data = URING_CANCEL;
+            ringSetFile(&reactor->ring, URING_LISTENER_SLOT, -1);
+            close(reactor->listener);
+            reactor->listener = -1;
+            drainStarted = time(NULL);
+        }
+        if (reactor->listener < 0) {
+            if (reactor->connectionCount == 0 && !reactor->accepting && reactor->syncing == NULL) {
+                break;
+            }
+            // Shutting the sockets down completes their receives, which closes them
+            if (shutdown_requested && drainExpired(drainStarted)) {
+                for (int i = 0; i < MAX_REACTOR_CONNECTIONS; i++) {
+                    if (reactor->pool[i].socket >= 0) {
+                        shutdown(reactor->pool[i].socket, SHUT_RDWR);
+                    }
+                }
+            }
+        }
 
-        if (bytes_received <= 0) {
-            printf("Client disconnected from child process %d\n", getpid());
-            break;
+        if (ringSubmit(&reactor->ring, 1, 1000) < 0 && errno != EAGAIN && errno != EBUSY) {
+            perror("io_uring_enter failed");
         }
 
-        // Update current account if available in the request
-        if (strlen(request.accountNumber) > 0) {
-            strncpy(current_account, request.accountNumber, ACC_NUM_LENGTH);
-            current_account[ACC_NUM_LENGTH] = '\0';
+        struct io_uring_cqe *cqe;
+        while ((cqe = ringPeek(&reactor->ring)) != NULL) {
+            unsigned long tag = cqe->user_data;
+            int result = cqe->res;
+            ringSeen(&reactor->ring);
+
+            if (tag == URING_ACCEPT) {
+                uring_accepted(reactor, result);
+            } else if (tag == URING_FSYNC) {
+                uring_synced(reactor, result);
+            } else if (tag != URING_CANCEL) {
+                uring_completed(reactor, (Connection *)tag, result);
+            }
         }
+        if (reactor->unsynced != NULL && reactor->syncing == NULL) {
+            uring_sync(reactor);
+        }
+        if (time(NULL) != lastSweep) {
+            lastSweep = time(NULL);
+            uring_drop_stalled(reactor);
+        }
+    }
 
-        printf("Processing request from client (PID: %d, Account: %s)\n", 
-               getpid(), current_account);
+    ringClose(&reactor->ring);
+    free(reactor->pool);
+    free(reactor->freeSlots);
+    return NULL;
+}
 
-        Response response = processRequest(&request);
-        send(client_socket, &response, sizeof(response), 0);
+// Serve with one reactor per core instead of a process per client. Every
+// reactor owns an SO_REUSEPORT listener, so accepts scale with the cores.
+int run_reactors(int reactor_count, char *argv[]) {
+    int cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (reactor_count <= 0) {
+        reactor_count = cores > 0 ? cores : 1;
+    }
+    // Every inherited listener needs a reactor, or its queued connections are lost
+    if (reactor_count < listener_count) {
+        reactor_count = listener_count;
+    }
+    if (reactor_count > MAX_REACTORS) {
+        reactor_count = MAX_REACTORS;
+    }
+    while (listener_count < reactor_count) {
+        listeners[listener_count++] = create_listener(server_port);
     }
 
-    close(client_socket);
-    exit(0); // Child process exits
+    Reactor *reactors = calloc(reactor_count, sizeof(Reactor));
+    for (int i = 0; i < reactor_count; i++) {
+        reactors[i].id = i;
+        reactors[i].listener = listeners[i];
+    }
+
+    // Older kernels, or ones with io_uring disabled, keep the epoll reactors
+    for (int i = 0; use_io_uring && i < reactor_count; i++) {
+        if (uring_setup(&reactors[i]) < 0) {
+            printf("io_uring unavailable (%s); using epoll reactors.\n", strerror(errno));
+            while (i-- > 0) {
+                ringClose(&reactors[i].ring);
+                free(reactors[i].pool);
+                free(reactors[i].freeSlots);
+                reactors[i].freeCount = 0;
+            }
+            use_io_uring = 0;
+        }
+    }
+
+    for (int i = 0; i < reactor_count && !use_io_uring; i++) {
+        reactors[i].epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (reactors[i].epoll_fd < 0) {
+            perror("epoll_create1 failed");
+            exit(EXIT_FAILURE);
+        }
+        fcntl(listeners[i], F_SETFL, fcntl(listeners[i], F_GETFL) | O_NONBLOCK);
+
+        struct epoll_event event = {0};
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        epoll_ctl(reactors[i].epoll_fd, EPOLL_CTL_ADD, listeners[i], &event);
+    }
+
+    // Connections queued by a previous process go to the first reactor
+    while (pending_count > 0) {
+        if (use_io_uring) {
+            uring_add_connection(&reactors[0], pending_clients[pending_head].socket, pending_clients[pending_head].ip);
+        } else {
+            add_connection(&reactors[0], pending_clients[pending_head].socket, pending_clients[pending_head].ip);
+        }
+        pending_head = (pending_head + 1) % MAX_PENDING_CLIENTS;
+        pending_count--;
+    }
+
+    for (int i = 0; i < reactor_count; i++) {
+        if (pthread_create(&reactors[i].thread, NULL, use_io_uring ? run_uring_reactor : run_reactor, &reactors[i]) != 0) {
+            perror("Reactor thread creation failed");
+            exit(EXIT_FAILURE);
+        }
+        if (cores > 0) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(i % cores, &cpus);
+            pthread_setaffinity_np(reactors[i].thread, sizeof(cpus), &cpus);
+        }
+    }
+
+    printf("Concurrent bank server running %d %s reactors on port %d...\n", reactor_count,
+           use_io_uring ? "io_uring" : "epoll", server_port);
+
+    while (!shutdown_requested && !handed_over) {
+        check_promotion();
+        if (restart_requested) {
+            handoff_to_successor(argv);
+            continue;
+        }
+        poll(NULL, 0, 1000);
+    }
+
+    if (handed_over) {
+        printf("Hot restart: handed over to the new server. Draining open connections.\n");
+    } else {
+        printf("Shutting down: draining open connections...\n");
+    }
+    for (int i = 0; i < reactor_count; i++) {
+        pthread_join(reactors[i].thread, NULL);
+    }
+    free(reactors);
+
+    // The store is shared, so only flush it if no successor has taken it over
+    if (!handed_over) {
+        saveAccountsToFile();
+    }
+    printf("Concurrent bank server shut down.\n");
+    return 0;
 }
 
-int main()
+void print_usage(const char *program) {
+    printf("Usage: %s [--reactors N [--io-uring]] [--no-rate-limit] [--port PORT] [--data FILE]\n", program);
+    printf("       [--fraud-rules FILE | --no-fraud-checks]\n");
+    printf("       [--replication-port PORT] [--replica-of HOST:PORT] [--cdc-port PORT]\n");
+    printf("       [--shards HOST:PORT,... --shard K [--cluster-secret SECRET]]\n");
+    printf("       [--tls-cert FILE --tls-key FILE]\n");
+    printf("  --reactors N              serve from N reactor threads (0 = one per core)\n");
+    printf("                            instead of forking a process per client\n");
+    printf("  --io-uring                run the reactors on io_uring, batching socket\n");
+    printf("                            I/O and operation log fsyncs into one system call\n");
+    printf("                            per loop; falls back to epoll on older kernels\n");
+    printf("  --no-rate-limit           disable per-address and per-account limits,\n");
+    printf("                            e.g. for load testing from one host\n");
+    printf("  --fraud-rules FILE        withdrawal velocity, amount and failed PIN\n");
+    printf("                            limits (see bank_fraud.h for the format)\n");
+    printf("  --no-fraud-checks         disable those limits\n");
+    printf("  --port PORT               serve clients on PORT (default %d)\n", PORT);
+    printf("  --data FILE               keep accounts in FILE and the operation log\n");
+    printf("                            in FILE%s (default %s)\n", LOG_FILE_SUFFIX, DATABASE_FILE);
+    printf("  --replication-port PORT   stream the operation log to replicas on PORT\n");
+    printf("  --replica-of HOST:PORT    run as a read-only replica of that primary's\n");
+    printf("                            replication port; SIGUSR1 promotes it. Both\n");
+    printf("                            need the primary's --cluster-secret\n");
+    printf("  --cdc-port PORT           stream committed account events to subscribers\n");
+    printf("                            on PORT (see bank_cdc.h for the protocol)\n");
+    printf("  --shards HOST:PORT,...    run as one shard of this cluster; accounts are\n");
+    printf("                            assigned by account number modulo the count,\n");
+    printf("                            and shards talk to each other on PORT+%d\n", SHARD_PEER_PORT_OFFSET);
+    printf("  --shard K                 index of this server in --shards (default 0)\n");
+    printf("  --cluster-secret SECRET   shared by all shards and replicas; enables\n");
+    printf("                            cross-shard transfers and replication\n");
+    printf("  --tls-cert FILE           serve clients over TLS with this PEM certificate\n");
+    printf("  --tls-key FILE            chain and key; forked children only, not reactors\n");
+}
+
+// bank_simulate.c includes this file and brings its own main
+#ifndef BANK_SIMULATE
+int main(int argc, char *argv[])
 {
-    srand(time(NULL));
+    int reactor_count = -1;
+    int rate_limit = 1;
+    int fraud_checks = 1;
+    FraudRules fraud_rules = DEFAULT_FRAUD_RULES;
+
+    static const struct option options[] = {
+        {"reactors", required_argument, NULL, 'r'},
+        {"io-uring", no_argument, NULL, 'u'},
+        {"no-rate-limit", no_argument, NULL, 'n'},
+        {"fraud-rules", required_argument, NULL, 'F'},
+        {"no-fraud-checks", no_argument, NULL, 'X'},
+        {"port", required_argument, NULL, 'p'},
+        {"data", required_argument, NULL, 'd'},
+        {"replication-port", required_argument, NULL, 'R'},
+        {"replica-of", required_argument, NULL, 'f'},
+        {"cdc-port", required_argument, NULL, 'C'},
+        {"shard", required_argument, NULL, 's'},
+        {"shards", required_argument, NULL, 'S'},
+        {"cluster-secret", required_argument, NULL, 'k'},
+        {"tls-cert", required_argument, NULL, 'T'},
+        {"tls-key", required_argument, NULL, 'K'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}};
+    int option;
+    char *separator;
+    int port_given = 0;
+    while ((option = getopt_long(argc, argv, "r:unF:Xp:d:R:f:C:s:S:k:T:K:h", options, NULL)) != -1) {
+        switch (option) {
+        case 'r':
+            reactor_count = atoi(optarg);
+            break;
+        case 'u':
+            use_io_uring = 1;
+            break;
+        case 'n':
+            rate_limit = 0;
+            break;
+        case 'F':
+            if (loadFraudRules(optarg, &fraud_rules) < 0) {
+                return 1;
+            }
+            break;
+        case 'X':
+            fraud_checks = 0;
+            break;
+        case 'p':
+            server_port = atoi(optarg);
+            port_given = 1;
+            break;
+        case 'd':
+            DATABASE_FILE = optarg;
+            break;
+        case 'R':
+            replication_port = atoi(optarg);
+            break;
+        case 'C':
+            cdc_port = atoi(optarg);
+            break;
+        case 'f':
+            separator = strrchr(optarg, ':');
+            if (separator == NULL || separator - optarg >= (long)sizeof(primary_host)) {
+                print_usage(argv[0]);
+                return 1;
+            }
+            memcpy(primary_host, optarg, separator - optarg);
+            primary_host[separator - optarg] = '\0';
+            primary_port = atoi(separator + 1);
+            break;
+        case 's':
+            shard_index = atoi(optarg);
+            break;
+        case 'S':
+            shard_count = parseShardList(optarg, shards, MAX_SHARDS);
+            if (shard_count < 1) {
+                fprintf(stderr, "Invalid shard list: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'k':
+            if (strlen(optarg) > MAX_NAME_LENGTH) {
+                fprintf(stderr, "Cluster secret is longer than %d characters.\n", MAX_NAME_LENGTH);
+                return 1;
+            }
+            cluster_secret = optarg;
+            break;
+        case 'T':
+            tls_cert_file = optarg;
+            break;
+        case 'K':
+            tls_key_file = optarg;
+            break;
+        default:
+            print_usage(argv[0]);
+            return option == 'h' ? 0 : 1;
+        }
+    }
+
+    if (use_io_uring && reactor_count < 0) {
+        reactor_count = 0;
+    }
+    if (shard_index < 0 || shard_index >= shard_count) {
+        fprintf(stderr, "Shard %d is not in the shard list.\n", shard_index);
+        return 1;
+    }
+    if (shard_count > 1 && !port_given) {
+        server_port = shards[shard_index].port;
+    }
+    // The replication stream holds every account, PIN hashes included
+    if ((replication_port > 0 || primary_host[0] != '\0') && cluster_secret == NULL) {
+        fprintf(stderr, "--replication-port and --replica-of need --cluster-secret.\n");
+        return 1;
+    }
+    if ((tls_cert_file == NULL) != (tls_key_file == NULL)) {
+        fprintf(stderr, "--tls-cert and --tls-key go together.\n");
+        return 1;
+    }
+    if (tls_cert_file != NULL) {
+#ifdef BANK_TLS
+        // The reactors would need a non-blocking handshake for every connection
+        if (reactor_count >= 0) {
+            fprintf(stderr, "TLS is only served by forked children; drop --reactors and --io-uring.\n");
+            return 1;
+        }
+        // Made before forking, so every child resumes the sessions of the others
+        tls_context = tlsServerContext(tls_cert_file, tls_key_file);
+        if (tls_context == NULL) {
+            return 1;
+        }
+#else
+        fprintf(stderr, "This server was built without TLS support (see BANK_TLS in the Makefile).\n");
+        return 1;
+#endif
+    }
 
     // Set up signal handler for child termination
     struct sigaction sa;
@@ -440,103 +4224,270 @@ int main()
     }
 
     // Initialize client tracking
-    for (int i = 0; i < 5; i++) {
+    for (int i = 0; i < MAX_CLIENTS; i++) {
         client_pids[i] = 0;
     }
     active_clients = 0;
 
-    // Load accounts from file at startup
-    loadAccountsFromFile();
+    // Rate limiters are shared with the children, so create them before forking
+    if (rate_limit) {
+        ip_limiter = createRateLimiter(IP_RATE, IP_BURST);
+        account_limiter = createRateLimiter(ACCOUNT_RATE, ACCOUNT_BURST);
+        pin_failure_limiter = createRateLimiter(PIN_FAILURE_RATE, PIN_FAILURE_BURST);
+        if (ip_limiter == NULL || account_limiter == NULL || pin_failure_limiter == NULL) {
+            perror("Rate limiter allocation failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+    dedup_table = createDedupTable();
+    if (dedup_table == NULL) {
+        perror("Dedup table allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    if (fraud_checks) {
+        fraud_monitor = createFraudMonitor(&fraud_rules);
+        if (fraud_monitor == NULL) {
+            perror("Fraud monitor allocation failed");
+            exit(EXIT_FAILURE);
+        }
+    }
 
-    int server_fd, new_socket;
-    struct sockaddr_in address;
-    int opt = 1;
-    int addrlen = sizeof(address);
+    installLifecycleHandlers();
+#ifdef BANK_TRACE
+    installTraceHandler();
+#endif
 
-    // Creating socket file descriptor
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0)
-    {
-        perror("Socket creation failed");
-        exit(EXIT_FAILURE);
+    struct sigaction promote;
+    promote.sa_handler = handle_sigusr1;
+    sigemptyset(&promote.sa_mask);
+    promote.sa_flags = 0;
+    sigaction(SIGUSR1, &promote, NULL);
+
+    // A hot restart passes in the account store, the listening sockets and
+    // queued connections; tell them apart by what kind of file they are
+    int handoff[HANDOFF_MAX_FDS];
+    int handoffCount = receiveHandoff(handoff, HANDOFF_MAX_FDS);
+    for (int i = 0; i < handoffCount; i++) {
+        struct stat st;
+        int listening = 0;
+        socklen_t length = sizeof(listening);
+
+        if (fstat(handoff[i], &st) == 0 && !S_ISSOCK(st.st_mode)) {
+            if (attachAccountStore(handoff[i]) < 0) {
+                printf("Previous account store has a different layout; loading from file.\n");
+                close(handoff[i]);
+            }
+        } else if (getsockopt(handoff[i], SOL_SOCKET, SO_ACCEPTCONN, &listening, &length) == 0 && listening) {
+            listeners[listener_count++] = handoff[i];
+        } else {
+            struct sockaddr_in peer;
+            socklen_t peer_size = sizeof(peer);
+            char peer_ip[INET_ADDRSTRLEN] = "unknown";
+            if (getpeername(handoff[i], (struct sockaddr *)&peer, &peer_size) == 0) {
+                inet_ntop(AF_INET, &peer.sin_addr, peer_ip, INET_ADDRSTRLEN);
+            }
+            queue_client(handoff[i], peer_ip);
+        }
     }
 
-    // Set socket options
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt)))
-    {
-        perror("Setsockopt failed");
+    unsigned long firstSequence, lastSequence;
+    snprintf(log_path, sizeof(log_path), "%s%s", DATABASE_FILE, LOG_FILE_SUFFIX);
+    log_fd = openOperationLog(log_path, &firstSequence, &lastSequence);
+    if (log_fd < 0) {
+        perror("Error opening operation log");
         exit(EXIT_FAILURE);
     }
 
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(PORT);
+    snprintf(archive_path, sizeof(archive_path), "%s%s", DATABASE_FILE, ARCHIVE_FILE_SUFFIX);
+    int resuming = store != NULL;
+    if (store == NULL) {
+        if (createAccountStore() < 0) {
+            perror("Account store allocation failed");
+            exit(EXIT_FAILURE);
+        }
 
-    // Bind socket to the address and port
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0)
-    {
-        perror("Bind failed");
-        exit(EXIT_FAILURE);
+        // Load accounts from file at startup
+        loadAccountsFromFile();
+        store->archivedCount = countAccountArchive(archive_path);
+        if (store->archivedCount < 0) {
+            perror(archive_path);
+            exit(EXIT_FAILURE);
+        }
+        resetAccountSequence();
+        store->firstSequence = firstSequence;
+        store->lastSequence = lastSequence;
+        store->readOnly = primary_host[0] != '\0';
+    } else {
+        printf("Took over the live account store (%d accounts).\n", store->accountCount);
     }
 
-    // Listen for connections
-    if (listen(server_fd, 5) < 0)
-    {
-        perror("Listen failed");
+    char schedule_path[512];
+    snprintf(schedule_path, sizeof(schedule_path), "%s%s", DATABASE_FILE, SCHEDULE_FILE_SUFFIX);
+    schedule = openSchedule(schedule_path, resuming, &schedule_fd);
+    if (schedule == NULL) {
+        fprintf(stderr, "Error opening standing orders %s: %s\n", schedule_path,
+                errno == EINVAL ? "written by a different server version" : strerror(errno));
         exit(EXIT_FAILURE);
     }
+    if (schedule->scheduled > 0) {
+        printf("%d standing orders scheduled.\n", schedule->scheduled);
+    }
 
-    printf("Concurrent bank server started on port %d...\n", PORT);
-    printf("Maximum clients allowed: 5\n");
+    int remembered = rebuildDedupTable();
+    if (remembered > 0) {
+        printf("%d recent request IDs recovered from the operation log.\n", remembered);
+    }
+    if (!resuming && !store->readOnly && shard_count > 1) {
+        int released = recover_transfers();
+        if (released > 0) {
+            printf("Gave back the funds of %d cross-shard transfers left undecided.\n", released);
+        }
+    }
 
-    // Server main loop
-    while (1)
-    {
-        printf("Waiting for connections... (Active clients: %d/5)\n", active_clients);
+    if (listener_count > 0) {
+        printf("Concurrent bank server took over from the previous process on port %d...\n", server_port);
+    } else {
+        listeners[listener_count++] = create_listener(server_port);
+        if (reactor_count < 0) {
+            printf("Concurrent bank server started on port %d...\n", server_port);
+        }
+    }
 
-        // Accept a new connection
-        if ((new_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t *)&addrlen)) < 0)
-        {
-            perror("Accept failed");
-            continue;
+    pthread_t thread;
+    pthread_create(&thread, NULL, run_scheduler, NULL);
+    pthread_detach(thread);
+    if (replication_port > 0) {
+        int listener = create_listener(replication_port);
+        pthread_create(&thread, NULL, run_replication_listener, (void *)(long)listener);
+        pthread_detach(thread);
+        printf("Streaming the operation log to replicas on port %d.\n", replication_port);
+    }
+    if (cdc_port > 0) {
+        int listener = create_listener(cdc_port);
+        pthread_create(&thread, NULL, run_cdc_listener, (void *)(long)listener);
+        pthread_detach(thread);
+        printf("Streaming committed events to subscribers on port %d.\n", cdc_port);
+    }
+    if (shard_count > 1) {
+        if (cluster_secret != NULL) {
+            int listener = create_listener(server_port + SHARD_PEER_PORT_OFFSET);
+            pthread_create(&thread, NULL, run_peer_listener, (void *)(long)listener);
+            pthread_detach(thread);
+            pthread_create(&thread, NULL, run_transfer_recovery, NULL);
+            pthread_detach(thread);
         }
+        printf("Serving shard %d of %d%s.\n", shard_index, shard_count,
+               cluster_secret != NULL ? "" : " (no cluster secret: transfers to other shards disabled)");
+    }
+    if (store->readOnly && primary_host[0] != '\0') {
+        // After a hot restart the store is current, so resume instead of resyncing
+        pthread_create(&thread, NULL, follow_primary, (void *)(long)resuming);
+        pthread_detach(thread);
+        printf("Running as a read-only replica of %s:%d.\n", primary_host, primary_port);
+    }
 
-        // Check if we can accept more clients
-        if (active_clients >= 5) {
-            printf("Maximum number of clients reached. Rejecting new connection.\n");
-            close(new_socket);
+    if (reactor_count >= 0) {
+        return run_reactors(reactor_count, argv);
+    }
+
+    printf("Maximum clients allowed: %d (plus %d queued)%s\n", MAX_CLIENTS, MAX_PENDING_CLIENTS,
+           tls_cert_file != NULL ? ", over TLS" : "");
+    printf("Waiting for connections...\n");
+
+    // Server main loop
+    while (!shutdown_requested && !handed_over)
+    {
+        check_promotion();
+        if (restart_requested) {
+            handoff_to_successor(argv);
             continue;
         }
 
-        // Create a child process to handle the client
-        pid_t pid = fork();
-        
-        if (pid < 0) {
-            perror("Fork failed");
-            close(new_socket);
+        dispatch_pending_clients();
+
+        // Wake up at least once a second to expire queued clients; a child
+        // exiting interrupts the poll so its slot is reused right away
+        struct pollfd ready[HANDOFF_MAX_FDS];
+        for (int i = 0; i < listener_count; i++) {
+            ready[i].fd = listeners[i];
+            ready[i].events = POLLIN;
+            ready[i].revents = 0;
+        }
+        if (poll(ready, listener_count, 1000) <= 0) {
             continue;
         }
-        
-        if (pid == 0) {
-            // Child process
-            close(server_fd); // Close the listening socket in the child
-            handle_client(new_socket);
-            // Child process exits in handle_client function
-        } else {
-            // Parent process
-            close(new_socket); // Close the client socket in the parent
-            
-            // Add child to our tracking array
-            for (int i = 0; i < 5; i++) {
-                if (client_pids[i] == 0) {
-                    client_pids[i] = pid;
-                    active_clients++;
-                    printf("New client connected. Active clients: %d/5\n", active_clients);
-                    break;
+
+        for (int i = 0; i < listener_count; i++) {
+            if (!(ready[i].revents & POLLIN)) {
+                continue;
+            }
+
+            // Accept a new connection
+            struct sockaddr_in address;
+            socklen_t addrlen = sizeof(address);
+            int new_socket = accept4(listeners[i], (struct sockaddr *)&address, &addrlen, SOCK_CLOEXEC);
+            if (new_socket < 0)
+            {
+                if (errno != EINTR && errno != EAGAIN) {
+                    perror("Accept failed");
                 }
+                continue;
             }
+
+            char client_ip[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &address.sin_addr, client_ip, INET_ADDRSTRLEN);
+
+            int retryAfter = rateLimitAcquire(ip_limiter, client_ip, 1);
+            if (retryAfter > 0) {
+                printf("Too many connections from %s. Rejecting new connection.\n", client_ip);
+                reject_client(new_socket, "Error: Too many connections from your address. Please retry later.", retryAfter);
+                continue;
+            }
+
+            // Serve right away when a slot is free and nobody is waiting ahead
+            if (active_clients < MAX_CLIENTS && pending_count == 0) {
+                if (spawn_client(new_socket) < 0) {
+                    reject_client(new_socket, "Error: Server busy. Please try again later.", 1);
+                }
+                continue;
+            }
+
+            // Otherwise queue the connection, or refuse it when the queue is full
+            if (queue_client(new_socket, client_ip) < 0) {
+                printf("Maximum number of clients reached. Rejecting new connection.\n");
+                reject_client(new_socket, "Error: Server busy. Please try again later.", PENDING_TIMEOUT);
+                continue;
+            }
+            printf("All %d client slots busy. Queued connection from %s (%d waiting).\n",
+                   MAX_CLIENTS, client_ip, pending_count);
         }
     }
 
-    close(server_fd);
+    // Stop accepting and turn away anyone still queued
+    for (int i = 0; i < listener_count; i++) {
+        close(listeners[i]);
+    }
+    while (pending_count > 0) {
+        reject_client(pending_clients[pending_head].socket, "Error: Server is shutting down. Please try again later.", 1);
+        pending_head = (pending_head + 1) % MAX_PENDING_CLIENTS;
+        pending_count--;
+    }
+
+    if (handed_over) {
+        // Existing sessions keep running on the shared store; the
+        // successor owns persistence from here on
+        printf("Hot restart: handed over to the new server. Waiting for %d active clients.\n", active_clients);
+        wait_for_children(1);
+        printf("Previous server exiting.\n");
+        return 0;
+    }
+
+    printf("Shutting down: draining %d active clients...\n", active_clients);
+    wait_for_children(1);
+
+    // The store is shared with the children, so it is current here
+    saveAccountsToFile();
+    printf("Concurrent bank server shut down.\n");
     return 0;
-}
\ No newline at end of file
+}
+#endif // BANK_SIMULATE
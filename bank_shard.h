@@ -0,0 +1,96 @@
+// Account sharding shared by the cluster servers and the routing client
+
+#ifndef BANK_SHARD_H
+#define BANK_SHARD_H
+
+#include <netdb.h>
+#include "bank_common.h"
+
+#define MAX_SHARDS 16
+#define SHARD_HOST_LENGTH 256
+#define SHARD_PEER_PORT_OFFSET 1000 // Shards reach each other on their client port plus this
+
+typedef struct
+{
+    char host[SHARD_HOST_LENGTH];
+    int port;
+} ShardAddress;
+
+// Parse a comma-separated host:port list. Returns the number of shards, or
+// -1 when the list is malformed.
+int parseShardList(const char *list, ShardAddress *shards, int maxShards)
+{
+    int count = 0;
+    while (*list != '\0')
+    {
+        const char *end = strchr(list, ',');
+        size_t length = end != NULL ? (size_t)(end - list) : strlen(list);
+        const char *separator = memchr(list, ':', length);
+        if (count == maxShards || separator == NULL || separator == list ||
+            (size_t)(separator - list) >= SHARD_HOST_LENGTH)
+        {
+            return -1;
+        }
+
+        memcpy(shards[count].host, list, separator - list);
+        shards[count].host[separator - list] = '\0';
+        shards[count].port = atoi(separator + 1);
+        if (shards[count].port <= 0)
+        {
+            return -1;
+        }
+        count++;
+
+        list += length;
+        if (*list == ',')
+        {
+            list++;
+        }
+    }
+    return count;
+}
+
+// Each shard hands out the account sequence numbers congruent to its index
+// modulo the shard count, so routing needs no lookup table. The sequence
+// is the account number without its check digit.
+int shardForAccount(const char *accountNumber, int shardCount)
+{
+    return (int)(strtoull(accountNumber, NULL, 10) / 10 % shardCount);
+}
+
+// New accounts go to the shard chosen by the customer's national ID
+int shardForNationalID(const char *nationalID, int shardCount)
+{
+    unsigned long hash = 14695981039346656037UL;
+    for (; *nationalID; nationalID++)
+    {
+        hash = (hash ^ (unsigned char)*nationalID) * 1099511628211UL;
+    }
+    return (int)(hash % shardCount);
+}
+
+// Connect to host:port. Returns the socket, or -1.
+int connectTo(const char *host, int port)
+{
+    char service[16];
+    struct addrinfo hints = {0};
+    struct addrinfo *addresses;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(host, service, &hints, &addresses) != 0)
+    {
+        return -1;
+    }
+
+    int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock >= 0 && connect(sock, addresses->ai_addr, addresses->ai_addrlen) < 0)
+    {
+        close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(addresses);
+    return sock;
+}
+
+#endif // BANK_SHARD_H
@@ -0,0 +1,830 @@
+// Deterministic simulation of the concurrent server's account logic, and a
+// libFuzzer target for its request decoding. Both serve requests in this
+// process through answer_request, against a store and files of their own.
+//
+// The simulation runs seeded random operation sequences and checks every
+// answer and the whole store against a model of the accounts after each
+// step. At the crash point between changing an account and saving it,
+// it may stop the server as a crash would and restart it from its files,
+// then retry the way bank_client does. Invariants: money is neither created
+// nor lost, open accounts keep MIN_BALANCE, a change is saved whole or not
+// at all, acknowledged changes survive restarts, retries apply once, and
+// the slot and customer indexes agree with the table.
+//
+// Built with -DBANK_FUZZ and clang -fsanitize=fuzzer, the file is the fuzz
+// target instead; bank_simulate --replay runs the inputs it reports.
+
+#define BANK_SIMULATE
+#define PIN_HASH_ITERATIONS 1 // The simulated files are never served for real
+#define SIMULATE_CRASH_POINT() simulateCrashPoint()
+
+void simulateCrashPoint(void);
+
+#include "bank_server_concurrent.c"
+#include <limits.h>
+#include <setjmp.h>
+#include <stdarg.h>
+
+#define SIM_DEFAULT_OPERATIONS 100000
+#define SIM_DEFAULT_CRASH_ONE_IN 50 // Crash at one crash point in this many
+#define SIM_RESTART_EVERY 1000      // Operations between clean restarts
+#define SIM_COMPACT_EVERY 250       // Operations between archiving closed accounts
+#define SIM_CUSTOMERS 8             // National IDs accounts are opened under
+#define SIM_MAX_RETRIES 10          // Crashes a retried request may run into
+#define SIM_FUZZ_ACCOUNTS 4         // Accounts every fuzz input starts with,
+#define SIM_FUZZ_PIN "123456"       // all with this PIN
+
+// What the model knows about an account: what a client was told, and what
+// the server must therefore still hold
+typedef struct
+{
+    char accountNumber[ACC_NUM_LENGTH + 1];
+    char pin[PIN_LENGTH + 1];
+    char nationalID[ID_LENGTH + 1];
+    double balance;
+    int isActive;
+} SimAccount;
+
+typedef struct
+{
+    SimAccount accounts[MAX_ACCOUNTS]; // Closed ones are reused for new accounts
+    int count;
+    double ledger; // Money paid in minus money paid out, over all time
+} SimModel;
+
+typedef struct
+{
+    unsigned long operations;
+    unsigned long crashes;
+    unsigned long restarts;
+    unsigned long compactions;
+} SimStats;
+
+char sim_dir[256];
+unsigned long sim_seed;
+unsigned long sim_operation;
+unsigned long sim_crash_one_in = SIM_DEFAULT_CRASH_ONE_IN;
+uint64_t sim_crash_random;
+int sim_crash_armed = 0;
+int sim_fuzzing = 0;
+int sim_verbose = 0;
+jmp_buf sim_crash;
+CredentialCache sim_credentials;
+
+// splitmix64: small, fast, and the same sequence on every platform
+uint64_t simulateRandom(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+void simulateFail(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    if (sim_fuzzing)
+    {
+        fprintf(stderr, "Invariant broken: ");
+    }
+    else
+    {
+        fprintf(stderr, "Seed %lu, operation %lu: ", sim_seed, sim_operation);
+    }
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    if (sim_fuzzing)
+    {
+        abort();
+    }
+    fprintf(stderr, "Rerun with --seed %lu --operations %lu --verbose to see how it got there.\n", sim_seed,
+            sim_operation);
+    exit(1);
+}
+
+// Stop here as a crash would, sometimes. Called before a changed account
+// is saved.
+void simulateCrashPoint(void)
+{
+    if (sim_crash_armed && simulateRandom(&sim_crash_random) % sim_crash_one_in == 0)
+    {
+        sim_crash_armed = 0;
+        longjmp(sim_crash, 1);
+    }
+}
+
+// Bring the server up from its files, as main does on a cold start
+void simulateStart(void)
+{
+    unsigned long firstSequence, lastSequence;
+    char schedule_path[512];
+    snprintf(schedule_path, sizeof(schedule_path), "%s%s", DATABASE_FILE, SCHEDULE_FILE_SUFFIX);
+    log_fd = openOperationLog(log_path, &firstSequence, &lastSequence);
+    dedup_table = createDedupTable();
+    if (log_fd < 0 || dedup_table == NULL || createAccountStore() < 0)
+    {
+        perror("Simulated server");
+        exit(2);
+    }
+    loadAccountsFromFile();
+    store->archivedCount = countAccountArchive(archive_path);
+    resetAccountSequence();
+    store->firstSequence = firstSequence;
+    store->lastSequence = lastSequence;
+    schedule = openSchedule(schedule_path, 0, &schedule_fd);
+    if (schedule == NULL)
+    {
+        perror(schedule_path);
+        exit(2);
+    }
+    rebuildDedupTable();
+
+    // The client reconnects, so it has to prove its PINs again
+    credentialCacheInit(&sim_credentials);
+}
+
+// Drop everything the process held; only its files remain
+void simulateStop(void)
+{
+    munmap(store, sizeof(AccountStore));
+    close(store_fd);
+    store = NULL;
+    memset(held_accounts, 0, sizeof(held_accounts)); // A crash leaves them locked
+    munmap(dedup_table, sizeof(DedupTable));
+    munmap(schedule, sizeof(Schedule));
+    close(schedule_fd);
+    close(log_fd);
+}
+
+void simulateRestart(SimStats *stats)
+{
+    simulateStop();
+    simulateStart();
+    stats->restarts++;
+}
+
+void simulateRemoveFiles(void)
+{
+    const char *suffixes[] = {"", LOG_FILE_SUFFIX, ARCHIVE_FILE_SUFFIX, SCHEDULE_FILE_SUFFIX, STORAGE_TEMP_SUFFIX};
+    char path[600];
+    for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++)
+    {
+        snprintf(path, sizeof(path), "%s%s", DATABASE_FILE, suffixes[i]);
+        unlink(path);
+    }
+}
+
+// Remove the files and directory of a run that passed
+void simulateCleanup(void)
+{
+    simulateStop();
+    simulateRemoveFiles();
+    rmdir(sim_dir);
+}
+
+// Start over with no accounts. The first call makes the directory.
+void simulateReset(int running)
+{
+    static char database[sizeof(sim_dir) + 32];
+
+    if (running)
+    {
+        simulateStop();
+    }
+    if (sim_dir[0] == '\0')
+    {
+        snprintf(sim_dir, sizeof(sim_dir), "%s/bank_simulate.XXXXXX", access("/dev/shm", W_OK) == 0 ? "/dev/shm" : "/tmp");
+        if (mkdtemp(sim_dir) == NULL)
+        {
+            perror(sim_dir);
+            exit(2);
+        }
+    }
+    snprintf(database, sizeof(database), "%s/bank_data.dat", sim_dir);
+    DATABASE_FILE = database;
+    snprintf(log_path, sizeof(log_path), "%s%s", DATABASE_FILE, LOG_FILE_SUFFIX);
+    snprintf(archive_path, sizeof(archive_path), "%s%s", DATABASE_FILE, ARCHIVE_FILE_SUFFIX);
+    simulateRemoveFiles();
+    saveAccountFile(DATABASE_FILE, NULL, 0);
+    simulateStart();
+}
+
+// Serve one request as a connection would, taking the records sent after
+// the response too. Returns 1 if the server crashed serving it.
+int simulateServe(const Request *request, Response *response, int crashes)
+{
+    Request copy = *request;
+    ResponsePayload payload;
+    volatile unsigned char sink = 0;
+
+    if (setjmp(sim_crash) != 0)
+    {
+        return 1;
+    }
+    sim_crash_armed = crashes;
+    *response = answer_request("127.0.0.1", &copy, &sim_credentials, &payload);
+    sim_crash_armed = 0;
+
+    for (int i = 0; i < payload.iovcnt; i++)
+    {
+        const unsigned char *bytes = payload.iov[i].iov_base;
+        for (size_t j = 0; j < payload.iov[i].iov_len; j++)
+        {
+            sink ^= bytes[j];
+        }
+    }
+    return 0;
+}
+
+// Money in every account the table holds, open or closed
+double simulateStoreTotal(void)
+{
+    double total = 0;
+    for (int i = 0; i < store->accountCount; i++)
+    {
+        if (store->accounts[i].accountNumber[0] != '\0')
+        {
+            total += store->accounts[i].balance;
+        }
+    }
+    return total;
+}
+
+// Check what holds for any store: open accounts keep the minimum balance,
+// and every slot is where the indexes say it is
+void simulateCheckStore(void)
+{
+    int customerSlots[MAX_ACCOUNTS];
+    for (int i = 0; i < store->accountCount; i++)
+    {
+        const Account *account = &store->accounts[i];
+        if (account->accountNumber[0] == '\0')
+        {
+            continue;
+        }
+        if (slotsFind(&store->slots, store->accounts, account->accountNumber) != i)
+        {
+            simulateFail("slot %d (%s) is missing from the slot index", i, account->accountNumber);
+        }
+        if (account->isActive && account->balance < MIN_BALANCE)
+        {
+            simulateFail("%s holds %.2f, below the minimum balance", account->accountNumber, account->balance);
+        }
+        if (account->isActive && account->nationalID[0] != '\0')
+        {
+            int found = customerIndexFind(&store->customers, store->accounts, account->nationalID, customerSlots,
+                                          MAX_ACCOUNTS);
+            int listed = 0;
+            for (int j = 0; j < found && j < MAX_ACCOUNTS; j++)
+            {
+                listed |= customerSlots[j] == i;
+            }
+            if (!listed)
+            {
+                simulateFail("%s is missing from the customer index", account->accountNumber);
+            }
+        }
+    }
+}
+
+// Does the store hold exactly the model's open accounts, with the model's
+// balances? Returns NULL, or what differs.
+const char *simulateCompare(const SimModel *model)
+{
+    static char difference[200];
+    int active = 0;
+    for (int i = 0; i < store->accountCount; i++)
+    {
+        active += store->accounts[i].accountNumber[0] != '\0' && store->accounts[i].isActive;
+    }
+
+    for (int i = 0; i < model->count; i++)
+    {
+        const SimAccount *expected = &model->accounts[i];
+        int slot = slotsFind(&store->slots, store->accounts, expected->accountNumber);
+        const Account *account = slot >= 0 ? &store->accounts[slot] : NULL;
+        if (expected->isActive && (account == NULL || !account->isActive))
+        {
+            snprintf(difference, sizeof(difference), "open account %s is gone", expected->accountNumber);
+            return difference;
+        }
+        if (expected->isActive && account->balance != expected->balance)
+        {
+            snprintf(difference, sizeof(difference), "%s holds %.2f instead of %.2f", expected->accountNumber,
+                     account->balance, expected->balance);
+            return difference;
+        }
+        if (!expected->isActive && account != NULL && account->isActive)
+        {
+            snprintf(difference, sizeof(difference), "closed account %s is open", expected->accountNumber);
+            return difference;
+        }
+        active -= expected->isActive;
+    }
+    if (active != 0)
+    {
+        snprintf(difference, sizeof(difference), "%d open accounts the model does not know", active);
+        return difference;
+    }
+    return NULL;
+}
+
+void simulateCheck(const SimModel *model, const char *when)
+{
+    simulateCheckStore();
+    const char *difference = simulateCompare(model);
+    if (difference != NULL)
+    {
+        simulateFail("%s: %s", when, difference);
+    }
+
+    double total = 0;
+    for (int i = 0; i < model->count; i++)
+    {
+        total += model->accounts[i].isActive ? model->accounts[i].balance : 0;
+    }
+    if (total != model->ledger)
+    {
+        simulateFail("open accounts hold %.2f but %.2f was paid in", total, model->ledger);
+    }
+}
+
+SimAccount *simulatePick(SimModel *model, uint64_t *random)
+{
+    return model->count > 0 ? &model->accounts[simulateRandom(random) % model->count] : NULL;
+}
+
+// Fill in a request for an account the model knows, or for none
+void simulateRequest(Request *request, RequestType type, const SimAccount *account, double amount)
+{
+    memset(request, 0, sizeof(*request));
+    request->type = type;
+    request->amount = amount;
+    if (account != NULL)
+    {
+        strcpy(request->accountNumber, account->accountNumber);
+        strcpy(request->pin, account->pin);
+    }
+}
+
+// Pick, send and check one random operation, crashing the server now and
+// then while it is being served
+void simulateOperation(SimModel *model, uint64_t *random, SimStats *stats)
+{
+    static Request lastRequest;  // Last deposit or withdrawal that succeeded,
+    static Response lastAnswer;  // to send again as a retry
+    static int haveLast = 0;
+    SimModel after = *model;
+    Request request;
+    Response response;
+    SimAccount *account = simulatePick(model, random);
+    SimAccount *target = simulatePick(model, random);
+    SimAccount *changed = account != NULL ? &after.accounts[account - model->accounts] : NULL;
+    int pick = simulateRandom(random) % 100;
+    int expected = 0;
+    int retryable = 0;
+    int retry = 0;
+    double amount;
+
+    if (sim_operation == 1)
+    {
+        haveLast = 0;
+    }
+
+    if (pick < 10 || account == NULL)
+    {
+        // Sometimes too small a first deposit
+        amount = simulateRandom(random) % 10 == 0 ? MIN_BALANCE - 100 : MIN_BALANCE + 100 * (simulateRandom(random) % 50);
+        simulateRequest(&request, OPEN_ACCOUNT, NULL, amount);
+        strcpy(request.name, "Simulated Customer");
+        snprintf(request.nationalID, sizeof(request.nationalID), "SIM%d", (int)(simulateRandom(random) % SIM_CUSTOMERS));
+        request.accountType = simulateRandom(random) % 2 ? SAVINGS : CHECKING;
+        expected = amount >= MIN_BALANCE && !accountTableFull();
+        account = changed = NULL;
+    }
+    else if (pick < 15)
+    {
+        simulateRequest(&request, CLOSE_ACCOUNT, account, 0);
+        expected = account->isActive;
+        if (expected)
+        {
+            changed->isActive = 0;
+            after.ledger -= account->balance;
+        }
+    }
+    else if (pick < 35)
+    {
+        // Mostly whole units, sometimes too small or not a whole unit
+        int kind = simulateRandom(random) % 10;
+        amount = kind == 0 ? MIN_TRANSACTION / 5 : kind == 1 ? MIN_TRANSACTION * 1.5 : MIN_TRANSACTION * (1 + simulateRandom(random) % 6);
+        simulateRequest(&request, WITHDRAW, account, amount);
+        request.requestId = simulateRandom(random) | 1;
+        expected = account->isActive && amount >= MIN_TRANSACTION && (long)amount % MIN_TRANSACTION == 0 &&
+                   account->balance - amount >= MIN_BALANCE;
+        retryable = 1;
+        if (expected)
+        {
+            changed->balance -= amount;
+            after.ledger -= amount;
+        }
+    }
+    else if (pick < 55)
+    {
+        amount = simulateRandom(random) % 10 == 0 ? MIN_TRANSACTION - 50 : MIN_TRANSACTION + 50 * (simulateRandom(random) % 40);
+        simulateRequest(&request, DEPOSIT_FUNDS, account, amount);
+        request.requestId = simulateRandom(random) | 1;
+        expected = account->isActive && amount >= MIN_TRANSACTION;
+        retryable = 1;
+        if (expected)
+        {
+            changed->balance += amount;
+            after.ledger += amount;
+        }
+    }
+    else if (pick < 70)
+    {
+        amount = MIN_TRANSACTION * (1 + simulateRandom(random) % 4);
+        simulateRequest(&request, TRANSFER, account, amount);
+        strcpy(request.targetAccount, target->accountNumber);
+        expected = account->isActive && target->isActive && account != target && account->balance - amount >= MIN_BALANCE;
+        if (expected)
+        {
+            changed->balance -= amount;
+            after.accounts[target - model->accounts].balance += amount;
+        }
+    }
+    else if (pick < 80)
+    {
+        simulateRequest(&request, CHECK_BALANCE, account, 0);
+        expected = account->isActive;
+    }
+    else if (pick < 85)
+    {
+        simulateRequest(&request, GET_STATEMENT, account, 0);
+        request.pageSize = simulateRandom(random) % 2 ? 0 : 1 + simulateRandom(random) % MAX_STATEMENT_PAGE;
+        expected = account->isActive;
+    }
+    else if (pick < 90)
+    {
+        simulateRequest(&request, LIST_ACCOUNTS, account, 0);
+        expected = account->isActive;
+    }
+    else if (pick < 95 && haveLast)
+    {
+        // The same deposit or withdrawal again: answered, not applied
+        request = lastRequest;
+        SimAccount *owner = NULL;
+        for (int i = 0; i < model->count; i++)
+        {
+            if (strcmp(model->accounts[i].accountNumber, request.accountNumber) == 0)
+            {
+                owner = &model->accounts[i];
+            }
+        }
+        expected = owner != NULL && owner->isActive;
+        account = owner;
+        retry = 1;
+    }
+    else if (pick < 98)
+    {
+        // A wrong PIN changes nothing
+        simulateRequest(&request, WITHDRAW, account, MIN_TRANSACTION);
+        request.pin[0] = request.pin[0] == '9' ? '0' : request.pin[0] + 1;
+        request.requestId = simulateRandom(random) | 1;
+    }
+    else
+    {
+        // No such account, or no such request type
+        simulateRequest(&request, CHECK_BALANCE, NULL, 0);
+        if (pick == 98)
+            strcpy(request.accountNumber, "0000000000");
+        else
+            request.type = INVALID_REQUEST + simulateRandom(random) % 4;
+    }
+
+    if (sim_verbose)
+    {
+        fprintf(stderr, "%lu: type %d account %s target %s amount %.2f id %lx, expecting %s\n", sim_operation,
+                request.type, request.accountNumber, request.targetAccount, request.amount, request.requestId,
+                expected ? "success" : "failure");
+    }
+
+    // Crash now and then; a client retries deposits and withdrawals with the
+    // same request ID after reconnecting, and gives up on anything else
+    int crashed = simulateServe(&request, &response, 1);
+    for (int attempt = 0; crashed; attempt++)
+    {
+        stats->crashes++;
+        simulateRestart(stats);
+        const char *before = simulateCompare(model);
+        const char *whole = expected && request.type != OPEN_ACCOUNT ? simulateCompare(&after) : "";
+        if (before != NULL && whole != NULL)
+        {
+            simulateFail("crash left a partial change: %s", before);
+        }
+        if (before != NULL)
+        {
+            *model = after;
+        }
+        if (sim_verbose)
+        {
+            fprintf(stderr, "%lu: crashed; the change was %s\n", sim_operation, before == NULL ? "lost" : "saved");
+        }
+        simulateCheck(model, "after a crash");
+        if (!retryable || attempt == SIM_MAX_RETRIES)
+        {
+            return;
+        }
+        crashed = simulateServe(&request, &response, 1);
+    }
+
+    if (response.success != expected)
+    {
+        simulateFail("type %d on %s %s: %s", request.type, request.accountNumber,
+                     expected ? "failed" : "succeeded", response.message);
+    }
+    if (retry && expected && response.balance != lastAnswer.balance)
+    {
+        simulateFail("a retry of request %lx was answered with %.2f, first %.2f", request.requestId, response.balance,
+                     lastAnswer.balance);
+    }
+    if (response.success)
+    {
+        if (request.type == OPEN_ACCOUNT)
+        {
+            // Reuse the entry of a closed account, if the model is full
+            int entry = after.count;
+            for (int i = 0; entry == MAX_ACCOUNTS && i < after.count; i++)
+            {
+                entry = after.accounts[i].isActive ? entry : i;
+            }
+            if (entry == MAX_ACCOUNTS)
+            {
+                simulateFail("opened account %s with every slot in use", response.accountNumber);
+            }
+            SimAccount *opened = &after.accounts[entry];
+            strcpy(opened->accountNumber, response.accountNumber);
+            strcpy(opened->pin, response.pin);
+            strcpy(opened->nationalID, request.nationalID);
+            opened->balance = request.amount;
+            opened->isActive = 1;
+            after.ledger += request.amount;
+            after.count += entry == after.count;
+        }
+        if ((request.type == WITHDRAW || request.type == DEPOSIT_FUNDS) && account != NULL && !retry)
+        {
+            lastRequest = request;
+            lastAnswer = response;
+            haveLast = 1;
+        }
+        if (request.type == LIST_ACCOUNTS)
+        {
+            int owned = 0;
+            for (int i = 0; i < model->count; i++)
+            {
+                owned += model->accounts[i].isActive && strcmp(model->accounts[i].nationalID, account->nationalID) == 0;
+            }
+            if (response.accountCount != owned)
+            {
+                simulateFail("%s's customer has %d accounts, %d listed", account->accountNumber, owned,
+                             response.accountCount);
+            }
+        }
+        if (request.type != OPEN_ACCOUNT && request.type != CLOSE_ACCOUNT && request.type != LIST_ACCOUNTS && !retry &&
+            response.balance != changed->balance)
+        {
+            simulateFail("type %d on %s answered balance %.2f, expected %.2f", request.type, request.accountNumber,
+                         response.balance, changed->balance);
+        }
+        *model = after;
+    }
+    simulateCheck(model, "after the answer");
+}
+
+// Run one seeded sequence of operations. Returns 0; a broken invariant
+// exits.
+int simulateSeed(unsigned long seed, unsigned long operations, SimStats *stats)
+{
+    static SimModel model;
+    uint64_t random = seed;
+    memset(&model, 0, sizeof(model));
+    sim_seed = seed;
+    sim_crash_random = seed ^ 0x5bd1e995;
+    simulateReset(store != NULL);
+
+    for (sim_operation = 1; sim_operation <= operations; sim_operation++)
+    {
+        simulateOperation(&model, &random, stats);
+        stats->operations++;
+
+        // What was acknowledged must be in the files
+        if (sim_operation % SIM_RESTART_EVERY == 0)
+        {
+            simulateRestart(stats);
+            simulateCheck(&model, "after a restart");
+        }
+        if (sim_operation % SIM_COMPACT_EVERY == 0 || accountTableFull())
+        {
+            stats->compactions += compact_closed_accounts() > 0;
+            simulateCheck(&model, "after compaction");
+        }
+    }
+    return 0;
+}
+
+// Decode data as the stream of requests a connection would carry and
+// serve each against a fresh store. Beyond what holds for any store, a
+// request may only add or take away the money it names.
+int simulateWireInput(const uint8_t *data, size_t size)
+{
+    simulateReset(store != NULL);
+
+    // The first SIM_FUZZ_ACCOUNTS account numbers, all with a known PIN, so
+    // inputs can get past the PIN check
+    for (int i = 0; i < SIM_FUZZ_ACCOUNTS; i++)
+    {
+        Request request;
+        Response response;
+        simulateRequest(&request, OPEN_ACCOUNT, NULL, MIN_BALANCE * (i + 1));
+        strcpy(request.name, "Fuzzed Customer");
+        strcpy(request.nationalID, i % 2 ? "SIM1" : "SIM0");
+        simulateServe(&request, &response, 0);
+        int slot = slotsFind(&store->slots, store->accounts, response.accountNumber);
+        if (slot < 0)
+        {
+            simulateFail("could not open account %d: %s", i + 1, response.message);
+        }
+        setAccountPIN(&store->accounts[slot], SIM_FUZZ_PIN);
+    }
+
+    for (size_t offset = 0; offset + sizeof(Request) <= size; offset += sizeof(Request))
+    {
+        Request request;
+        Response response;
+        memcpy(&request, data + offset, sizeof(request));
+        double before = simulateStoreTotal();
+        simulateServe(&request, &response, 0);
+        simulateCheckStore();
+        if (sim_verbose)
+        {
+            fprintf(stderr, "type %d account %.*s amount %.2f: %s\n", request.type, ACC_NUM_LENGTH,
+                    request.accountNumber, request.amount, response.message);
+        }
+
+        // Totals are summed in a different order, so allow for rounding
+        double change = simulateStoreTotal() - before;
+        double named = request.type == WITHDRAW ? -request.amount : request.amount;
+        double error = change > named ? change - named : named - change;
+        int paysInOrOut = request.type == OPEN_ACCOUNT || request.type == DEPOSIT_FUNDS || request.type == WITHDRAW;
+        if (change != 0 && !(response.success && paysInOrOut && error <= 1e-9 * (before > 0 ? before : 1)))
+        {
+            simulateFail("request type %d for %.2f changed the money held by %.2f", request.type, request.amount, change);
+        }
+    }
+    return 0;
+}
+
+#ifdef BANK_FUZZ
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    if (!sim_fuzzing)
+    {
+        sim_fuzzing = 1;
+        if (freopen("/dev/null", "w", stdout) == NULL)
+        {
+            return 0;
+        }
+    }
+    return simulateWireInput(data, size);
+}
+
+#else
+
+// Feed a file to the fuzz target's decoder, such as a crash libFuzzer found
+int replayInput(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+    static uint8_t data[1 << 20];
+    size_t size = fread(data, 1, sizeof(data), file);
+    fclose(file);
+    sim_fuzzing = 1;
+    return simulateWireInput(data, size);
+}
+
+void printUsage(const char *program)
+{
+    printf("Usage: %s [--seed N] [--seeds COUNT] [--operations N] [--crash-one-in N] [--verbose]\n", program);
+    printf("       %s --replay FILE...\n", program);
+    printf("  --seed N            first seed to run (default 1); a seed always runs\n");
+    printf("                      the same operations\n");
+    printf("  --seeds COUNT       run COUNT seeds from there, each from an empty store\n");
+    printf("  --operations N      operations per seed (default %d)\n", SIM_DEFAULT_OPERATIONS);
+    printf("  --crash-one-in N    crash at one in N crash points (default %d, 0 never)\n", SIM_DEFAULT_CRASH_ONE_IN);
+    printf("  --verbose           print every operation to standard error\n");
+    printf("  --replay FILE...    serve each file as a stream of requests, as the\n");
+    printf("                      fuzz target does\n");
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long seed = 1;
+    unsigned long seeds = 1;
+    unsigned long operations = SIM_DEFAULT_OPERATIONS;
+    int replay = 0;
+
+    static const struct option options[] = {
+        {"seed", required_argument, NULL, 's'},
+        {"seeds", required_argument, NULL, 'n'},
+        {"operations", required_argument, NULL, 'o'},
+        {"crash-one-in", required_argument, NULL, 'c'},
+        {"verbose", no_argument, NULL, 'v'},
+        {"replay", no_argument, NULL, 'r'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}};
+    int option;
+    while ((option = getopt_long(argc, argv, "s:n:o:c:vrh", options, NULL)) != -1)
+    {
+        switch (option)
+        {
+        case 's':
+            seed = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            seeds = strtoul(optarg, NULL, 10);
+            break;
+        case 'o':
+            operations = strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            sim_crash_one_in = strtoul(optarg, NULL, 10);
+            break;
+        case 'v':
+            sim_verbose = 1;
+            break;
+        case 'r':
+            replay = 1;
+            break;
+        default:
+            printUsage(argv[0]);
+            return option == 'h' ? 0 : 1;
+        }
+    }
+    if (replay == (optind == argc))
+    {
+        printUsage(argv[0]);
+        return 1;
+    }
+    if (sim_crash_one_in == 0)
+    {
+        sim_crash_one_in = ULONG_MAX;
+    }
+
+    // The server reports every save; only the results matter here
+    FILE *report = fdopen(dup(STDOUT_FILENO), "w");
+    if (report == NULL || freopen("/dev/null", "w", stdout) == NULL)
+    {
+        perror("stdout");
+        return 2;
+    }
+
+    if (replay)
+    {
+        for (int i = optind; i < argc; i++)
+        {
+            if (replayInput(argv[i]) < 0)
+            {
+                return 1;
+            }
+        }
+        simulateCleanup();
+        fprintf(report, "%d inputs replayed, all invariants held.\n", argc - optind);
+        return 0;
+    }
+
+    SimStats stats = {0};
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (unsigned long i = 0; i < seeds; i++)
+    {
+        simulateSeed(seed + i, operations, &stats);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    simulateCleanup();
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(report, "%lu seeds from %lu, %lu operations in %.1f s (%.0f per second): %lu crashes, %lu restarts, "
+                    "%lu compactions; all invariants held.\n",
+            seeds, seed, stats.operations, seconds, seconds > 0 ? stats.operations / seconds : 0, stats.crashes,
+            stats.restarts, stats.compactions);
+    return 0;
+}
+
+#endif // BANK_FUZZ
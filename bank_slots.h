@@ -0,0 +1,94 @@
+// Slot bookkeeping for the account table: an index from account number to
+// slot, and the free list of slots that compaction has emptied
+
+#ifndef BANK_SLOTS_H
+#define BANK_SLOTS_H
+
+#include "bank_common.h"
+#include "bank_ratelimit.h"
+
+#define SLOT_BUCKETS (MAX_ACCOUNTS * 2)
+
+// Every slot holding an account, open or closed, is in the index; a free
+// slot has an empty account number and is on the free list instead. Opening
+// an account takes a free slot before growing the table, so closed
+// accounts stop costing room once they are archived.
+typedef struct
+{
+    int buckets[SLOT_BUCKETS];
+    int next[MAX_ACCOUNTS]; // Next slot in the same bucket, or -1
+    int freeSlots[MAX_ACCOUNTS];
+    int freeCount;
+} AccountSlots;
+
+unsigned long slotBucket(const char *accountNumber)
+{
+    return hashKey(accountNumber) % SLOT_BUCKETS;
+}
+
+void slotsAdd(AccountSlots *slots, const Account *accounts, int slot)
+{
+    int *bucket = &slots->buckets[slotBucket(accounts[slot].accountNumber)];
+    slots->next[slot] = *bucket;
+    *bucket = slot;
+}
+
+// Index a freshly loaded table, putting slots without an account on the
+// free list. Returns the number of closed accounts it holds.
+int slotsBuild(AccountSlots *slots, const Account *accounts, int count)
+{
+    int closed = 0;
+    for (int i = 0; i < SLOT_BUCKETS; i++)
+    {
+        slots->buckets[i] = -1;
+    }
+    slots->freeCount = 0;
+    for (int slot = count - 1; slot >= 0; slot--)
+    {
+        if (accounts[slot].accountNumber[0] == '\0')
+        {
+            slots->freeSlots[slots->freeCount++] = slot;
+            continue;
+        }
+        slotsAdd(slots, accounts, slot);
+        closed += !accounts[slot].isActive;
+    }
+    return closed;
+}
+
+// Find the slot holding an account number, or -1
+int slotsFind(const AccountSlots *slots, const Account *accounts, const char *accountNumber)
+{
+    for (int slot = slots->buckets[slotBucket(accountNumber)]; slot >= 0; slot = slots->next[slot])
+    {
+        if (strcmp(accounts[slot].accountNumber, accountNumber) == 0)
+        {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+// Take a free slot, or -1 when there is none
+int slotsTake(AccountSlots *slots)
+{
+    return slots->freeCount > 0 ? slots->freeSlots[--slots->freeCount] : -1;
+}
+
+// Empty a slot and put it on the free list
+void slotsRelease(AccountSlots *slots, Account *accounts, int slot)
+{
+    int *link = &slots->buckets[slotBucket(accounts[slot].accountNumber)];
+    while (*link >= 0 && *link != slot)
+    {
+        link = &slots->next[*link];
+    }
+    if (*link == slot)
+    {
+        *link = slots->next[slot];
+    }
+    memset(&accounts[slot], 0, sizeof(Account));
+    slots->freeSlots[slots->freeCount++] = slot;
+}
+
+#endif // BANK_SLOTS_H
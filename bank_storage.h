@@ -0,0 +1,607 @@
+// Versioned, checksummed account database file shared by both servers and
+// bank_migrate
+
+#ifndef BANK_STORAGE_H
+#define BANK_STORAGE_H
+
+#include <fcntl.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "bank_common.h"
+#include "bank_auth.h"
+#include "bank_history.h"
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#define STORAGE_MAGIC "BNKDATA"
+#define STORAGE_VERSION 4
+#define STORAGE_UNCOMPRESSED_VERSION 1 // History as full Transaction records
+#define STORAGE_UNACCRUED_VERSION 2    // Before accruedPeriod; the same size, so it was padding
+#define STORAGE_UNTAGGED_VERSION 3     // Before request IDs in history; read as is
+#define STORAGE_BYTE_ORDER 0x01020304U // Reads back differently on a host of the other endianness
+#define STORAGE_BLOCK_ACCOUNTS 16
+#define STORAGE_MAX_THREADS 8
+#define STORAGE_TEMP_SUFFIX ".tmp"
+#define ARCHIVE_FILE_SUFFIX ".archive"
+
+// File layout: a header, then blocks of up to STORAGE_BLOCK_ACCOUNTS raw
+// Account records, each behind its own header. Every block but the last is
+// full, so block n starts at a known offset and blocks can be checked in
+// parallel. Files from a build with a different Account layout are refused
+// rather than misread, except version 1 to 3 files, which are converted.
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint32_t accountSize; // sizeof(Account) of the build that wrote the file
+    uint32_t blockAccounts;
+    uint32_t accountCount;
+    uint32_t blockCount;
+    uint32_t checksum; // CRC32C of the fields above
+    uint32_t reserved;
+} StorageHeader;
+
+typedef struct
+{
+    uint32_t index;
+    uint32_t count;
+    uint32_t checksum; // CRC32C of the count accounts that follow
+    uint32_t reserved;
+} StorageBlockHeader;
+
+// CRC32C (Castagnoli), with the SSE4.2 instruction where the CPU has it
+static uint32_t crc32cTable[256];
+static pthread_once_t crc32cTableOnce = PTHREAD_ONCE_INIT;
+
+void buildCrc32cTable()
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+        }
+        crc32cTable[i] = crc;
+    }
+}
+
+uint32_t crc32cSoftware(uint32_t crc, const unsigned char *data, size_t length)
+{
+    pthread_once(&crc32cTableOnce, buildCrc32cTable);
+    while (length-- > 0)
+    {
+        crc = crc32cTable[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) uint32_t crc32cHardware(uint32_t crc, const unsigned char *data, size_t length)
+{
+    uint64_t wide = crc;
+    for (; length >= 8; data += 8, length -= 8)
+    {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        wide = _mm_crc32_u64(wide, word);
+    }
+    crc = (uint32_t)wide;
+    for (; length > 0; data++, length--)
+    {
+        crc = _mm_crc32_u8(crc, *data);
+    }
+    return crc;
+}
+#endif
+
+uint32_t crc32c(const void *data, size_t length)
+{
+    uint32_t crc = 0xffffffff;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        return ~crc32cHardware(crc, data, length);
+    }
+#endif
+    return ~crc32cSoftware(crc, data, length);
+}
+
+// Account layout before PINs were hashed
+typedef struct
+{
+    char accountNumber[ACC_NUM_LENGTH + 1];
+    char pin[PIN_LENGTH + 1];
+    char name[MAX_NAME_LENGTH + 1];
+    char nationalID[ID_LENGTH + 1];
+    AccountType type;
+    double balance;
+    Transaction transactions[MAX_TRANSACTIONS];
+    int transactionCount;
+    int isActive;
+} LegacyAccount;
+
+// Account layout of format version 1, and of unversioned files written once
+// PINs were hashed: the history as full Transaction records
+typedef struct
+{
+    char accountNumber[ACC_NUM_LENGTH + 1];
+    unsigned char pinSalt[PIN_SALT_LENGTH];
+    unsigned char pinHash[PIN_HASH_LENGTH];
+    char name[MAX_NAME_LENGTH + 1];
+    char nationalID[ID_LENGTH + 1];
+    AccountType type;
+    double balance;
+    Transaction transactions[MAX_TRANSACTIONS];
+    int transactionCount;
+    int isActive;
+} UncompressedAccount;
+
+// Fill in the fields every older layout shares and encode its history
+void copyOlderAccount(Account *account, const char *accountNumber, const char *name, const char *nationalID,
+                      AccountType type, double balance, int isActive, const Transaction *transactions, int count)
+{
+    memset(account, 0, sizeof(Account));
+    memcpy(account->accountNumber, accountNumber, ACC_NUM_LENGTH);
+    memcpy(account->name, name, MAX_NAME_LENGTH);
+    memcpy(account->nationalID, nationalID, ID_LENGTH);
+    account->type = type;
+    account->balance = balance;
+    account->isActive = isActive;
+    for (int i = 0; i < count && i < MAX_TRANSACTIONS; i++)
+    {
+        Transaction transaction = transactions[i];
+        transaction.description[sizeof(transaction.description) - 1] = '\0';
+        appendHistory(account, transaction.timestamp, transaction.type, transaction.amount, transaction.description);
+    }
+}
+
+void convertUncompressedAccount(Account *account, const UncompressedAccount *old)
+{
+    copyOlderAccount(account, old->accountNumber, old->name, old->nationalID, old->type, old->balance, old->isActive,
+                     old->transactions, old->transactionCount);
+    memcpy(account->pinSalt, old->pinSalt, PIN_SALT_LENGTH);
+    memcpy(account->pinHash, old->pinHash, PIN_HASH_LENGTH);
+}
+
+void convertLegacyAccount(Account *account, const LegacyAccount *old)
+{
+    char pin[PIN_LENGTH + 1];
+    copyOlderAccount(account, old->accountNumber, old->name, old->nationalID, old->type, old->balance, old->isActive,
+                     old->transactions, old->transactionCount);
+    memcpy(pin, old->pin, PIN_LENGTH);
+    pin[PIN_LENGTH] = '\0';
+    setAccountPIN(account, pin);
+}
+
+// Read the account count and accounts from an unversioned database file,
+// converting them to the current layout (and plaintext PINs to hashes).
+// Returns the number of accounts, or -1 when the file matches neither
+// older layout.
+int readAccountFile(FILE *file, Account *accounts, int maxAccounts)
+{
+    int count = 0;
+    struct stat st;
+    if (fread(&count, sizeof(int), 1, file) != 1 || count < 0 || count > maxAccounts)
+    {
+        return -1;
+    }
+
+    fstat(fileno(file), &st);
+    int legacy = st.st_size == (off_t)(sizeof(int) + count * sizeof(LegacyAccount));
+    if (!legacy && st.st_size != (off_t)(sizeof(int) + count * sizeof(UncompressedAccount)))
+    {
+        return -1;
+    }
+    if (legacy)
+    {
+        printf("Converting %d accounts to hashed PINs...\n", count);
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        union
+        {
+            LegacyAccount legacy;
+            UncompressedAccount uncompressed;
+        } old;
+        if (fread(&old, legacy ? sizeof(LegacyAccount) : sizeof(UncompressedAccount), 1, file) != 1)
+        {
+            return -1;
+        }
+        if (legacy)
+        {
+            convertLegacyAccount(&accounts[i], &old.legacy);
+        }
+        else
+        {
+            convertUncompressedAccount(&accounts[i], &old.uncompressed);
+        }
+    }
+    return count;
+}
+
+// Whether an account read from disk is internally consistent
+int accountRecordValid(const Account *account)
+{
+    return memchr(account->accountNumber, '\0', sizeof(account->accountNumber)) != NULL &&
+           memchr(account->name, '\0', sizeof(account->name)) != NULL &&
+           memchr(account->nationalID, '\0', sizeof(account->nationalID)) != NULL &&
+           (account->type == SAVINGS || account->type == CHECKING) &&
+           (account->isActive == 0 || account->isActive == 1) && historyValid(account);
+}
+
+// Write the accounts to path, replacing it only once the new file is
+// complete and on disk. Returns 0 on success, -1 on error.
+int saveAccountFile(const char *path, const Account *accounts, int count)
+{
+    char tempPath[512];
+    snprintf(tempPath, sizeof(tempPath), "%s%s", path, STORAGE_TEMP_SUFFIX);
+    FILE *file = fopen(tempPath, "wb");
+    if (file == NULL)
+    {
+        return -1;
+    }
+
+    StorageHeader header = {0};
+    memcpy(header.magic, STORAGE_MAGIC, sizeof(STORAGE_MAGIC));
+    header.version = STORAGE_VERSION;
+    header.byteOrder = STORAGE_BYTE_ORDER;
+    header.accountSize = sizeof(Account);
+    header.blockAccounts = STORAGE_BLOCK_ACCOUNTS;
+    header.accountCount = count;
+    header.blockCount = (count + STORAGE_BLOCK_ACCOUNTS - 1) / STORAGE_BLOCK_ACCOUNTS;
+    header.checksum = crc32c(&header, offsetof(StorageHeader, checksum));
+    int failed = fwrite(&header, sizeof(header), 1, file) != 1;
+
+    for (uint32_t i = 0; i < header.blockCount && !failed; i++)
+    {
+        StorageBlockHeader block = {0};
+        const Account *first = &accounts[i * STORAGE_BLOCK_ACCOUNTS];
+        block.index = i;
+        block.count = count - i * STORAGE_BLOCK_ACCOUNTS;
+        if (block.count > STORAGE_BLOCK_ACCOUNTS)
+        {
+            block.count = STORAGE_BLOCK_ACCOUNTS;
+        }
+        block.checksum = crc32c(first, block.count * sizeof(Account));
+        failed = fwrite(&block, sizeof(block), 1, file) != 1 ||
+                 fwrite(first, sizeof(Account), block.count, file) != block.count;
+    }
+
+    failed = fflush(file) != 0 || fdatasync(fileno(file)) != 0 || failed;
+    failed = fclose(file) != 0 || failed;
+    if (failed || rename(tempPath, path) != 0)
+    {
+        int saved = errno;
+        unlink(tempPath);
+        errno = saved;
+        return -1;
+    }
+    return 0;
+}
+
+// Find one account in a file whose accounts were written in account number
+// order, reading only the numbers a binary search visits and the block the
+// account is in, whose checksum is checked. Returns 1 and fills account
+// when it is there, 0 when it is not, or -1 on error.
+int findStoredAccount(const char *path, const char *accountNumber, Account *account)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    StorageHeader header;
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, STORAGE_MAGIC, sizeof(STORAGE_MAGIC)) != 0 ||
+        (header.version != STORAGE_VERSION && header.version != STORAGE_UNTAGGED_VERSION) ||
+        header.accountSize != sizeof(Account) || header.blockAccounts != STORAGE_BLOCK_ACCOUNTS ||
+        header.checksum != crc32c(&header, offsetof(StorageHeader, checksum)))
+    {
+        close(fd);
+        errno = EBADMSG;
+        return -1;
+    }
+
+    size_t stride = sizeof(StorageBlockHeader) + STORAGE_BLOCK_ACCOUNTS * sizeof(Account);
+    int low = 0;
+    int high = (int)header.accountCount - 1;
+    int found = -1;
+    while (low <= high && found < 0)
+    {
+        int middle = low + (high - low) / 2;
+        char number[ACC_NUM_LENGTH + 1];
+        off_t at = sizeof(StorageHeader) + (middle / STORAGE_BLOCK_ACCOUNTS) * stride + sizeof(StorageBlockHeader) +
+                   (middle % STORAGE_BLOCK_ACCOUNTS) * sizeof(Account);
+        if (pread(fd, number, sizeof(number), at + offsetof(Account, accountNumber)) != sizeof(number))
+        {
+            close(fd);
+            return -1;
+        }
+        number[ACC_NUM_LENGTH] = '\0';
+        int order = strcmp(number, accountNumber);
+        if (order == 0)
+            found = middle;
+        else if (order < 0)
+            low = middle + 1;
+        else
+            high = middle - 1;
+    }
+    if (found < 0)
+    {
+        close(fd);
+        return 0;
+    }
+
+    int block = found / STORAGE_BLOCK_ACCOUNTS;
+    unsigned char *data = malloc(stride);
+    StorageBlockHeader blockHeader;
+    ssize_t got = data != NULL ? pread(fd, data, stride, sizeof(StorageHeader) + block * stride) : -1;
+    int ok = got >= (ssize_t)sizeof(blockHeader);
+    if (ok)
+    {
+        memcpy(&blockHeader, data, sizeof(blockHeader));
+        ok = blockHeader.index == (uint32_t)block && blockHeader.count <= STORAGE_BLOCK_ACCOUNTS &&
+             got >= (ssize_t)(sizeof(blockHeader) + blockHeader.count * sizeof(Account)) &&
+             crc32c(data + sizeof(blockHeader), blockHeader.count * sizeof(Account)) == blockHeader.checksum;
+    }
+    if (ok)
+    {
+        memcpy(account, data + sizeof(blockHeader) + (found % STORAGE_BLOCK_ACCOUNTS) * sizeof(Account), sizeof(Account));
+    }
+    free(data);
+    close(fd);
+    if (!ok)
+    {
+        errno = EBADMSG;
+        return -1;
+    }
+    return 1;
+}
+
+// Closed accounts moved out of the database file by compaction, appended
+// as raw Account records each behind this header. An account can appear
+// twice if the server stopped between archiving it and rewriting the
+// database file; both copies are the same.
+typedef struct
+{
+    uint32_t accountSize;
+    uint32_t checksum; // CRC32C of the account that follows
+    time_t archivedAt;
+} ArchiveRecordHeader;
+
+// Append accounts to the archive at path and wait for them to reach the
+// disk. Returns 0, or -1 on error.
+int appendAccountArchive(const char *path, const Account *accounts, int count, time_t now)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    int failed = 0;
+    for (int i = 0; i < count && !failed; i++)
+    {
+        ArchiveRecordHeader header = {sizeof(Account), crc32c(&accounts[i], sizeof(Account)), now};
+        struct iovec iov[2] = {{&header, sizeof(header)}, {(void *)&accounts[i], sizeof(Account)}};
+        failed = writev(fd, iov, 2) != (ssize_t)(sizeof(header) + sizeof(Account));
+    }
+    failed = fdatasync(fd) != 0 || failed;
+    failed = close(fd) != 0 || failed;
+    return failed ? -1 : 0;
+}
+
+// Count the accounts in the archive at path, 0 when there is none yet
+int countAccountArchive(const char *path)
+{
+    struct stat st;
+    if (stat(path, &st) < 0)
+    {
+        return errno == ENOENT ? 0 : -1;
+    }
+    return st.st_size / (sizeof(ArchiveRecordHeader) + sizeof(Account));
+}
+
+// Work shared by the loader threads. Each checks every threads-th block.
+typedef struct
+{
+    const unsigned char *file;
+    const StorageHeader *header;
+    Account *accounts;
+    int first;
+    int threads;
+    int bad; // First damaged block found, or -1
+} StorageLoad;
+
+void *loadStorageBlocks(void *arg)
+{
+    StorageLoad *load = arg;
+    size_t recordSize = load->header->accountSize;
+    size_t stride = sizeof(StorageBlockHeader) + STORAGE_BLOCK_ACCOUNTS * recordSize;
+    for (uint32_t i = load->first; i < load->header->blockCount; i += load->threads)
+    {
+        const unsigned char *at = load->file + sizeof(StorageHeader) + i * stride;
+        StorageBlockHeader block;
+        memcpy(&block, at, sizeof(block));
+        uint32_t expected = load->header->accountCount - i * STORAGE_BLOCK_ACCOUNTS;
+        if (expected > STORAGE_BLOCK_ACCOUNTS)
+        {
+            expected = STORAGE_BLOCK_ACCOUNTS;
+        }
+        if (block.index != i || block.count != expected ||
+            crc32c(at + sizeof(block), block.count * recordSize) != block.checksum)
+        {
+            load->bad = i;
+            return NULL;
+        }
+
+        Account *accounts = &load->accounts[i * STORAGE_BLOCK_ACCOUNTS];
+        if (load->header->version == STORAGE_UNCOMPRESSED_VERSION)
+        {
+            for (uint32_t j = 0; j < block.count; j++)
+            {
+                UncompressedAccount old;
+                memcpy(&old, at + sizeof(block) + j * recordSize, sizeof(old));
+                convertUncompressedAccount(&accounts[j], &old);
+            }
+        }
+        else
+        {
+            memcpy(accounts, at + sizeof(block), block.count * sizeof(Account));
+            for (uint32_t j = 0; load->header->version == STORAGE_UNACCRUED_VERSION && j < block.count; j++)
+            {
+                accounts[j].accruedPeriod = 0;
+            }
+        }
+        for (uint32_t j = 0; j < block.count; j++)
+        {
+            if (!accountRecordValid(&accounts[j]))
+            {
+                load->bad = i;
+                return NULL;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Check a file mapped at data against its header and load its accounts,
+// checking the blocks on several threads. Sets *converted for a version 1
+// to 3 file. Returns the account count, or -1 after reporting what is wrong.
+int loadStorageImage(const char *path, const unsigned char *data, size_t size, Account *accounts, int maxAccounts,
+                     int *converted)
+{
+    StorageHeader header;
+    memcpy(&header, data, sizeof(header));
+    if (header.byteOrder != STORAGE_BYTE_ORDER)
+    {
+        fprintf(stderr, "%s was written on a host of the other byte order.\n", path);
+        return -1;
+    }
+    if (header.checksum != crc32c(&header, offsetof(StorageHeader, checksum)))
+    {
+        fprintf(stderr, "%s: header checksum mismatch; the file is damaged.\n", path);
+        return -1;
+    }
+    *converted = (header.version == STORAGE_UNCOMPRESSED_VERSION && header.accountSize == sizeof(UncompressedAccount)) ||
+                 ((header.version == STORAGE_UNACCRUED_VERSION || header.version == STORAGE_UNTAGGED_VERSION) &&
+                  header.accountSize == sizeof(Account));
+    if (!*converted && (header.version != STORAGE_VERSION || header.accountSize != sizeof(Account)))
+    {
+        fprintf(stderr, "%s has format version %u with %u-byte accounts; this build reads version %d with %zu-byte accounts.\n",
+                path, header.version, header.accountSize, STORAGE_VERSION, sizeof(Account));
+        return -1;
+    }
+    if (header.blockAccounts != STORAGE_BLOCK_ACCOUNTS || header.accountCount > (uint32_t)maxAccounts ||
+        header.blockCount != (header.accountCount + STORAGE_BLOCK_ACCOUNTS - 1) / STORAGE_BLOCK_ACCOUNTS ||
+        size != sizeof(StorageHeader) + header.blockCount * sizeof(StorageBlockHeader) +
+                    (size_t)header.accountCount * header.accountSize)
+    {
+        fprintf(stderr, "%s: %u accounts do not fit a %zu-byte file of at most %d accounts; it is damaged or truncated.\n",
+                path, header.accountCount, size, maxAccounts);
+        return -1;
+    }
+
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > STORAGE_MAX_THREADS)
+        threads = STORAGE_MAX_THREADS;
+    if (threads > (int)header.blockCount)
+        threads = header.blockCount;
+    if (threads < 1)
+        threads = 1;
+
+    StorageLoad loads[STORAGE_MAX_THREADS];
+    pthread_t workers[STORAGE_MAX_THREADS];
+    for (int i = 0; i < threads; i++)
+    {
+        loads[i] = (StorageLoad){data, &header, accounts, i, threads, -1};
+        if (i > 0 && pthread_create(&workers[i], NULL, loadStorageBlocks, &loads[i]) != 0)
+        {
+            loads[i].threads = 0; // Not started; the calling thread covers its blocks below
+        }
+    }
+    loadStorageBlocks(&loads[0]);
+    for (int i = 1; i < threads; i++)
+    {
+        if (loads[i].threads == 0)
+        {
+            loads[i].threads = threads;
+            loadStorageBlocks(&loads[i]);
+        }
+        else
+        {
+            pthread_join(workers[i], NULL);
+        }
+    }
+
+    for (int i = 0; i < threads; i++)
+    {
+        if (loads[i].bad >= 0)
+        {
+            fprintf(stderr, "%s: block %d (accounts %d-%d) failed its checksum or holds invalid records.\n",
+                    path, loads[i].bad, loads[i].bad * STORAGE_BLOCK_ACCOUNTS + 1,
+                    loads[i].bad * STORAGE_BLOCK_ACCOUNTS + STORAGE_BLOCK_ACCOUNTS);
+            return -1;
+        }
+    }
+    return header.accountCount;
+}
+
+// Load the accounts in path. Files in an older format are still read, and
+// *converted is set so the caller saves them in the current one. Returns the account count, or -1 with errno ENOENT when there is no
+// file or EBADMSG when it cannot be trusted (the reason is printed).
+int loadAccountFile(const char *path, Account *accounts, int maxAccounts, int *converted)
+{
+    *converted = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    struct stat st;
+    StorageHeader header;
+    if (fstat(fd, &st) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size < (off_t)sizeof(header) || pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, STORAGE_MAGIC, sizeof(STORAGE_MAGIC)) != 0)
+    {
+        // A bare count followed by raw accounts
+        FILE *file = fdopen(fd, "rb");
+        int count = readAccountFile(file, accounts, maxAccounts);
+        fclose(file);
+        if (count < 0)
+        {
+            fprintf(stderr, "%s is neither a versioned database nor a valid older one.\n", path);
+            errno = EBADMSG;
+            return -1;
+        }
+        *converted = 1;
+        return count;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        return -1;
+    }
+    int count = loadStorageImage(path, data, st.st_size, accounts, maxAccounts, converted);
+    munmap(data, st.st_size);
+    if (count < 0)
+    {
+        errno = EBADMSG;
+    }
+    return count;
+}
+
+#endif // BANK_STORAGE_H
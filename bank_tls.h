@@ -0,0 +1,284 @@
+// Encrypted transport over OpenSSL. Build with -DBANK_TLS and link with
+// -lssl -lcrypto; without it every connection is plain TCP.
+
+#ifndef BANK_TLS_H
+#define BANK_TLS_H
+
+#ifdef BANK_TLS
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#define TLS_MAX_SOCKETS 1024      // Descriptors a TLS session can be kept for
+#define TLS_RECORD_BYTES 16384    // Plaintext one TLS record holds
+#define TLS_HANDSHAKE_TIMEOUT 10  // Seconds a peer may take over the handshake
+
+// The TLS session on each socket, by descriptor, or NULL for a plain one.
+// recvAll, sendAll and sendResponse look sockets up here, so the code above
+// them does not care whether a connection is encrypted. When the kernel
+// took over encrypting writes (kTLS), plain sendmsg on the socket sends TLS
+// records, so responses are still gathered straight from the account store
+// without being copied into a record buffer first.
+SSL *tls_sessions[TLS_MAX_SOCKETS];
+int tls_kernel_send[TLS_MAX_SOCKETS];
+
+SSL *tlsSession(int socket)
+{
+    return socket >= 0 && socket < TLS_MAX_SOCKETS ? tls_sessions[socket] : NULL;
+}
+
+int tlsKernelSend(int socket)
+{
+    return tlsSession(socket) != NULL && tls_kernel_send[socket];
+}
+
+// Records already read off the socket and waiting in OpenSSL; poll cannot
+// see those
+int tlsPending(int socket)
+{
+    SSL *ssl = tlsSession(socket);
+    return ssl != NULL && SSL_has_pending(ssl);
+}
+
+// Did the handshake resume an earlier session instead of doing a full one?
+int tlsResumed(int socket)
+{
+    SSL *ssl = tlsSession(socket);
+    return ssl != NULL && SSL_session_reused(ssl);
+}
+
+int tlsRetryable(SSL *ssl, int result)
+{
+    int error = SSL_get_error(ssl, result);
+    return error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE ||
+           (error == SSL_ERROR_SYSCALL && errno == EINTR);
+}
+
+// Receive exactly length bytes. Returns 0, or -1 on error or disconnect.
+int tlsRecvAll(SSL *ssl, void *buffer, size_t length)
+{
+    char *next = buffer;
+    while (length > 0)
+    {
+        int received = SSL_read(ssl, next, length > INT32_MAX ? INT32_MAX : (int)length);
+        if (received <= 0)
+        {
+            if (tlsRetryable(ssl, received))
+                continue;
+            return -1;
+        }
+        next += received;
+        length -= received;
+    }
+    return 0;
+}
+
+// Send all of buffer. Returns 0, or -1 on error.
+int tlsSendAll(SSL *ssl, const void *buffer, size_t length)
+{
+    const char *next = buffer;
+    while (length > 0)
+    {
+        int sent = SSL_write(ssl, next, length > INT32_MAX ? INT32_MAX : (int)length);
+        if (sent <= 0)
+        {
+            if (tlsRetryable(ssl, sent))
+                continue;
+            return -1;
+        }
+        next += sent;
+        length -= sent;
+    }
+    return 0;
+}
+
+// Send iovecs as few full records rather than one record per iovec: the
+// response header and its payload usually fit in a single one.
+int tlsSendv(SSL *ssl, const struct iovec *iov, int iovcnt)
+{
+    char record[TLS_RECORD_BYTES];
+    size_t used = 0;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        const char *data = iov[i].iov_base;
+        size_t left = iov[i].iov_len;
+        while (left > 0)
+        {
+            size_t chunk = left < sizeof(record) - used ? left : sizeof(record) - used;
+            memcpy(record + used, data, chunk);
+            used += chunk;
+            data += chunk;
+            left -= chunk;
+            if (used == sizeof(record))
+            {
+                if (tlsSendAll(ssl, record, used) < 0)
+                    return -1;
+                used = 0;
+            }
+        }
+    }
+    return used > 0 ? tlsSendAll(ssl, record, used) : 0;
+}
+
+// Wrap a connected socket in a finished handshake and remember the session
+// for it. Returns 0, or -1 after reporting why the handshake failed.
+int tlsAttach(SSL *ssl, int socket, int server)
+{
+    if (socket >= TLS_MAX_SOCKETS || SSL_set_fd(ssl, socket) != 1)
+    {
+        SSL_free(ssl);
+        return -1;
+    }
+
+    // A peer that stalls mid-handshake must not hold the connection forever
+    struct timeval timeout = {TLS_HANDSHAKE_TIMEOUT, 0};
+    struct timeval none = {0, 0};
+    setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    int result;
+    do
+    {
+        result = server ? SSL_accept(ssl) : SSL_connect(ssl);
+    } while (result <= 0 && SSL_get_error(ssl, result) == SSL_ERROR_SYSCALL && errno == EINTR);
+    setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &none, sizeof(none));
+    setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &none, sizeof(none));
+
+    if (result != 1)
+    {
+        ERR_print_errors_fp(stderr);
+        SSL_free(ssl);
+        return -1;
+    }
+    tls_sessions[socket] = ssl;
+    tls_kernel_send[socket] = BIO_get_ktls_send(SSL_get_wbio(ssl)) > 0;
+    return 0;
+}
+
+// Say goodbye and forget the session on a socket; the caller closes it
+void tlsDetach(int socket)
+{
+    SSL *ssl = tlsSession(socket);
+    if (ssl != NULL)
+    {
+        SSL_shutdown(ssl);
+        SSL_free(ssl);
+        tls_sessions[socket] = NULL;
+    }
+}
+
+SSL_CTX *tlsNewContext(const SSL_METHOD *method)
+{
+    SSL_CTX *ctx = SSL_CTX_new(method);
+    if (ctx != NULL)
+    {
+        SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+        // Hand record encryption to the kernel once the handshake is done,
+        // where it supports that for the negotiated cipher
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+        // Read whole records at once instead of header and body separately
+        SSL_CTX_set_read_ahead(ctx, 1);
+    }
+    return ctx;
+}
+
+// Server context with the certificate chain and key from PEM files. Make it
+// before forking: children inherit its session ticket key, so a client
+// resumes with a ticket from any child and skips the full handshake. There
+// is no server-side session cache, since forked children could not share
+// one. Returns NULL after reporting the error.
+SSL_CTX *tlsServerContext(const char *certFile, const char *keyFile)
+{
+    SSL_CTX *ctx = tlsNewContext(TLS_server_method());
+    if (ctx == NULL || SSL_CTX_use_certificate_chain_file(ctx, certFile) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, keyFile, SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(ctx) != 1)
+    {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    return ctx;
+}
+
+int tlsAccept(SSL_CTX *ctx, int socket)
+{
+    SSL *ssl = SSL_new(ctx);
+    return ssl != NULL ? tlsAttach(ssl, socket, 1) : -1;
+}
+
+// Keep the newest ticket the server sent in the slot the connection was
+// given; TLS 1.3 tickets arrive after the handshake, with the first answer
+int tlsRememberSession(SSL *ssl, SSL_SESSION *session)
+{
+    SSL_SESSION **slot = SSL_get_app_data(ssl);
+    if (slot == NULL)
+    {
+        return 0;
+    }
+    if (*slot != NULL)
+    {
+        SSL_SESSION_free(*slot);
+    }
+    *slot = session;
+    return 1; // The slot keeps the reference
+}
+
+// Client context that trusts the certificates in caFile, or the system's
+// when it is NULL. Returns NULL after reporting the error.
+SSL_CTX *tlsClientContext(const char *caFile)
+{
+    SSL_CTX *ctx = tlsNewContext(TLS_client_method());
+    if (ctx == NULL ||
+        (caFile != NULL ? SSL_CTX_load_verify_locations(ctx, caFile, NULL) : SSL_CTX_set_default_verify_paths(ctx)) != 1)
+    {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, tlsRememberSession);
+    return ctx;
+}
+
+// Handshake with the server at host on a connected socket, checking its
+// certificate names host. With resume set, offer the session kept there and
+// keep the server's next ticket in it; NULL forces a full handshake.
+// Returns 0, or -1 after reporting the error.
+int tlsConnect(SSL_CTX *ctx, int socket, const char *host, SSL_SESSION **resume)
+{
+    SSL *ssl = SSL_new(ctx);
+    if (ssl == NULL)
+    {
+        return -1;
+    }
+    struct in_addr address;
+    if (inet_pton(AF_INET, host, &address) == 1)
+    {
+        X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), host);
+    }
+    else
+    {
+        SSL_set_tlsext_host_name(ssl, host);
+        SSL_set1_host(ssl, host);
+    }
+    SSL_set_app_data(ssl, resume);
+    if (resume != NULL && *resume != NULL)
+    {
+        SSL_set_session(ssl, *resume);
+    }
+    return tlsAttach(ssl, socket, 0);
+}
+
+#endif // BANK_TLS
+
+#endif // BANK_TLS_H
@@ -0,0 +1,147 @@
+// Tracing of where requests spend their time, switched on at compile time.
+// Build with -DBANK_TRACE to record spans into a ring per thread; without
+// it the TRACE_ macros compile to nothing.
+
+#ifndef BANK_TRACE_H
+#define BANK_TRACE_H
+
+#ifdef BANK_TRACE
+
+#include <signal.h>
+#include <sys/syscall.h>
+#include "bank_common.h"
+
+#define TRACE_RING_SIZE 16384 // Spans kept per thread; the oldest are overwritten
+#define TRACE_MAX_THREADS 256
+
+// One finished span. The name is a string literal, so only the pointer is kept.
+typedef struct
+{
+    const char *name;
+    uint64_t start; // CLOCK_MONOTONIC nanoseconds
+    uint32_t duration;
+    int arg;
+} TraceSpan;
+
+typedef struct
+{
+    pid_t tid;
+    uint64_t head; // Spans ever recorded; the next goes to head % TRACE_RING_SIZE
+    TraceSpan spans[TRACE_RING_SIZE];
+} TraceRing;
+
+__thread TraceRing *trace_ring = NULL;
+TraceRing *trace_rings[TRACE_MAX_THREADS]; // Every thread's ring, for dumping
+int trace_ring_count = 0;
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+volatile sig_atomic_t trace_dump_requested = 0;
+
+uint64_t traceNow()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Give the calling thread its ring. Returns NULL once TRACE_MAX_THREADS
+// threads have one.
+TraceRing *traceAttach()
+{
+    pthread_mutex_lock(&trace_lock);
+    if (trace_ring_count < TRACE_MAX_THREADS)
+    {
+        trace_ring = calloc(1, sizeof(TraceRing));
+        if (trace_ring != NULL)
+        {
+            trace_ring->tid = syscall(SYS_gettid);
+            trace_rings[trace_ring_count++] = trace_ring;
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+    return trace_ring;
+}
+
+// Record a span that started at start and ends now
+void traceRecord(const char *name, uint64_t start, int arg)
+{
+    TraceRing *ring = trace_ring != NULL ? trace_ring : traceAttach();
+    if (ring == NULL)
+    {
+        return;
+    }
+    TraceSpan *span = &ring->spans[ring->head % TRACE_RING_SIZE];
+    span->name = name;
+    span->start = start;
+    span->duration = traceNow() - start;
+    span->arg = arg;
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+// In a forked child, forget the parent's rings; the child's own threads
+// attach new ones
+void traceForked()
+{
+    pthread_mutex_init(&trace_lock, NULL);
+    trace_ring_count = 0;
+    trace_ring = NULL;
+}
+
+// Write every thread's spans to path as Chrome trace JSON, which
+// chrome://tracing and Perfetto open. Threads keep recording meanwhile, so
+// the oldest spans of a busy ring may come out torn. Returns 0, or -1 on error.
+int traceDump(const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+    {
+        return -1;
+    }
+
+    fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    const char *separator = "\n";
+    pthread_mutex_lock(&trace_lock);
+    for (int i = 0; i < trace_ring_count; i++)
+    {
+        TraceRing *ring = trace_rings[i];
+        uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        for (uint64_t n = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0; n < head; n++)
+        {
+            TraceSpan span = ring->spans[n % TRACE_RING_SIZE];
+            fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"arg\":%d}}",
+                    separator, span.name, span.start / 1e3, span.duration / 1e3, getpid(), ring->tid, span.arg);
+            separator = ",\n";
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+    fprintf(file, "\n]}\n");
+    return fclose(file) == 0 ? 0 : -1;
+}
+
+void handleTraceSignal(int sig)
+{
+    (void)sig;
+    trace_dump_requested = 1;
+}
+
+// SIGQUIT asks for a dump, which the process writes at its next check
+void installTraceHandler()
+{
+    struct sigaction sa;
+    sa.sa_handler = handleTraceSignal;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGQUIT, &sa, NULL);
+}
+
+// Mark the start of a span in a local variable, and record it at the end
+#define TRACE_BEGIN(span) uint64_t span = traceNow()
+#define TRACE_END(span, name, arg) traceRecord(name, span, arg)
+
+#else
+
+#define TRACE_BEGIN(span)
+#define TRACE_END(span, name, arg)
+
+#endif // BANK_TRACE
+
+#endif // BANK_TRACE_H
@@ -0,0 +1,183 @@
+// Minimal io_uring wrapper over the raw system calls, used by the reactors
+
+#ifndef BANK_URING_H
+#define BANK_URING_H
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "bank_common.h"
+
+// Submission and completion queues of one ring, mapped from the kernel
+typedef struct
+{
+    int fd;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned sqMask;
+    unsigned *sqArray;
+    struct io_uring_sqe *sqes;
+    unsigned queued; // Entries filled in but not yet submitted
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe *cqes;
+    void *sqRing;
+    size_t sqRingSize;
+    void *cqRing;
+    size_t cqRingSize;
+    size_t sqesSize;
+} Ring;
+
+// Create a ring with sqEntries submission and cqEntries completion slots.
+// Returns 0, or -1 with errno set when the kernel has no usable io_uring:
+// ENOSYS before 5.1, EPERM when it is disabled, EOPNOTSUPP when it lacks
+// the wait timeout (5.11) or overflow-free completions the reactors need.
+int ringSetup(Ring *ring, unsigned sqEntries, unsigned cqEntries)
+{
+    struct io_uring_params params = {0};
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = cqEntries;
+
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = syscall(__NR_io_uring_setup, sqEntries, &params);
+    if (ring->fd < 0)
+    {
+        return -1;
+    }
+    if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP))
+    {
+        close(ring->fd);
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqRing = mmap(NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    ring->cqRing = mmap(NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqRing == MAP_FAILED || ring->cqRing == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        int saved = errno;
+        close(ring->fd);
+        errno = saved;
+        return -1;
+    }
+
+    char *sq = ring->sqRing;
+    char *cq = ring->cqRing;
+    ring->sqHead = (unsigned *)(sq + params.sq_off.head);
+    ring->sqTail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sqMask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sqArray = (unsigned *)(sq + params.sq_off.array);
+    ring->cqHead = (unsigned *)(cq + params.cq_off.head);
+    ring->cqTail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cqMask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+}
+
+void ringClose(Ring *ring)
+{
+    munmap(ring->sqes, ring->sqesSize);
+    munmap(ring->cqRing, ring->cqRingSize);
+    munmap(ring->sqRing, ring->sqRingSize);
+    close(ring->fd);
+}
+
+// Hand the queued entries to the kernel and wait up to timeoutMs for at
+// least waitFor completions. Returns the number submitted, or -1.
+int ringSubmit(Ring *ring, unsigned waitFor, int timeoutMs)
+{
+    struct __kernel_timespec timeout = {timeoutMs / 1000, (timeoutMs % 1000) * 1000000L};
+    struct io_uring_getevents_arg arg = {0};
+    arg.ts = (unsigned long)&timeout;
+
+    unsigned flags = IORING_ENTER_EXT_ARG | (waitFor > 0 ? IORING_ENTER_GETEVENTS : 0);
+    int submitted = syscall(__NR_io_uring_enter, ring->fd, ring->queued, waitFor, flags, &arg, sizeof(arg));
+    if (submitted < 0)
+    {
+        // A timeout or signal still submitted nothing; keep the entries queued
+        return errno == ETIME || errno == EINTR ? 0 : -1;
+    }
+    ring->queued -= submitted;
+    return submitted;
+}
+
+// Next free submission entry, cleared. When the queue is full the pending
+// entries are submitted first to make room.
+struct io_uring_sqe *ringGetSqe(Ring *ring)
+{
+    unsigned tail = *ring->sqTail;
+    while (tail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) > ring->sqMask)
+    {
+        if (ringSubmit(ring, 0, 0) < 0)
+        {
+            return NULL;
+        }
+    }
+
+    unsigned index = tail & ring->sqMask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sqArray[index] = index;
+    __atomic_store_n(ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+    ring->queued++;
+    return sqe;
+}
+
+// Oldest unread completion, or NULL. Release it with ringSeen.
+struct io_uring_cqe *ringPeek(Ring *ring)
+{
+    unsigned head = *ring->cqHead;
+    if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE))
+    {
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cqMask];
+}
+
+void ringSeen(Ring *ring)
+{
+    __atomic_store_n(ring->cqHead, *ring->cqHead + 1, __ATOMIC_RELEASE);
+}
+
+// Register a table of count fixed files, all empty
+int ringRegisterFiles(Ring *ring, unsigned count)
+{
+    int *fds = malloc(count * sizeof(int));
+    if (fds == NULL)
+    {
+        return -1;
+    }
+    for (unsigned i = 0; i < count; i++)
+    {
+        fds[i] = -1;
+    }
+    int result = syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, fds, count);
+    free(fds);
+    return result;
+}
+
+// Put fd (or -1 to clear) into fixed file slot
+int ringSetFile(Ring *ring, unsigned slot, int fd)
+{
+    struct io_uring_files_update update = {0};
+    update.offset = slot;
+    update.fds = (unsigned long)&fd;
+    return syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES_UPDATE, &update, 1) == 1 ? 0 : -1;
+}
+
+// Pin memory as fixed buffer 0 so reads into it skip the per-call page mapping
+int ringRegisterBuffer(Ring *ring, void *buffer, size_t length)
+{
+    struct iovec iov = {buffer, length};
+    return syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, &iov, 1);
+}
+
+#endif // BANK_URING_H